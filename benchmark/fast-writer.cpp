@@ -0,0 +1,66 @@
+//          Copyright Maarten L. Hekkelman, 2022
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Compare writing formatted fields to a gzip file using operator<<
+// with using gxrio::fast_writer. Fast compression is used, to measure
+// the formatting overhead rather than the codec.
+//
+// usage: fast-writer [number-of-rows]
+
+#include <chrono>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include <gxrio.hpp>
+
+namespace fs = std::filesystem;
+
+using clock_type = std::chrono::steady_clock;
+using ofstream_type = gxrio::basic_ofstream<char, std::char_traits<char>, 64 * 1024>;
+
+constexpr int kFieldsPerRow = 4;
+
+double fields_per_second(clock_type::duration d, size_t rows)
+{
+	return rows * kFieldsPerRow / std::chrono::duration<double>(d).count();
+}
+
+int main(int argc, char *const argv[])
+{
+	size_t rows = argc > 1 ? std::stoul(argv[1]) : 2'000'000;
+
+	fs::path file = fs::temp_directory_path() / "gxrio-fast-writer.tsv.gz";
+
+	gxrio::compression_options options;
+	options.level = 1;
+
+	auto start = clock_type::now();
+	{
+		ofstream_type out(file, options);
+		for (size_t i = 0; i < rows; ++i)
+			out << i << '\t' << i * 0.5 << '\t' << "name" << '\t' << -static_cast<long>(i) << '\n';
+	}
+	auto stream_time = clock_type::now() - start;
+
+	start = clock_type::now();
+	{
+		ofstream_type out(file, options);
+		gxrio::fast_writer w(out);
+		for (size_t i = 0; i < rows; ++i)
+			w.append(i).append('\t').append(i * 0.5).append('\t').append("name").append('\t').append(-static_cast<long>(i)).append('\n');
+	}
+	auto writer_time = clock_type::now() - start;
+
+	std::cout << std::left << std::setw(14) << "operator<<" << std::right << std::setw(14) << std::fixed << std::setprecision(0)
+			  << fields_per_second(stream_time, rows) << " fields/s" << std::endl
+			  << std::left << std::setw(14) << "fast_writer" << std::right << std::setw(14)
+			  << fields_per_second(writer_time, rows) << " fields/s" << std::endl;
+
+	fs::remove(file);
+
+	return 0;
+}
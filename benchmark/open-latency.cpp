@@ -0,0 +1,93 @@
+//          Copyright Maarten L. Hekkelman, 2022
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Measure the latency of opening, reading the first byte and closing
+// many small compressed files, for each of the supported codecs.
+//
+// usage: open-latency [number-of-files]
+
+#include <chrono>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <gxrio.hpp>
+
+namespace fs = std::filesystem;
+
+using clock_type = std::chrono::steady_clock;
+
+double us_per_file(clock_type::duration d, size_t n)
+{
+	return std::chrono::duration<double, std::micro>(d).count() / n;
+}
+
+int main(int argc, char *const argv[])
+{
+	size_t count = argc > 1 ? std::stoul(argv[1]) : 1000;
+
+	fs::path dir = fs::temp_directory_path() / "gxrio-open-latency";
+	fs::create_directories(dir);
+
+	std::vector<std::string> extensions{ ".txt", ".gz" };
+#if HAVE_LibLZMA
+	extensions.push_back(".xz");
+#endif
+
+	std::cout << std::left << std::setw(8) << "codec"
+			  << std::right << std::setw(14) << "write (us)"
+			  << std::setw(14) << "open (us)"
+			  << std::setw(16) << "1st byte (us)" << std::endl;
+
+	for (auto &ext : extensions)
+	{
+		std::vector<fs::path> files;
+		for (size_t i = 0; i < count; ++i)
+			files.emplace_back(dir / ("file-" + std::to_string(i) + ext));
+
+		auto start = clock_type::now();
+		for (auto &f : files)
+		{
+			gxrio::ofstream out(f);
+			out << "Hello, world! - this is " << f.filename().string() << '\n';
+		}
+		auto write_time = clock_type::now() - start;
+
+		// open and close, e.g. to check if a file exists
+		start = clock_type::now();
+		for (auto &f : files)
+		{
+			gxrio::ifstream in(f);
+			if (not in.is_open())
+				return 1;
+		}
+		auto open_time = clock_type::now() - start;
+
+		// open, read the first byte and close
+		start = clock_type::now();
+		for (auto &f : files)
+		{
+			gxrio::ifstream in(f);
+			if (in.get() != 'H')
+				return 1;
+		}
+		auto first_byte_time = clock_type::now() - start;
+
+		std::cout << std::left << std::setw(8) << ext
+				  << std::right << std::fixed << std::setprecision(2)
+				  << std::setw(14) << us_per_file(write_time, count)
+				  << std::setw(14) << us_per_file(open_time, count)
+				  << std::setw(16) << us_per_file(first_byte_time, count) << std::endl;
+
+		for (auto &f : files)
+			fs::remove(f);
+	}
+
+	fs::remove(dir);
+
+	return 0;
+}
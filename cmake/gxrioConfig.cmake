@@ -25,6 +25,7 @@ endmacro()
 ####################################################################################
 
 include(CMakeFindDependencyMacro)
+find_dependency(Threads REQUIRED)
 find_dependency(ZLIB REQUIRED)
 find_dependency(LibLZMA REQUIRED)
 
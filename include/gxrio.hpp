@@ -5,16 +5,71 @@
 
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <future>
+#include <initializer_list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
 #include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+#if defined(_MSVC_LANG) ? _MSVC_LANG >= 202002L : __cplusplus >= 202002L
+#define GXRIO_CXX20 1
+#include <coroutine>
+#include <latch>
+#include <ranges>
+#include <span>
+#endif
 
 #include <zlib.h>
 #if HAVE_LibLZMA
 #include <lzma.h>
 #endif
+#if HAVE_Brotli
+#include <brotli/decode.h>
+#include <brotli/encode.h>
+#endif
 
 /// \file gxrio.hpp
 ///
@@ -36,6 +91,301 @@ const size_t kDefaultBufferSize = 256;
 
 // --------------------------------------------------------------------
 
+/// \brief Resource budgets for decompressing untrusted input
+///
+/// A value of zero means unlimited. The limits are checked each time
+/// a decompressing streambuf refills its buffer, so the overhead is
+/// negligible. When a limit is exceeded a gxrio::limit_exceeded exception
+/// is thrown from underflow. As usual for iostreams, that exception is
+/// caught by the istream which then sets the badbit. Call exceptions(std::ios::badbit)
+/// on the stream to have the exception propagated.
+
+struct decompression_limits
+{
+	/// \brief Maximum number of decompressed bytes
+	std::uint64_t max_output = 0;
+
+	/// \brief Maximum ratio between decompressed and compressed bytes
+	double max_ratio = 0;
+
+	/// \brief Maximum amount of memory the decoder may use, only xz has a variable amount
+	std::uint64_t memlimit = 0;
+
+	/// \brief Maximum time spent inside the decoder
+	std::chrono::milliseconds max_cpu_time{ 0 };
+};
+
+/// \brief Options for compressing data
+
+struct compression_options
+{
+	/// \brief The compression level, 0 to 9, for brotli this is the quality
+	/// from 0 to 11. A negative value selects the highest compression level,
+	/// which is the default.
+	int level = -1;
+
+	/// \brief The number of threads to use for compression, only xz supports this.
+	/// Zero selects the default from gxrio::settings, which is one thread.
+	unsigned threads = 0;
+
+	/// \brief Create gzip output that is friendly to rsync and deduplicating backups
+	///
+	/// The compressor state is reset at boundaries determined by the content, so
+	/// that a local change in the input only results in a local change in the
+	/// compressed output. This costs a little in compression ratio.
+	bool rsyncable = false;
+
+	/// \brief Write a checkpoint each time this many uncompressed bytes have been
+	/// compressed, zero means no checkpoints.
+	///
+	/// At a checkpoint the compressor is flushed in such a way that compression
+	/// can be resumed from that point. gxrio::ofstream then syncs the file to disk
+	/// and records the checkpoint in a journal file, see basic_ofstream::resume.
+	std::uint64_t checkpoint_interval = 0;
+
+	/// \brief The base two logarithm of the window size, zero selects the default.
+	/// Only brotli uses this, valid values are 10 to 24.
+	unsigned window_bits = 0;
+
+	/// \brief Data used as a preset dictionary when writing .xzr files
+	///
+	/// Data that resembles the reference, like the next in a series of
+	/// snapshots, then costs roughly the size of the differences. The same
+	/// reference is needed for decompressing, see basic_istream::set_reference.
+	std::shared_ptr<const std::string> reference;
+};
+
+/// \brief The metadata stored in the header of gzip compressed data
+
+struct gzip_header
+{
+	/// \brief The original file name, empty if not stored
+	std::string name;
+
+	/// \brief The comment, empty if not stored
+	std::string comment;
+
+	/// \brief The payload of the FEXTRA field, at most 65535 bytes,
+	/// empty if not stored
+	std::string extra;
+
+	/// \brief The modification time in seconds since the epoch, zero if not stored
+	std::uint32_t mtime = 0;
+
+	/// \brief The operating system the data was compressed on, 255 means unknown
+	int os = 255;
+};
+
+/// \brief The state of compressed output at a checkpoint
+
+struct checkpoint
+{
+	/// \brief Number of compressed bytes written
+	std::uint64_t compressed = 0;
+
+	/// \brief Number of uncompressed bytes compressed
+	std::uint64_t uncompressed = 0;
+
+	/// \brief The CRC-32 of the uncompressed data
+	std::uint32_t crc = 0;
+};
+
+/// \brief Options for following a compressed file that is still being written
+
+struct follow_options
+{
+	/// \brief How often to check whether the file has grown. On Linux
+	/// inotify is used and this is only a fallback.
+	std::chrono::milliseconds poll_interval{ 250 };
+
+	/// \brief Report end of file when no new data arrived for this long,
+	/// zero means wait forever
+	std::chrono::milliseconds idle_timeout{ 0 };
+};
+
+/// \brief The exception thrown when one of the decompression_limits is exceeded
+
+class limit_exceeded : public std::runtime_error
+{
+  public:
+	/// \brief The limit that was exceeded
+	enum class limit_type
+	{
+		output,
+		ratio,
+		memory,
+		cpu_time
+	};
+
+	limit_exceeded(limit_type type, const char *msg)
+		: std::runtime_error(msg)
+		, m_type(type)
+	{
+	}
+
+	/// \brief Return which limit was exceeded
+	limit_type type() const noexcept
+	{
+		return m_type;
+	}
+
+  private:
+	limit_type m_type;
+};
+
+/// \brief The exception thrown when data in the xz reference format is read
+/// without the reference it was compressed with
+
+class reference_mismatch : public std::runtime_error
+{
+  public:
+	reference_mismatch()
+		: std::runtime_error("The data was compressed with another reference")
+	{
+	}
+};
+
+// --------------------------------------------------------------------
+
+/// \brief Defaults for file streams, per codec and direction
+///
+/// The defaults are read once, from the file named by the environment variable
+/// GXRIO_CONFIG. This file is usually written by the gxrio-calibrate tool and
+/// contains lines like:
+///
+/// \code
+/// # codec.direction.setting = value
+/// gzip.read.buffer_size = 262144
+/// xz.write.threads = 4
+/// \endcode
+///
+/// The codec is the name of a codec, or none for files that are not compressed.
+/// The buffer size is used for the buffer of the file being read or written,
+/// the number of threads is used by xz when compression_options::threads is zero.
+/// For reading, more than one xz thread means the streams in concatenated xz files
+/// are decoded in parallel, as are the blocks written by multi threaded encoders.
+/// Changes to the defaults should be made before streams are opened.
+
+class settings
+{
+  public:
+	/// \brief The direction of a stream
+	enum class direction
+	{
+		read,
+		write
+	};
+
+	/// \brief The settings for one codec and direction, zero means the library default
+	struct values
+	{
+		size_t buffer_size = 0;
+		unsigned threads = 0;
+	};
+
+	/// \brief The defaults used by gxrio streams
+	static settings &defaults()
+	{
+		static settings s_defaults = []
+		{
+			settings result;
+			if (auto file = std::getenv("GXRIO_CONFIG"); file != nullptr and *file != 0)
+				result.load(file);
+			return result;
+		}();
+
+		return s_defaults;
+	}
+
+	/// \brief Return the values for \a codec in direction \a dir
+	values get(std::string_view codec, direction dir) const
+	{
+		auto i = m_values.find(key(codec, dir));
+		return i != m_values.end() ? i->second : values{};
+	}
+
+	/// \brief Set the values for \a codec in direction \a dir
+	void set(std::string_view codec, direction dir, const values &v)
+	{
+		m_values[key(codec, dir)] = v;
+	}
+
+	/// \brief Read the settings in \a file, returns false if it could not be read.
+	/// Unknown settings are ignored.
+	bool load(const std::filesystem::path &file)
+	{
+		std::ifstream in(file);
+		if (not in.is_open())
+			return false;
+
+		std::string line;
+		while (std::getline(in, line))
+		{
+			auto eq = line.find('=');
+			if (line.empty() or line[0] == '#' or eq == std::string::npos)
+				continue;
+
+			auto name = trim(std::string_view(line).substr(0, eq));
+			auto value = trim(std::string_view(line).substr(eq + 1));
+
+			auto dot = name.rfind('.');
+			if (dot == std::string_view::npos)
+				continue;
+
+			std::uint64_t n;
+			if (auto r = std::from_chars(value.data(), value.data() + value.size(), n); r.ec != std::errc())
+				continue;
+
+			auto &v = m_values[std::string(name.substr(0, dot))];
+			if (name.substr(dot + 1) == "buffer_size")
+				v.buffer_size = n;
+			else if (name.substr(dot + 1) == "threads")
+				v.threads = static_cast<unsigned>(n);
+		}
+
+		return not in.bad();
+	}
+
+	/// \brief Write the settings to \a file, returns false on error
+	bool save(const std::filesystem::path &file) const
+	{
+		std::ofstream out(file, std::ios_base::trunc);
+
+		out << "# gxrio settings, codec.direction.setting = value\n";
+
+		for (auto &[name, v] : m_values)
+		{
+			if (v.buffer_size)
+				out << name << ".buffer_size = " << v.buffer_size << '\n';
+			if (v.threads)
+				out << name << ".threads = " << v.threads << '\n';
+		}
+
+		out.close();
+
+		return not out.fail();
+	}
+
+  private:
+	static std::string key(std::string_view codec, direction dir)
+	{
+		return std::string(codec) + (dir == direction::read ? ".read" : ".write");
+	}
+
+	static std::string_view trim(std::string_view s)
+	{
+		while (not s.empty() and std::isspace(static_cast<unsigned char>(s.front())))
+			s.remove_prefix(1);
+		while (not s.empty() and std::isspace(static_cast<unsigned char>(s.back())))
+			s.remove_suffix(1);
+		return s;
+	}
+
+	std::map<std::string, values> m_values;
+};
+
+// --------------------------------------------------------------------
+
 /// \brief A base class for the streambuf classes in gxrio
 ///
 /// \tparam CharT Type of the character stream.
@@ -65,6 +415,14 @@ class basic_streambuf : public std::basic_streambuf<CharT, Traits>
 		: streambuf_type(std::move(rhs))
 	{
 		m_upstream = std::exchange(rhs.m_upstream, nullptr);
+		m_limits = rhs.m_limits;
+		m_options = rhs.m_options;
+		m_reference = rhs.m_reference;
+		m_checkpoint_handler = std::move(rhs.m_checkpoint_handler);
+		m_wait_handler = std::move(rhs.m_wait_handler);
+		m_total_in = rhs.m_total_in;
+		m_total_out = rhs.m_total_out;
+		m_codec_time = rhs.m_codec_time;
 	}
 
 	basic_streambuf &operator=(const basic_streambuf &) = delete;
@@ -72,6 +430,14 @@ class basic_streambuf : public std::basic_streambuf<CharT, Traits>
 	basic_streambuf &operator=(basic_streambuf &&rhs)
 	{
 		m_upstream = std::exchange(rhs.m_upstream, nullptr);
+		m_limits = rhs.m_limits;
+		m_options = rhs.m_options;
+		m_reference = rhs.m_reference;
+		m_checkpoint_handler = std::move(rhs.m_checkpoint_handler);
+		m_wait_handler = std::move(rhs.m_wait_handler);
+		m_total_in = rhs.m_total_in;
+		m_total_out = rhs.m_total_out;
+		m_codec_time = rhs.m_codec_time;
 		return *this;
 	}
 
@@ -83,13 +449,348 @@ class basic_streambuf : public std::basic_streambuf<CharT, Traits>
 	virtual basic_streambuf *init(streambuf_type *sb) = 0;
 	virtual basic_streambuf *close() = 0;
 
+	/// \brief Set the resource budgets used while decompressing
+	virtual void set_limits(const decompression_limits &limits)
+	{
+		m_limits = limits;
+	}
+
+	/// \brief Return the resource budgets used while decompressing
+	const decompression_limits &get_limits() const
+	{
+		return m_limits;
+	}
+
+	/// \brief Set the options used for compressing
+	///
+	/// Compressing streambufs initialize their codec on first use,
+	/// the options should be set before that.
+	void set_options(const compression_options &options)
+	{
+		m_options = options;
+	}
+
+	/// \brief Return the options used for compressing
+	const compression_options &get_options() const
+	{
+		return m_options;
+	}
+
+	/// \brief Set the reference data needed by decompressors for data
+	/// compressed with compression_options::reference
+	void set_reference(std::shared_ptr<const std::string> reference)
+	{
+		m_reference = std::move(reference);
+	}
+
+	/// \brief The callback called at each checkpoint, should return false on error
+	using checkpoint_handler = std::function<bool(const checkpoint &)>;
+
+	/// \brief Set the function to call when a checkpoint was written
+	void set_checkpoint_handler(checkpoint_handler handler)
+	{
+		m_checkpoint_handler = std::move(handler);
+	}
+
+	/// \brief Continue compressing after checkpoint \a cp
+	///
+	/// This should be called right after init. The upstream should have been
+	/// truncated to cp.compressed bytes. The default returns false, meaning
+	/// resuming is not supported.
+	virtual bool resume(const checkpoint &/* cp */)
+	{
+		return false;
+	}
+
+	/// \brief Return the gzip header of the data, it is read when needed
+	///
+	/// Only the header is read, no data is decompressed. The default returns
+	/// nothing, meaning the data is not gzip compressed.
+	virtual std::optional<gzip_header> get_gzip_header()
+	{
+		return std::nullopt;
+	}
+
+	/// \brief Set the gzip header to write, this should be called before
+	/// anything is written. The default returns false, meaning the codec
+	/// does not write gzip headers.
+	virtual bool set_gzip_header(const gzip_header &/* header */)
+	{
+		return false;
+	}
+
+	/// \brief The callback called by decompressors when upstream has no more data
+	///
+	/// It is passed the time spent waiting so far and should return true
+	/// after new data may have arrived, or false to report end of file.
+	using wait_handler = std::function<bool(std::chrono::steady_clock::duration)>;
+
+	/// \brief Set the function to call at the end of the available input,
+	/// this turns a decompressor into one that follows a growing upstream.
+	void set_wait_handler(wait_handler handler)
+	{
+		m_wait_handler = std::move(handler);
+	}
+
+	/// \brief Return the decompressed data in the get area without copying
+	///
+	/// The get area is refilled when it is empty, an empty view is returned
+	/// at end of input. The view is valid until the next call that reads
+	/// from this streambuf. Use consume() to mark characters as read.
+	std::basic_string_view<CharT, Traits> peek()
+	{
+		if (traits_type::eq_int_type(this->sgetc(), traits_type::eof()))
+			return {};
+
+		return { this->gptr(), static_cast<size_t>(this->egptr() - this->gptr()) };
+	}
+
+	/// \brief Mark \a n characters returned by peek() as read
+	void consume(std::streamsize n)
+	{
+		this->gbump(static_cast<int>(n));
+	}
+
+	/// \brief Return the free space in the put area, for writing without copying
+	///
+	/// If less than \a size characters are free, the contents of the put area
+	/// are compressed first. The result may still be smaller than \a size
+	/// if the buffer is smaller, it is empty on error or for decompressors.
+	/// Use commit() to add the characters written there to the output.
+	std::pair<char_type *, size_t> prepare(size_t size = 1)
+	{
+		if (static_cast<size_t>(this->epptr() - this->pptr()) < size and not drain())
+			return {};
+
+		return { this->pptr(), static_cast<size_t>(this->epptr() - this->pptr()) };
+	}
+
+	/// \brief Add \a n characters written in the space returned by prepare() to the output
+	void commit(std::streamsize n)
+	{
+		this->pbump(static_cast<int>(n));
+	}
+
+	/// \brief Write the \a count fragments at \a fragments, returns the number of
+	/// characters written.
+	///
+	/// Fragments that fit are copied into the put area, others are written
+	/// using sputn. Compressors override this to pass large batches to the
+	/// codec at once.
+	virtual std::streamsize sputn_gather(const std::basic_string_view<CharT, Traits> *fragments, size_t count)
+	{
+		std::streamsize result = 0;
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			auto &f = fragments[i];
+
+			if (f.empty())
+				continue;
+
+			if (f.length() <= static_cast<size_t>(this->epptr() - this->pptr()))
+			{
+				traits_type::copy(this->pptr(), f.data(), f.length());
+				this->pbump(static_cast<int>(f.length()));
+				result += f.length();
+			}
+			else
+			{
+				auto n = this->sputn(f.data(), f.length());
+				result += n;
+
+				if (n != static_cast<std::streamsize>(f.length()))
+					break;
+			}
+		}
+
+		return result;
+	}
+
   protected:
+	/// \brief Compress the contents of the put area and empty it,
+	/// compressing streambufs override this. Returns false on error.
+	virtual bool drain()
+	{
+		return false;
+	}
+
+	/// \brief Reset the counters used to check the limits
+	void reset_counters()
+	{
+		m_total_in = m_total_out = 0;
+		m_codec_time = {};
+	}
+
+	/// \brief Call \a codec, keeping track of the time spent if there's a budget for it
+	template <typename F>
+	auto run_codec(F &&codec)
+	{
+		if (m_limits.max_cpu_time.count() == 0)
+			return codec();
+
+		auto start = std::chrono::steady_clock::now();
+		auto result = codec();
+		m_codec_time += std::chrono::steady_clock::now() - start;
+		return result;
+	}
+
+	/// \brief Read at most \a size characters from upstream into \a buffer
+	///
+	/// If there is no data and a wait handler was set, wait for more.
+	std::streamsize read_upstream(char_type *buffer, std::streamsize size)
+	{
+		auto n = m_upstream->sgetn(buffer, size);
+
+		if (n == 0 and m_wait_handler)
+		{
+			auto start = std::chrono::steady_clock::now();
+			while (n == 0 and m_wait_handler(std::chrono::steady_clock::now() - start))
+				n = m_upstream->sgetn(buffer, size);
+		}
+
+		return n;
+	}
+
+	/// \brief Account for \a in compressed bytes read and \a out bytes
+	/// decompressed, throws limit_exceeded if a budget is exhausted.
+	void account(std::uint64_t in, std::uint64_t out)
+	{
+		m_total_in += in;
+		m_total_out += out;
+
+		if (m_limits.max_output > 0 and m_total_out > m_limits.max_output)
+			throw limit_exceeded(limit_exceeded::limit_type::output, "Maximum decompressed size exceeded");
+
+		if (m_limits.max_ratio > 0 and m_total_out > m_limits.max_ratio * (m_total_in ? m_total_in : 1))
+			throw limit_exceeded(limit_exceeded::limit_type::ratio, "Maximum expansion ratio exceeded");
+
+		if (m_limits.max_cpu_time.count() > 0 and m_codec_time > m_limits.max_cpu_time)
+			throw limit_exceeded(limit_exceeded::limit_type::cpu_time, "Maximum decompression time exceeded");
+	}
+
 	/// \brief The upstream streambuf object, usually this is a basic_filebuf
 	streambuf_type *m_upstream = nullptr;
+
+	/// \brief The resource budgets
+	decompression_limits m_limits;
+
+	/// \brief The compression options
+	compression_options m_options;
+
+	/// \brief The reference data used while decompressing
+	std::shared_ptr<const std::string> m_reference;
+
+	/// \brief Called when a checkpoint was written
+	checkpoint_handler m_checkpoint_handler;
+
+	/// \brief Called at the end of the available input
+	wait_handler m_wait_handler;
+
+	/// \brief Number of bytes consumed by the codec, compressed
+	/// bytes for decompressors and uncompressed bytes for compressors
+	std::uint64_t m_total_in = 0;
+
+	/// \brief Number of bytes produced by the codec
+	std::uint64_t m_total_out = 0;
+
+	/// \brief Time spent in the decoder, only measured if there's a budget for it
+	std::chrono::steady_clock::duration m_codec_time{};
 };
 
 // --------------------------------------------------------------------
 
+namespace detail
+{
+
+/// \brief zlib takes 32 bit sizes, larger blocks of data are passed in slices of this size
+inline constexpr size_t kMaxZlibSlice = 1U << 30;
+
+/// \brief Update \a crc with the CRC-32 of \a data
+inline std::uint32_t crc32(std::uint32_t crc, std::string_view data)
+{
+	while (not data.empty())
+	{
+		auto n = std::min(data.size(), kMaxZlibSlice);
+		crc = static_cast<std::uint32_t>(::crc32(crc, reinterpret_cast<const Bytef *>(data.data()), static_cast<uInt>(n)));
+		data.remove_prefix(n);
+	}
+	return crc;
+}
+
+/// \brief Update \a crc with the CRC-32 of \a size characters at \a data
+template <typename CharT>
+std::uint32_t crc32(std::uint32_t crc, const CharT *data, size_t size)
+{
+	return crc32(crc, std::string_view(reinterpret_cast<const char *>(data), size));
+}
+
+/// \brief Fragments written using sputn_gather are collected in a buffer
+/// of this size before being compressed, larger fragments are compressed
+/// from where they are.
+inline constexpr size_t kGatherBufferSize = 16 * 1024;
+
+/// \brief Pass the \a count fragments at \a fragments to \a compress, which
+/// is called with a pointer and a size and returns false on error.
+template <typename CharT, typename Traits, typename Compress>
+bool gather(const std::basic_string_view<CharT, Traits> *fragments, size_t count, Compress &&compress)
+{
+	CharT buffer[kGatherBufferSize];
+	size_t used = 0;
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		auto &f = fragments[i];
+
+		if (f.length() >= kGatherBufferSize / 4)
+		{
+			if (used > 0 and not compress(buffer, used))
+				return false;
+			used = 0;
+
+			if (not compress(f.data(), f.length()))
+				return false;
+			continue;
+		}
+
+		if (used + f.length() > kGatherBufferSize)
+		{
+			if (not compress(buffer, used))
+				return false;
+			used = 0;
+		}
+
+		Traits::copy(buffer + used, f.data(), f.length());
+		used += f.length();
+	}
+
+	return used == 0 or compress(buffer, used);
+}
+
+/// \brief The total length of the \a count fragments at \a fragments
+template <typename CharT, typename Traits>
+size_t total_length(const std::basic_string_view<CharT, Traits> *fragments, size_t count)
+{
+	size_t result = 0;
+	for (size_t i = 0; i < count; ++i)
+		result += fragments[i].length();
+	return result;
+}
+
+/// \brief A zlib gz_header together with the storage its fields point to
+struct gz_header_storage
+{
+	/// \brief The maximum size of name and comment kept when reading
+	static constexpr uInt kMaxStringSize = 4096;
+
+	gz_header header{};
+	std::vector<Bytef> extra, name, comment;
+};
+
+} // namespace detail
+
+// --------------------------------------------------------------------
+
 /// \brief A streambuf class that can be used to decompress gzipped data
 ///
 /// \tparam CharT		Type of the character stream.
@@ -125,6 +826,7 @@ class basic_igzip_streambuf : public basic_streambuf<CharT, Traits>
 	{
 		std::swap(m_zstream, rhs.m_zstream);
 		std::swap(m_gzheader, rhs.m_gzheader);
+		m_pending = std::exchange(rhs.m_pending, false);
 
 		auto p = std::copy(rhs.gptr(), rhs.egptr(), m_out_buffer.data());
 		this->setg(m_out_buffer.data(), m_out_buffer.data(), p);
@@ -148,6 +850,7 @@ class basic_igzip_streambuf : public basic_streambuf<CharT, Traits>
 
 		std::swap(m_zstream, rhs.m_zstream);
 		std::swap(m_gzheader, rhs.m_gzheader);
+		m_pending = std::exchange(rhs.m_pending, false);
 
 		auto p = std::copy(rhs.gptr(), rhs.egptr(), m_out_buffer.data());
 		this->setg(m_out_buffer.data(), m_out_buffer.data(), p);
@@ -180,37 +883,95 @@ class basic_igzip_streambuf : public basic_streambuf<CharT, Traits>
 			m_gzheader.reset(nullptr);
 		}
 
+		m_pending = false;
+
 		this->setg(nullptr, nullptr, nullptr);
 
 		return this;
 	}
 
-	/// \brief Initialize a zlib stream and set the upstream.
+	/// \brief Set the upstream, the zlib stream is initialized on first use.
 	///
 	/// \param upstream The upstream streambuf
 	///
-	/// The zstream is constructed and an optional header is
-	/// read from upstream. The contents of the header are ignored
-	/// but we must maintain that structure.
+	/// Nothing is read from \a upstream until the first call to underflow,
+	/// which makes opening a file cheap.
 	base_type *init(streambuf_type *upstream) override
 	{
 		this->set_upstream(upstream);
 
 		close();
 
+		this->reset_counters();
+
+		m_pending = true;
+
+		return this;
+	}
+
+	/// \brief Return the header of the first gzip member, reading it if needed
+	std::optional<gzip_header> get_gzip_header() override
+	{
+		if (m_pending and not init_codec())
+			return std::nullopt;
+
+		if (not m_zstream or not read_header() or m_gzheader->header.done != 1)
+			return std::nullopt;
+
+		auto &header = m_gzheader->header;
+
+		// zlib only terminates strings that fit
+		auto to_string = [](const Bytef *s, uInt max)
+		{
+			return s ? std::string(reinterpret_cast<const char *>(s), std::find(s, s + max, 0) - s) : std::string();
+		};
+
+		gzip_header result;
+		result.name = to_string(header.name, header.name_max);
+		result.comment = to_string(header.comment, header.comm_max);
+		if (header.extra)
+			result.extra.assign(reinterpret_cast<const char *>(header.extra), std::min(header.extra_len, header.extra_max));
+		result.mtime = static_cast<std::uint32_t>(header.time);
+		result.os = header.os;
+
+		return result;
+	}
+
+  private:
+	/// \brief Initialize a zlib stream
+	///
+	/// The zstream is constructed and the first block of data is
+	/// read from upstream. The gzip header is stored in m_gzheader
+	/// when inflate processes it.
+	bool init_codec()
+	{
+		m_pending = false;
+
 		m_zstream.reset(new z_stream_s);
-		m_gzheader.reset(new gz_header_s);
+		m_gzheader.reset(new detail::gz_header_storage);
 
 		auto &zstream = *m_zstream.get();
 		zstream = z_stream_s{};
-		auto &header = *m_gzheader.get();
-		header = gz_header_s{};
+
+		auto &storage = *m_gzheader;
+		storage.extra.resize(65535);
+		storage.name.resize(detail::gz_header_storage::kMaxStringSize);
+		storage.comment.resize(detail::gz_header_storage::kMaxStringSize);
+
+		auto &header = storage.header;
+		header.extra = storage.extra.data();
+		header.extra_max = static_cast<uInt>(storage.extra.size());
+		header.name = storage.name.data();
+		header.name_max = static_cast<uInt>(storage.name.size());
+		header.comment = storage.comment.data();
+		header.comm_max = static_cast<uInt>(storage.comment.size());
 
 		int err = ::inflateInit2(&zstream, 47);
 		if (err == Z_OK)
 		{
 			zstream.next_in = reinterpret_cast<unsigned char *>(m_in_buffer.data());
 			zstream.avail_in = static_cast<uInt>(this->m_upstream->sgetn(m_in_buffer.data(), m_in_buffer.size()));
+			this->account(zstream.avail_in, 0);
 
 			err = ::inflateGetHeader(&zstream, &header);
 
@@ -219,45 +980,114 @@ class basic_igzip_streambuf : public basic_streambuf<CharT, Traits>
 		}
 
 		if (err != Z_OK)
-			zstream = z_stream_s{};
+		{
+			m_zstream.reset(nullptr);
+			m_gzheader.reset(nullptr);
+		}
 
-		return err == Z_OK ? this : nullptr;
+		return err == Z_OK;
+	}
+
+	/// \brief Run inflate until the gzip header is processed, nothing is
+	/// decompressed since inflate stops before the first deflate block.
+	bool read_header()
+	{
+		auto &zstream = *m_zstream;
+
+		while (m_gzheader->header.done == 0)
+		{
+			std::streamsize read = 0;
+			if (zstream.avail_in == 0)
+			{
+				zstream.next_in = reinterpret_cast<unsigned char *>(m_in_buffer.data());
+				zstream.avail_in = static_cast<uInt>(this->read_upstream(m_in_buffer.data(), m_in_buffer.size()));
+				read = zstream.avail_in;
+			}
+
+			if (zstream.avail_in == 0)
+				return false;
+
+			zstream.next_out = reinterpret_cast<unsigned char *>(m_out_buffer.data());
+			zstream.avail_out = static_cast<uInt>(m_out_buffer.size());
+
+			int err = ::inflate(&zstream, Z_BLOCK);
+
+			this->account(read, m_out_buffer.size() - zstream.avail_out);
+
+			if (err != Z_OK)
+				return false;
+		}
+
+		return true;
 	}
 
-  private:
 	/// \brief The actual work is done here.
 	int_type underflow() override
 	{
+		if (this->gptr() == this->egptr())
+		{
+			auto n = decompress(m_out_buffer.data(), m_out_buffer.size());
+			this->setg(m_out_buffer.data(), m_out_buffer.data(), m_out_buffer.data() + n);
+		}
+
+		return this->gptr() != this->egptr() ? traits_type::to_int_type(*this->gptr()) : traits_type::eof();
+	}
+
+	/// \brief Read \a n characters into \a s, large reads are decompressed
+	/// directly into \a s, in slices of at most detail::kMaxZlibSlice.
+	std::streamsize xsgetn(char_type *s, std::streamsize n) override
+	{
+		std::streamsize result = std::min<std::streamsize>(this->egptr() - this->gptr(), n);
+		std::copy(this->gptr(), this->gptr() + result, s);
+		this->gbump(static_cast<int>(result));
+
+		while (n - result >= static_cast<std::streamsize>(m_out_buffer.size()))
+		{
+			auto r = decompress(s + result, std::min<std::streamsize>(n - result, detail::kMaxZlibSlice));
+			if (r == 0)
+				return result;
+			result += r;
+		}
+
+		return result + streambuf_type::xsgetn(s + result, n - result);
+	}
+
+	/// \brief Decompress at most \a size characters into \a data, returns the number
+	/// decompressed which is zero at the end of the data or on error.
+	std::streamsize decompress(char_type *data, std::streamsize size)
+	{
+		if (m_pending and not init_codec())
+			return 0;
+
+		std::streamsize n = 0;
+
 		if (m_zstream and this->m_upstream)
 		{
 			auto &zstream = *m_zstream.get();
-			const std::streamsize kBufferByteSize = m_out_buffer.size();
 
-			while (this->gptr() == this->egptr())
+			while (n == 0)
 			{
-				zstream.next_out = reinterpret_cast<unsigned char *>(m_out_buffer.data());
-				zstream.avail_out = static_cast<uInt>(kBufferByteSize);
+				zstream.next_out = reinterpret_cast<unsigned char *>(data);
+				zstream.avail_out = static_cast<uInt>(size);
 
+				std::streamsize read = 0;
 				if (zstream.avail_in == 0)
 				{
 					zstream.next_in = reinterpret_cast<unsigned char *>(m_in_buffer.data());
-					zstream.avail_in = static_cast<uInt>(this->m_upstream->sgetn(m_in_buffer.data(), m_in_buffer.size()));
+					zstream.avail_in = static_cast<uInt>(this->read_upstream(m_in_buffer.data(), m_in_buffer.size()));
+					read = zstream.avail_in;
 				}
 
 				if (zstream.avail_in == 0)
 					break;
 
-				int err = ::inflate(&zstream, Z_SYNC_FLUSH);
-				std::streamsize n = kBufferByteSize - zstream.avail_out;
+				int err = this->run_codec([&zstream] { return ::inflate(&zstream, Z_SYNC_FLUSH); });
+				n = size - zstream.avail_out;
+
+				this->account(read, n);
 
 				if (n > 0)
-				{
-					this->setg(
-						m_out_buffer.data(),
-						m_out_buffer.data(),
-						m_out_buffer.data() + n);
 					break;
-				}
 
 				if (err == Z_STREAM_END and zstream.avail_in > 0)
 					err = ::inflateReset2(&zstream, 47);
@@ -267,7 +1097,7 @@ class basic_igzip_streambuf : public basic_streambuf<CharT, Traits>
 			}
 		}
 
-		return this->gptr() != this->egptr() ? traits_type::to_int_type(*this->gptr()) : traits_type::eof();
+		return n;
 	}
 
   private:
@@ -277,7 +1107,10 @@ class basic_igzip_streambuf : public basic_streambuf<CharT, Traits>
 
 	/// \brief The zlib internal structures are mainained as pointers to avoid having
 	/// to copy their content in move constructors.
-	std::unique_ptr<gz_header> m_gzheader;
+	std::unique_ptr<detail::gz_header_storage> m_gzheader;
+
+	/// \brief Set by init, the zlib stream is created on first use
+	bool m_pending = false;
 
 	/// \brief Input buffer, this is the input for zlib
 	std::array<char_type, BufferSize> m_in_buffer;
@@ -322,6 +1155,8 @@ class basic_ogzip_streambuf : public basic_streambuf<CharT, Traits>
 	{
 		std::swap(m_zstream, rhs.m_zstream);
 		std::swap(m_gzheader, rhs.m_gzheader);
+		std::swap(m_header, rhs.m_header);
+		m_pending = std::exchange(rhs.m_pending, false);
 
 		this->setp(m_in_buffer.data(), m_in_buffer.data() + m_in_buffer.size());
 		this->sputn(rhs.pbase(), rhs.pptr() - rhs.pbase());
@@ -337,6 +1172,8 @@ class basic_ogzip_streambuf : public basic_streambuf<CharT, Traits>
 
 		std::swap(m_zstream, rhs.m_zstream);
 		std::swap(m_gzheader, rhs.m_gzheader);
+		std::swap(m_header, rhs.m_header);
+		m_pending = std::exchange(rhs.m_pending, false);
 
 		this->setp(m_in_buffer.data(), m_in_buffer.data() + m_in_buffer.size());
 		this->sputn(rhs.pbase(), rhs.pptr() - rhs.pbase());
@@ -351,73 +1188,293 @@ class basic_ogzip_streambuf : public basic_streambuf<CharT, Traits>
 	}
 
 	/// \brief This closes the zlib stream and sets the put pointers to null.
+	///
+	/// If nothing was written the zlib stream is initialized here
+	/// to make sure a valid, empty, gzip file is written.
+	/// Returns nullptr if finishing the compressed data failed.
 	base_type *close() override
 	{
-		if (m_zstream)
+		bool result = true;
+
+		if (m_zstream or m_pending)
 		{
-			overflow(traits_type::eof());
+			result = write_put_area(true);
 
-			::deflateEnd(m_zstream.get());
+			if (m_zstream)
+				::deflateEnd(m_zstream.get());
 
 			m_zstream.reset(nullptr);
 			m_gzheader.reset(nullptr);
 		}
 
+		m_pending = false;
+
 		this->setp(nullptr, nullptr);
 
-		return this;
+		return result ? this : nullptr;
 	}
 
-	/// \brief Initialize the internal zlib structures
+	/// \brief Set the upstream, the zlib stream is initialized on first use
 	///
 	/// \param upstream The upstream streambuf
 	///
-	/// The zlib stream is initialized as one that can accept
-	/// a gzip header.
+	/// Initializing deflate is expensive, so this is deferred until
+	/// the buffer needs to be written for the first time.
 	base_type *init(streambuf_type *upstream) override
 	{
 		this->set_upstream(upstream);
 
 		close();
 
+		this->reset_counters();
+
+		m_pending = true;
+		m_header.reset();
+		m_rsync_hash = 0;
+		m_resumed = false;
+		m_crc = 0;
+		m_last_checkpoint = 0;
+
+		this->setp(this->m_in_buffer.data(), this->m_in_buffer.data() + this->m_in_buffer.size());
+
+		return this;
+	}
+
+	/// \brief Continue compressing after checkpoint \a cp
+	///
+	/// The deflate data is continued as a raw deflate stream, the
+	/// gzip trailer is then written by this class.
+	bool resume(const checkpoint &cp) override
+	{
+		if (not m_pending or this->pptr() != this->pbase())
+			return false;
+
+		m_resumed = true;
+		m_crc = cp.crc;
+		m_last_checkpoint = this->m_total_in = cp.uncompressed;
+		this->m_total_out = cp.compressed;
+
+		return true;
+	}
+
+	/// \brief Set the gzip header to write, returns false if compression
+	/// already started, was resumed or \a header.extra is too large.
+	bool set_gzip_header(const gzip_header &header) override
+	{
+		if (not m_pending or m_resumed or header.extra.size() > 65535)
+			return false;
+
+		m_header = header;
+
+		return true;
+	}
+
+  private:
+	/// \brief Initialize the internal zlib structures
+	///
+	/// The zlib stream is initialized as one that can accept
+	/// a gzip header. Or as a raw deflate stream when resuming.
+	bool init_codec()
+	{
+		m_pending = false;
+
 		m_zstream.reset(new z_stream_s);
-		m_gzheader.reset(new gz_header_s);
+		m_gzheader.reset(new detail::gz_header_storage);
 
 		auto &zstream = *m_zstream.get();
 		zstream = z_stream_s{};
-		auto &header = *m_gzheader.get();
-		header = gz_header_s{};
+		auto &header = m_gzheader->header;
+
+		if (m_header)
+		{
+			// zlib needs null terminated strings, these must remain valid until the header is written
+			auto &storage = *m_gzheader;
+			auto assign = [](std::vector<Bytef> &v, const std::string &s)
+			{
+				v.assign(s.begin(), s.end());
+				v.push_back(0);
+				return v.data();
+			};
+
+			if (not m_header->name.empty())
+				header.name = assign(storage.name, m_header->name);
+			if (not m_header->comment.empty())
+				header.comment = assign(storage.comment, m_header->comment);
+			if (not m_header->extra.empty())
+			{
+				header.extra = assign(storage.extra, m_header->extra);
+				header.extra_len = static_cast<uInt>(m_header->extra.size());
+			}
+			header.time = m_header->mtime;
+			header.os = m_header->os;
+		}
 
 		const int WINDOW_BITS = 15, GZIP_ENCODING = 16;
 
-		int err = deflateInit2(&zstream, Z_BEST_COMPRESSION, Z_DEFLATED,
-			WINDOW_BITS | GZIP_ENCODING, Z_DEFLATED, Z_DEFAULT_STRATEGY);
+		int level = this->m_options.level < 0 ? Z_BEST_COMPRESSION : std::min(this->m_options.level, Z_BEST_COMPRESSION);
 
-		if (err == Z_OK)
+		int err = deflateInit2(&zstream, level, Z_DEFLATED,
+			m_resumed ? -WINDOW_BITS : WINDOW_BITS | GZIP_ENCODING, Z_DEFLATED, Z_DEFAULT_STRATEGY);
+
+		if (err == Z_OK and not m_resumed)
 			err = ::deflateSetHeader(&zstream, &header);
 
-		if (err == Z_OK)
-			this->setp(this->m_in_buffer.data(), this->m_in_buffer.data() + this->m_in_buffer.size());
-		else
-			zstream = z_stream_s{};
+		if (err != Z_OK)
+		{
+			::deflateEnd(&zstream);
+
+			m_zstream.reset(nullptr);
+			m_gzheader.reset(nullptr);
+		}
 
-		return err == Z_OK ? this : nullptr;
+		return err == Z_OK;
 	}
 
-  private:
 	/// \brief The actual work is done here
 	///
 	/// \param ch The character that did not fit, in case it is eof we need to flush
 	///
 	int_type overflow(int_type ch) override
 	{
-		if (not m_zstream)
+		if (not write_put_area(traits_type::eq_int_type(ch, traits_type::eof())))
 			return traits_type::eof();
 
+		if (not traits_type::eq_int_type(ch, traits_type::eof()))
+		{
+			*this->pptr() = traits_type::to_char_type(ch);
+			this->pbump(1);
+		}
+
+		return ch;
+	}
+
+	/// \brief Compress the contents of the put area
+	bool drain() override
+	{
+		return write_put_area(false);
+	}
+
+	/// \brief Compress the put area and empty it, the gzip stream is finished if \a finish is true
+	bool write_put_area(bool finish)
+	{
+		if (m_pending and not init_codec())
+			return false;
+
+		if (not m_zstream)
+			return false;
+
+		const char_type *data = this->pbase();
+
+		if (this->m_options.rsyncable)
+		{
+			// Issue a full flush each time the rolling hash hits the magic value
+			for (auto p = data; p != this->pptr(); ++p)
+			{
+				m_rsync_hash = ((m_rsync_hash << 1) ^ static_cast<unsigned char>(*p)) & kRsyncMask;
+
+				if (m_rsync_hash == kRsyncMask)
+				{
+					if (not compress(data, p + 1 - data, Z_FULL_FLUSH))
+						return false;
+					data = p + 1;
+				}
+			}
+		}
+
+		if (not compress(data, this->pptr() - data, finish ? Z_FINISH : Z_NO_FLUSH))
+			return false;
+
+		if (finish)
+		{
+			if (m_resumed and not write_trailer())
+				return false;
+		}
+		else if (not checkpoint_if_due())
+			return false;
+
+		this->setp(this->m_in_buffer.data(), this->m_in_buffer.data() + this->m_in_buffer.size());
+
+		return true;
+	}
+
+	/// \brief Write a checkpoint if checkpoint_interval bytes were compressed since the last
+	bool checkpoint_if_due()
+	{
+		if (this->m_options.checkpoint_interval > 0 and
+			this->m_total_in - m_last_checkpoint >= this->m_options.checkpoint_interval)
+			return write_checkpoint();
+
+		return true;
+	}
+
+	/// \brief Write \a n characters, large writes are compressed directly from \a s
+	std::streamsize xsputn(const char_type *s, std::streamsize n) override
+	{
+		// rsyncable output needs to see each byte in the put area
+		if (n < static_cast<std::streamsize>(this->m_in_buffer.size()) or this->m_options.rsyncable)
+			return streambuf_type::xsputn(s, n);
+
+		if (not write_put_area(false) or not compress(s, n, Z_NO_FLUSH) or not checkpoint_if_due())
+			return 0;
+
+		return n;
+	}
+
+	/// \brief Write fragments, batches that do not fit in the put area are passed
+	/// to deflate directly, small fragments are collected first.
+	std::streamsize sputn_gather(const std::basic_string_view<CharT, Traits> *fragments, size_t count) override
+	{
+		auto length = detail::total_length(fragments, count);
+
+		// rsyncable output needs to see each byte in the put area
+		if (length <= static_cast<size_t>(this->epptr() - this->pptr()) or this->m_options.rsyncable)
+			return base_type::sputn_gather(fragments, count);
+
+		auto compress_fragment = [this](const char_type *data, size_t size)
+		{
+			return compress(data, size, Z_NO_FLUSH);
+		};
+
+		if (not write_put_area(false) or not detail::gather(fragments, count, compress_fragment) or not checkpoint_if_due())
+			return 0;
+
+		return length;
+	}
+
+	/// \brief Compress \a size characters at \a data and write the result upstream
+	///
+	/// \param data The data to compress
+	/// \param size The number of characters in \a data
+	/// \param flush The zlib flush mode, used after the last slice
+	/// \result false in case of an error
+	bool compress(const char_type *data, std::streamsize size, int flush)
+	{
+		// zlib takes 32 bit sizes
+		while (size > static_cast<std::streamsize>(detail::kMaxZlibSlice))
+		{
+			if (not compress_slice(data, detail::kMaxZlibSlice, Z_NO_FLUSH))
+				return false;
+
+			data += detail::kMaxZlibSlice;
+			size -= detail::kMaxZlibSlice;
+		}
+
+		return compress_slice(data, size, flush);
+	}
+
+	/// \brief Compress \a size characters at \a data, at most detail::kMaxZlibSlice
+	bool compress_slice(const char_type *data, std::streamsize size, int flush)
+	{
 		auto &zstream = *m_zstream;
 
-		zstream.next_in = reinterpret_cast<unsigned char *>(this->pbase());
-		zstream.avail_in = static_cast<uInt>(this->pptr() - this->pbase());
+		zstream.next_in = reinterpret_cast<unsigned char *>(const_cast<char_type *>(data));
+		zstream.avail_in = static_cast<uInt>(size);
+
+		this->m_total_in += size;
+
+		// raw deflate streams do not calculate a crc
+		if (m_resumed and size > 0)
+			m_crc = ::crc32(m_crc, zstream.next_in, zstream.avail_in);
 
 		char_type buffer[BufferSize];
 
@@ -426,7 +1483,7 @@ class basic_ogzip_streambuf : public basic_streambuf<CharT, Traits>
 			zstream.next_out = reinterpret_cast<unsigned char *>(buffer);
 			zstream.avail_out = sizeof(buffer);
 
-			int err = ::deflate(&zstream, ch == traits_type::eof() ? Z_FINISH : Z_NO_FLUSH);
+			int err = ::deflate(&zstream, flush);
 
 			std::streamsize n = sizeof(buffer) - zstream.avail_out;
 			if (n > 0)
@@ -434,27 +1491,52 @@ class basic_ogzip_streambuf : public basic_streambuf<CharT, Traits>
 				auto r = this->m_upstream->sputn(reinterpret_cast<char_type *>(buffer), n);
 
 				if (r != n)
-					return traits_type::eof();
+					return false;
+
+				this->m_total_out += n;
 			}
 
 			if (zstream.avail_out == 0)
 				continue;
 
-			if (err == Z_OK and ch == traits_type::eof())
+			if (err == Z_OK and flush == Z_FINISH)
 				continue;
 
 			break;
 		}
 
-		this->setp(this->m_in_buffer.data(), this->m_in_buffer.data() + this->m_in_buffer.size());
+		return true;
+	}
 
-		if (not traits_type::eq_int_type(ch, traits_type::eof()))
+	/// \brief Do a full flush so compression can be resumed from here and report it
+	bool write_checkpoint()
+	{
+		if (not compress(nullptr, 0, Z_FULL_FLUSH))
+			return false;
+
+		m_last_checkpoint = this->m_total_in;
+
+		checkpoint cp{ this->m_total_out, this->m_total_in, m_resumed ? m_crc : static_cast<std::uint32_t>(m_zstream->adler) };
+
+		return not this->m_checkpoint_handler or this->m_checkpoint_handler(cp);
+	}
+
+	/// \brief Write the gzip trailer for a resumed, raw, deflate stream
+	bool write_trailer()
+	{
+		char_type trailer[8];
+
+		for (int i = 0; i < 4; ++i)
 		{
-			*this->pptr() = traits_type::to_char_type(ch);
-			this->pbump(1);
+			trailer[i] = static_cast<char_type>((m_crc >> (8 * i)) & 0xff);
+			trailer[4 + i] = static_cast<char_type>((this->m_total_in >> (8 * i)) & 0xff);
 		}
 
-		return ch;
+		if (this->m_upstream->sputn(trailer, 8) != 8)
+			return false;
+
+		this->m_total_out += 8;
+		return true;
 	}
 
   private:
@@ -464,7 +1546,30 @@ class basic_ogzip_streambuf : public basic_streambuf<CharT, Traits>
 
 	/// \brief The zlib internal structures are mainained as pointers to avoid having
 	/// to copy their content in move constructors.
-	std::unique_ptr<gz_header> m_gzheader;
+	std::unique_ptr<detail::gz_header_storage> m_gzheader;
+
+	/// \brief The header set using set_gzip_header, written when the codec is initialized
+	std::optional<gzip_header> m_header;
+
+	/// \brief Set by init, the zlib stream is created on first use
+	bool m_pending = false;
+
+	/// \brief The number of bits in the rolling hash for rsyncable output,
+	/// resulting in blocks of 4 KiB on average
+	static constexpr uint32_t kRsyncBits = 12;
+	static constexpr uint32_t kRsyncMask = (1U << kRsyncBits) - 1;
+
+	/// \brief The rolling hash, each byte is shifted out after kRsyncBits bytes
+	uint32_t m_rsync_hash = 0;
+
+	/// \brief Set when resuming after a checkpoint, a raw deflate stream is used then
+	bool m_resumed = false;
+
+	/// \brief The CRC-32 of the uncompressed data, only maintained when resumed
+	std::uint32_t m_crc = 0;
+
+	/// \brief The value of m_total_in at the last checkpoint
+	std::uint64_t m_last_checkpoint = 0;
 
 	/// \brief Input buffer, this is the input for zlib
 	std::array<char_type, BufferSize> m_in_buffer;
@@ -473,6 +1578,62 @@ class basic_ogzip_streambuf : public basic_streambuf<CharT, Traits>
 // --------------------------------------------------------------------
 #if HAVE_LibLZMA
 
+namespace detail
+{
+
+/// \brief The start of each stream in the xz reference format
+///
+/// A stream consists of this signature, the dictionary size (4 bytes), the size
+/// (8 bytes) and CRC-32 (4 bytes) of the reference, then the raw LZMA2 data and
+/// finally the CRC-32 (4 bytes) and size (8 bytes) of the uncompressed data.
+/// All numbers are little endian.
+inline constexpr std::string_view kReferenceSignature{ "\x89GXZR\r\n\x1a", 8 };
+inline constexpr size_t kReferenceHeaderSize = 24;
+inline constexpr size_t kReferenceTrailerSize = 12;
+
+/// \brief The largest dictionary LZMA2 supports
+inline constexpr std::uint64_t kMaxDictSize = 1536ULL << 20;
+
+/// \brief Store the \a n lower bytes of \a v at \a p, little endian
+inline void put_le(std::uint8_t *p, std::uint64_t v, size_t n)
+{
+	for (size_t i = 0; i < n; ++i, v >>= 8)
+		p[i] = static_cast<std::uint8_t>(v);
+}
+
+/// \brief Return the little endian number of \a n bytes at \a p
+inline std::uint64_t get_le(const std::uint8_t *p, size_t n)
+{
+	std::uint64_t result = 0;
+	while (n-- > 0)
+		result = result << 8 | p[n];
+	return result;
+}
+
+/// \brief The LZMA2 filter chain for the reference format
+struct reference_filters
+{
+	/// \brief Set up the filters for dictionary size \a dict_size, using the end of \a reference
+	reference_filters(std::uint32_t preset, std::uint64_t dict_size, std::string_view reference)
+	{
+		ok = not lzma_lzma_preset(&options, preset);
+		options.dict_size = static_cast<std::uint32_t>(dict_size);
+
+		auto n = std::min<size_t>(reference.size(), dict_size);
+		options.preset_dict = reinterpret_cast<const std::uint8_t *>(reference.data() + reference.size() - n);
+		options.preset_dict_size = static_cast<std::uint32_t>(n);
+
+		filters[0] = { LZMA_FILTER_LZMA2, &options };
+		filters[1] = { LZMA_VLI_UNKNOWN, nullptr };
+	}
+
+	lzma_options_lzma options;
+	lzma_filter filters[2];
+	bool ok;
+};
+
+} // namespace detail
+
 /// \brief A streambuf class that can be used to decompress xz data
 ///
 /// \tparam CharT		Type of the character stream.
@@ -505,9 +1666,29 @@ class basic_ixz_streambuf : public basic_streambuf<CharT, Traits>
 		: base_type(std::move(rhs))
 	{
 		std::swap(m_xzstream, rhs.m_xzstream);
-
-		auto p = std::copy(rhs.gptr(), rhs.egptr(), m_out_buffer.data());
-		this->setg(m_out_buffer.data(), m_out_buffer.data(), p);
+		m_pending = std::exchange(rhs.m_pending, false);
+		m_reference_format = rhs.m_reference_format;
+		m_in_stream = rhs.m_in_stream;
+		m_stream_crc = rhs.m_stream_crc;
+		m_stream_size = rhs.m_stream_size;
+		m_start = rhs.m_start;
+		m_threads = std::exchange(rhs.m_threads, 0);
+		m_streams = std::move(rhs.m_streams);
+		m_decoded = std::move(rhs.m_decoded);
+		m_decoding = std::exchange(rhs.m_decoding, 0);
+
+		if (m_threads > 0)
+		{
+			// the get area points into m_current, moving it keeps the data in place
+			this->setg(rhs.eback(), rhs.gptr(), rhs.egptr());
+			m_current = std::move(rhs.m_current);
+			rhs.setg(nullptr, nullptr, nullptr);
+		}
+		else
+		{
+			auto p = std::copy(rhs.gptr(), rhs.egptr(), m_out_buffer.data());
+			this->setg(m_out_buffer.data(), m_out_buffer.data(), p);
+		}
 
 		if (m_xzstream and m_xzstream->avail_in > 0)
 		{
@@ -526,9 +1707,29 @@ class basic_ixz_streambuf : public basic_streambuf<CharT, Traits>
 	{
 		base_type::operator=(std::move(rhs));
 		std::swap(m_xzstream, rhs.m_xzstream);
-
-		auto p = std::copy(rhs.gptr(), rhs.egptr(), m_out_buffer.data());
-		this->setg(m_out_buffer.data(), m_out_buffer.data(), p);
+		m_pending = std::exchange(rhs.m_pending, false);
+		m_reference_format = rhs.m_reference_format;
+		m_in_stream = rhs.m_in_stream;
+		m_stream_crc = rhs.m_stream_crc;
+		m_stream_size = rhs.m_stream_size;
+		m_start = rhs.m_start;
+		m_threads = std::exchange(rhs.m_threads, 0);
+		m_streams = std::move(rhs.m_streams);
+		m_decoded = std::move(rhs.m_decoded);
+		m_decoding = std::exchange(rhs.m_decoding, 0);
+
+		if (m_threads > 0)
+		{
+			// the get area points into m_current, moving it keeps the data in place
+			this->setg(rhs.eback(), rhs.gptr(), rhs.egptr());
+			m_current = std::move(rhs.m_current);
+			rhs.setg(nullptr, nullptr, nullptr);
+		}
+		else
+		{
+			auto p = std::copy(rhs.gptr(), rhs.egptr(), m_out_buffer.data());
+			this->setg(m_out_buffer.data(), m_out_buffer.data(), p);
+		}
 
 		if (m_xzstream and m_xzstream->avail_in > 0)
 		{
@@ -557,57 +1758,138 @@ class basic_ixz_streambuf : public basic_streambuf<CharT, Traits>
 			m_xzstream.reset(nullptr);
 		}
 
+		m_pending = false;
+		m_in_stream = false;
+
+		// this waits for the worker threads
+		m_threads = 0;
+		m_streams.clear();
+		m_decoded.clear();
+		m_decoding = 0;
+		m_current.clear();
+
 		this->setg(nullptr, nullptr, nullptr);
 
 		return this;
 	}
 
-	/// \brief Initialize a xz stream and set the upstream.
+	/// \brief Set the upstream, the xz stream is initialized on first use.
 	///
 	/// \param upstream The upstream streambuf
 	///
-	/// The zstream is constructed and an optional header is
-	/// read from upstream. The contents of the header are ignored
-	/// but we must maintain that structure.
+	/// Nothing is read from \a upstream until the first call to underflow,
+	/// which makes opening a file cheap.
 	base_type *init(streambuf_type *upstream) override
 	{
 		this->set_upstream(upstream);
 
 		close();
 
-		m_xzstream.reset(new lzma_stream);
+		this->reset_counters();
 
-		auto &xzstream = *m_xzstream.get();
-		xzstream = LZMA_STREAM_INIT;
+		m_pending = true;
+
+		return this;
+	}
 
-		int err = lzma_stream_decoder(&xzstream, UINT64_MAX, LZMA_TELL_NO_CHECK);
+	/// \brief Set the resource budgets, the memlimit is passed on to the decoder
+	void set_limits(const decompression_limits &limits) override
+	{
+		base_type::set_limits(limits);
 
-		return err == LZMA_OK ? this : nullptr;
+		if (m_xzstream)
+			::lzma_memlimit_set(m_xzstream.get(), memlimit());
 	}
 
   private:
-	/// \brief The actual work is done here.
-	int_type underflow() override
+	/// \brief Initialize the xz decoder
+	bool init_codec()
 	{
-		if (m_xzstream and this->m_upstream)
-		{
-			auto &zstream = *m_xzstream.get();
-			const std::streamsize kBufferByteSize = m_out_buffer.size();
+		m_pending = false;
 
-			while (this->gptr() == this->egptr())
-			{
-				zstream.next_out = reinterpret_cast<unsigned char *>(m_out_buffer.data());
-				zstream.avail_out = kBufferByteSize;
+		m_xzstream.reset(new lzma_stream);
 
-				if (zstream.avail_in == 0)
-				{
+		auto &xzstream = *m_xzstream.get();
+		xzstream = LZMA_STREAM_INIT;
+
+		// the decoder for the reference format is set up for each stream
+		if (m_reference_format)
+			return true;
+
+		auto threads = settings::defaults().get("xz", settings::direction::read).threads;
+
+		// Independent streams in seekable data are decoded in parallel, data
+		// that is still being written is not seekable in this sense.
+		if (threads > 1 and not this->m_wait_handler and locate_streams())
+		{
+			m_threads = threads;
+			return true;
+		}
+
+		int err;
+#if LZMA_VERSION >= 50040002
+		if (threads > 1)
+		{
+			// decodes the blocks of multi threaded encoders in parallel
+			lzma_mt mt{};
+			mt.flags = LZMA_TELL_NO_CHECK | LZMA_CONCATENATED;
+			mt.threads = threads;
+			mt.memlimit_threading = memlimit();
+			mt.memlimit_stop = memlimit();
+
+			err = lzma_stream_decoder_mt(&xzstream, &mt);
+		}
+		else
+#endif
+			err = lzma_stream_decoder(&xzstream, memlimit(), LZMA_TELL_NO_CHECK | LZMA_CONCATENATED);
+
+		if (err != LZMA_OK)
+			m_xzstream.reset(nullptr);
+
+		return err == LZMA_OK;
+	}
+
+	/// \brief The actual work is done here.
+	int_type underflow() override
+	{
+		if (m_pending and not init_codec())
+			return traits_type::eof();
+
+		if (m_reference_format)
+			return underflow_reference();
+
+		if (m_threads > 0)
+			return underflow_parallel();
+
+		if (m_xzstream and this->m_upstream)
+		{
+			auto &zstream = *m_xzstream.get();
+			const std::streamsize kBufferByteSize = m_out_buffer.size();
+
+			while (this->gptr() == this->egptr())
+			{
+				zstream.next_out = reinterpret_cast<unsigned char *>(m_out_buffer.data());
+				zstream.avail_out = kBufferByteSize;
+
+				std::streamsize read = 0;
+				if (zstream.avail_in == 0)
+				{
 					zstream.next_in = reinterpret_cast<unsigned char *>(m_in_buffer.data());
-					zstream.avail_in = this->m_upstream->sgetn(m_in_buffer.data(), m_in_buffer.size());
+					zstream.avail_in = this->read_upstream(m_in_buffer.data(), m_in_buffer.size());
+					read = zstream.avail_in;
 				}
 
-				int err = ::lzma_code(&zstream, LZMA_RUN);
+				// In concatenated mode the decoder needs to be told the input has ended
+				lzma_action action = zstream.avail_in == 0 ? LZMA_FINISH : LZMA_RUN;
+
+				int err = this->run_codec([&zstream, action] { return ::lzma_code(&zstream, action); });
 				std::streamsize n = kBufferByteSize - zstream.avail_out;
 
+				this->account(read, n);
+
+				if (err == LZMA_MEMLIMIT_ERROR)
+					throw limit_exceeded(limit_exceeded::limit_type::memory, "Decoder memory limit exceeded");
+
 				if (err == LZMA_STREAM_END or (err == LZMA_OK and n > 0))
 				{
 					this->setg(
@@ -625,11 +1907,361 @@ class basic_ixz_streambuf : public basic_streambuf<CharT, Traits>
 		return this->gptr() != this->egptr() ? traits_type::to_int_type(*this->gptr()) : traits_type::eof();
 	}
 
+	/// \brief underflow for the reference format, the streams are decoded using a raw LZMA2 decoder
+	int_type underflow_reference()
+	{
+		if (m_xzstream and this->m_upstream)
+		{
+			auto &zstream = *m_xzstream.get();
+			const std::streamsize kBufferByteSize = m_out_buffer.size();
+
+			while (this->gptr() == this->egptr())
+			{
+				if (not m_in_stream and not start_stream())
+					break;
+
+				zstream.next_out = reinterpret_cast<unsigned char *>(m_out_buffer.data());
+				zstream.avail_out = kBufferByteSize;
+
+				std::streamsize read = 0;
+				if (zstream.avail_in == 0)
+				{
+					zstream.next_in = reinterpret_cast<unsigned char *>(m_in_buffer.data());
+					zstream.avail_in = this->read_upstream(m_in_buffer.data(), m_in_buffer.size());
+					read = zstream.avail_in;
+				}
+
+				int err = this->run_codec([&zstream] { return ::lzma_code(&zstream, LZMA_RUN); });
+				std::streamsize n = kBufferByteSize - zstream.avail_out;
+
+				this->account(read, n);
+
+				m_stream_crc = detail::crc32(m_stream_crc, { reinterpret_cast<const char *>(m_out_buffer.data()), static_cast<size_t>(n) });
+				m_stream_size += n;
+
+				if (err == LZMA_STREAM_END and not end_stream())
+					break;
+
+				if (n > 0)
+					this->setg(m_out_buffer.data(), m_out_buffer.data(), m_out_buffer.data() + n);
+
+				if (err != LZMA_OK and err != LZMA_STREAM_END)
+					break;
+			}
+		}
+
+		return this->gptr() != this->egptr() ? traits_type::to_int_type(*this->gptr()) : traits_type::eof();
+	}
+
+	/// \brief underflow for streams decoded in parallel, the decoded streams are returned in order
+	int_type underflow_parallel()
+	{
+		while (this->gptr() == this->egptr())
+		{
+			schedule();
+
+			if (m_decoded.empty())
+				break;
+
+			auto result = this->run_codec([this] { return m_decoded.front().get(); });
+			m_decoded.pop_front();
+			m_decoding -= result.size;
+
+			if (result.err == LZMA_MEMLIMIT_ERROR)
+				throw limit_exceeded(limit_exceeded::limit_type::memory, "Decoder memory limit exceeded");
+
+			if (result.err != LZMA_OK)
+			{
+				m_streams.clear();
+				break;
+			}
+
+			m_current = std::move(result.data);
+			this->account(0, m_current.size());
+
+			this->setg(m_current.data(), m_current.data(), m_current.data() + m_current.size());
+		}
+
+		return this->gptr() != this->egptr() ? traits_type::to_int_type(*this->gptr()) : traits_type::eof();
+	}
+
+	/// \brief Read the next streams from upstream and decode them on worker
+	/// threads, until m_threads streams are in flight.
+	void schedule()
+	{
+		while (m_decoded.size() < m_threads and not m_streams.empty())
+		{
+			auto stream = m_streams.front();
+
+			// The sizes are taken from the index in the file, check them against the
+			// limits before allocating. Streams already scheduled are returned first.
+			auto total_out = this->m_total_out + m_decoding + stream.uncompressed_size;
+			auto total_in = this->m_total_in + stream.compressed_size;
+			auto &limits = this->m_limits;
+
+			if ((limits.max_output > 0 and total_out > limits.max_output) or
+				(limits.max_ratio > 0 and total_out > limits.max_ratio * total_in))
+			{
+				if (not m_decoded.empty())
+					break;
+
+				this->account(stream.compressed_size, stream.uncompressed_size);
+			}
+
+			m_streams.pop_front();
+
+			std::vector<std::uint8_t> in(stream.compressed_size);
+
+			if (this->m_upstream->pubseekpos(m_start + off_type(stream.offset), std::ios_base::in) == pos_type(off_type(-1)) or
+				this->m_upstream->sgetn(reinterpret_cast<char_type *>(in.data()), in.size()) != static_cast<std::streamsize>(in.size()))
+			{
+				m_streams.clear();
+				break;
+			}
+
+			this->account(in.size(), 0);
+
+			m_decoding += stream.uncompressed_size;
+
+			m_decoded.emplace_back(std::async(std::launch::async,
+				[in = std::move(in), size = stream.uncompressed_size, limit = memlimit()]() mutable
+				{
+					decoded_stream result;
+					result.size = size;
+					result.data.resize(size);
+
+					size_t in_pos = 0, out_pos = 0;
+					result.err = ::lzma_stream_buffer_decode(&limit, 0, nullptr, in.data(), &in_pos, in.size(),
+						reinterpret_cast<std::uint8_t *>(result.data.data()), &out_pos, result.data.size());
+
+					if (result.err == LZMA_OK and out_pos != result.data.size())
+						result.err = LZMA_DATA_ERROR;
+
+					return result;
+				}));
+		}
+	}
+
+	/// \brief Locate the xz streams in upstream by parsing the stream footers and indices
+	/// backwards from the end. Returns false, leaving upstream where it was, if upstream is
+	/// not seekable, holds a single stream or holds streams too large to decode in memory.
+	/// Reading the indices requires liblzma 5.4, with older versions this returns false.
+	bool locate_streams()
+	{
+#if LZMA_VERSION >= 50040002
+		auto &upstream = *this->m_upstream;
+		const pos_type kError(off_type(-1));
+
+		auto start = upstream.pubseekoff(0, std::ios_base::cur, std::ios_base::in);
+		if (start == kError)
+			return false;
+
+		auto end = upstream.pubseekoff(0, std::ios_base::end, std::ios_base::in);
+
+		std::deque<stream_info> streams;
+		lzma_index *index = nullptr;
+		lzma_stream strm = LZMA_STREAM_INIT;
+
+		if (end != kError and end > start and
+			::lzma_file_info_decoder(&strm, &index, memlimit(), static_cast<std::uint64_t>(end - start)) == LZMA_OK)
+		{
+			upstream.pubseekpos(start, std::ios_base::in);
+
+			lzma_ret err;
+			do
+			{
+				if (strm.avail_in == 0)
+				{
+					strm.next_in = reinterpret_cast<const std::uint8_t *>(m_in_buffer.data());
+					strm.avail_in = upstream.sgetn(m_in_buffer.data(), m_in_buffer.size());
+				}
+
+				err = ::lzma_code(&strm, LZMA_RUN);
+
+				if (err == LZMA_SEEK_NEEDED)
+				{
+					if (upstream.pubseekpos(start + off_type(strm.seek_pos), std::ios_base::in) == kError)
+						break;
+
+					strm.avail_in = 0;
+					err = LZMA_OK;
+				}
+			} while (err == LZMA_OK);
+
+			if (err == LZMA_STREAM_END)
+			{
+				lzma_index_iter iter;
+				lzma_index_iter_init(&iter, index);
+
+				while (not ::lzma_index_iter_next(&iter, LZMA_INDEX_ITER_STREAM))
+				{
+					if (iter.stream.uncompressed_size > kMaxParallelStreamSize)
+					{
+						streams.clear();
+						break;
+					}
+
+					// empty streams produce no data
+					if (iter.stream.uncompressed_size > 0)
+						streams.push_back({ iter.stream.compressed_offset, iter.stream.compressed_size, iter.stream.uncompressed_size });
+				}
+			}
+
+			::lzma_index_end(index, nullptr);
+		}
+
+		::lzma_end(&strm);
+
+		upstream.pubseekpos(start, std::ios_base::in);
+
+		if (streams.size() < 2)
+			return false;
+
+		m_start = start;
+		m_streams = std::move(streams);
+
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	/// \brief Read exactly \a size bytes of input into \a data
+	bool read_exact(std::uint8_t *data, size_t size)
+	{
+		auto &zstream = *m_xzstream.get();
+
+		while (size > 0)
+		{
+			if (zstream.avail_in == 0)
+			{
+				zstream.next_in = reinterpret_cast<unsigned char *>(m_in_buffer.data());
+				zstream.avail_in = this->read_upstream(m_in_buffer.data(), m_in_buffer.size());
+				this->account(zstream.avail_in, 0);
+
+				if (zstream.avail_in == 0)
+					return false;
+			}
+
+			auto n = std::min<size_t>(size, zstream.avail_in);
+			data = std::copy(zstream.next_in, zstream.next_in + n, data);
+			zstream.next_in += n;
+			zstream.avail_in -= n;
+			size -= n;
+		}
+
+		return true;
+	}
+
+	/// \brief Read the header of the next stream and set up the decoder, returns false at the end
+	/// of the data or when the header is invalid. Throws reference_mismatch if the stream was
+	/// written for another reference.
+	bool start_stream()
+	{
+		std::uint8_t header[detail::kReferenceHeaderSize];
+
+		if (not read_exact(header, sizeof(header)) or
+			std::string_view(reinterpret_cast<char *>(header), detail::kReferenceSignature.length()) != detail::kReferenceSignature)
+			return false;
+
+		std::string_view reference = this->m_reference ? std::string_view(*this->m_reference) : std::string_view{};
+
+		if (detail::get_le(header + 12, 8) != reference.size() or
+			detail::get_le(header + 20, 4) != detail::crc32(0, reference))
+			throw reference_mismatch();
+
+		detail::reference_filters filters(LZMA_PRESET_DEFAULT, detail::get_le(header + 8, 4), reference);
+
+		if (not filters.ok)
+			return false;
+
+		if (::lzma_raw_decoder_memusage(filters.filters) > memlimit())
+			throw limit_exceeded(limit_exceeded::limit_type::memory, "Decoder memory limit exceeded");
+
+		if (::lzma_raw_decoder(m_xzstream.get(), filters.filters) != LZMA_OK)
+			return false;
+
+		m_in_stream = true;
+		m_stream_crc = 0;
+		m_stream_size = 0;
+
+		return true;
+	}
+
+	/// \brief Read and check the trailer of a stream
+	bool end_stream()
+	{
+		std::uint8_t trailer[detail::kReferenceTrailerSize];
+
+		m_in_stream = false;
+
+		return read_exact(trailer, sizeof(trailer)) and
+		       detail::get_le(trailer, 4) == m_stream_crc and
+		       detail::get_le(trailer + 4, 8) == m_stream_size;
+	}
+
+	/// \brief The memlimit to use for the decoder
+	std::uint64_t memlimit() const
+	{
+		return this->m_limits.memlimit ? this->m_limits.memlimit : UINT64_MAX;
+	}
+
+  protected:
+	/// \brief Set for the reference format, see xz_reference_codec
+	bool m_reference_format = false;
+
   private:
 	/// \brief The xz internal structures are mainained as pointers to avoid having
 	/// to copy their content in move constructors.
 	std::unique_ptr<lzma_stream> m_xzstream;
 
+	/// \brief Set by init, the xz stream is created on first use
+	bool m_pending = false;
+
+	/// \brief Set while decoding the data of a stream in the reference format
+	bool m_in_stream = false;
+
+	/// \brief The CRC-32 and size of the data decoded from the current stream in the reference format
+	std::uint32_t m_stream_crc = 0;
+	std::uint64_t m_stream_size = 0;
+
+	/// \brief Streams larger than this are not decoded in parallel, since each is decoded in memory
+	static constexpr std::uint64_t kMaxParallelStreamSize = 256 * 1024 * 1024;
+
+	/// \brief The location of an xz stream in upstream, relative to m_start
+	struct stream_info
+	{
+		std::uint64_t offset;
+		std::uint64_t compressed_size;
+		std::uint64_t uncompressed_size;
+	};
+
+	/// \brief A stream decoded by a worker thread
+	struct decoded_stream
+	{
+		std::vector<char_type> data;
+		std::uint64_t size;
+		lzma_ret err = LZMA_OK;
+	};
+
+	/// \brief The position of the first stream in upstream
+	pos_type m_start{};
+
+	/// \brief The number of streams decoded in parallel, zero when decoding serially
+	unsigned m_threads = 0;
+
+	/// \brief The streams not yet scheduled for decoding
+	std::deque<stream_info> m_streams;
+
+	/// \brief The streams being decoded, in order
+	std::deque<std::future<decoded_stream>> m_decoded;
+
+	/// \brief The sum of the uncompressed sizes of the streams being decoded
+	std::uint64_t m_decoding = 0;
+
+	/// \brief The decoded stream the get area points into
+	std::vector<char_type> m_current;
+
 	/// \brief Input buffer, this is the input for xz
 	std::array<char_type, BufferSize> m_in_buffer;
 
@@ -637,6 +2269,23 @@ class basic_ixz_streambuf : public basic_streambuf<CharT, Traits>
 	std::array<char_type, BufferSize> m_out_buffer;
 };
 
+/// \brief A streambuf class that decompresses the xz reference format
+///
+/// Data compressed using compression_options::reference is written as
+/// raw LZMA2 streams that use the reference as preset dictionary. The same
+/// reference should be passed using set_reference, the data is rejected
+/// when its size or CRC-32 does not match.
+
+template <typename CharT, typename Traits, size_t BufferSize = kDefaultBufferSize>
+class basic_ixz_reference_streambuf : public basic_ixz_streambuf<CharT, Traits, BufferSize>
+{
+  public:
+	basic_ixz_reference_streambuf()
+	{
+		this->m_reference_format = true;
+	}
+};
+
 // --------------------------------------------------------------------
 
 /// \brief A streambuf class that can be used to compress data using xz
@@ -670,6 +2319,10 @@ class basic_oxz_streambuf : public basic_streambuf<CharT, Traits>
 		: base_type(std::move(rhs))
 	{
 		std::swap(m_xzstream, rhs.m_xzstream);
+		m_pending = std::exchange(rhs.m_pending, false);
+		m_reference_format = rhs.m_reference_format;
+		m_stream_crc = rhs.m_stream_crc;
+		m_stream_size = rhs.m_stream_size;
 
 		this->setp(m_in_buffer.data(), m_in_buffer.data() + m_in_buffer.size());
 		this->sputn(rhs.pbase(), rhs.pptr() - rhs.pbase());
@@ -684,6 +2337,10 @@ class basic_oxz_streambuf : public basic_streambuf<CharT, Traits>
 		base_type::operator=(std::move(rhs));
 
 		std::swap(m_xzstream, rhs.m_xzstream);
+		m_pending = std::exchange(rhs.m_pending, false);
+		m_reference_format = rhs.m_reference_format;
+		m_stream_crc = rhs.m_stream_crc;
+		m_stream_size = rhs.m_stream_size;
 
 		this->setp(m_in_buffer.data(), m_in_buffer.data() + m_in_buffer.size());
 		this->sputn(rhs.pbase(), rhs.pptr() - rhs.pbase());
@@ -698,710 +2355,5701 @@ class basic_oxz_streambuf : public basic_streambuf<CharT, Traits>
 	}
 
 	/// \brief This closes the xz stream and sets the put pointers to null.
+	///
+	/// If nothing was written the xz stream is initialized here
+	/// to make sure a valid, empty, xz file is written.
+	/// Returns nullptr if finishing the compressed data failed.
 	base_type *close() override
 	{
-		if (m_xzstream)
+		bool result = true;
+
+		if (m_xzstream or m_pending)
 		{
-			overflow(traits_type::eof());
+			result = write_put_area(true);
 
-			::lzma_end(m_xzstream.get());
+			if (m_xzstream)
+				::lzma_end(m_xzstream.get());
 
 			m_xzstream.reset(nullptr);
 		}
 
+		m_pending = false;
+
 		this->setp(nullptr, nullptr);
 
-		return this;
+		return result ? this : nullptr;
 	}
 
-	/// \brief Initialize the internal xz structures
+	/// \brief Set the upstream, the xz stream is initialized on first use
 	///
 	/// \param upstream The upstream streambuf
 	///
-	/// The xz stream is initialized as one that can accept
-	/// a gzip header.
+	/// The xz encoder allocates quite a bit of memory, so this is deferred
+	/// until the buffer needs to be written for the first time.
 	base_type *init(streambuf_type *upstream) override
 	{
 		this->set_upstream(upstream);
 
 		close();
 
-		m_xzstream.reset(new lzma_stream);
-
-		auto &zstream = *m_xzstream.get();
-		zstream = LZMA_STREAM_INIT;
+		this->reset_counters();
 
-		int err = lzma_easy_encoder(&zstream, 9, LZMA_CHECK_CRC64);
+		m_pending = true;
+		m_crc = 0;
+		m_last_checkpoint = 0;
 
-		if (err == LZMA_OK)
-			this->setp(this->m_in_buffer.data(), this->m_in_buffer.data() + this->m_in_buffer.size());
+		this->setp(this->m_in_buffer.data(), this->m_in_buffer.data() + this->m_in_buffer.size());
 
-		return err == LZMA_OK ? this : nullptr;
+		return this;
 	}
 
-  private:
-	/// \brief The actual work is done here
-	///
-	/// \param ch The character that did not fit, in case it is eof we need to flush
+	/// \brief Continue compressing after checkpoint \a cp
 	///
-	int_type overflow(int_type ch) override
+	/// Checkpoints in xz output are at the end of an xz stream,
+	/// resuming simply means starting a new stream.
+	bool resume(const checkpoint &cp) override
 	{
-		if (not m_xzstream)
-			return traits_type::eof();
+		if (not m_pending or this->pptr() != this->pbase())
+			return false;
 
-		auto &zstream = *m_xzstream;
+		m_crc = cp.crc;
+		m_last_checkpoint = this->m_total_in = cp.uncompressed;
+		this->m_total_out = cp.compressed;
 
-		zstream.next_in = reinterpret_cast<unsigned char *>(this->pbase());
-		zstream.avail_in = this->pptr() - this->pbase();
+		return true;
+	}
 
-		char_type buffer[BufferSize];
+  private:
+	/// \brief Initialize the internal xz structures
+	bool init_codec()
+	{
+		m_pending = false;
 
-		for (;;)
-		{
-			zstream.next_out = reinterpret_cast<unsigned char *>(buffer);
-			zstream.avail_out = sizeof(buffer);
+		m_xzstream.reset(new lzma_stream);
 
-			int err = ::lzma_code(&zstream, ch == traits_type::eof() ? LZMA_FINISH : LZMA_RUN);
+		auto &zstream = *m_xzstream.get();
+		zstream = LZMA_STREAM_INIT;
 
-			std::streamsize n = sizeof(buffer) - zstream.avail_out;
-			if (n > 0)
-			{
-				auto r = this->m_upstream->sputn(reinterpret_cast<char_type *>(buffer), n);
+		if (not start_stream())
+		{
+			m_xzstream.reset(nullptr);
+			return false;
+		}
 
-				if (r != n)
-					return traits_type::eof();
-			}
+		return true;
+	}
 
-			if (zstream.avail_out == 0)
-				continue;
+	/// \brief Set up the encoder for a new xz stream
+	bool start_stream()
+	{
+		auto &zstream = *m_xzstream.get();
 
-			if (err == LZMA_OK and ch == traits_type::eof())
-				continue;
+		uint32_t preset = this->m_options.level < 0 ? 9 : std::min<uint32_t>(this->m_options.level, 9);
 
-			break;
-		}
+		if (m_reference_format)
+			return start_reference_stream(preset);
 
-		this->setp(this->m_in_buffer.data(), this->m_in_buffer.data() + this->m_in_buffer.size());
+		auto threads = this->m_options.threads;
+		if (threads == 0)
+			threads = settings::defaults().get("xz", settings::direction::write).threads;
 
-		if (not traits_type::eq_int_type(ch, traits_type::eof()))
+		int err;
+		if (threads > 1)
 		{
-			*this->pptr() = traits_type::to_char_type(ch);
-			this->pbump(1);
+			lzma_mt mt{};
+			mt.threads = threads;
+			mt.preset = preset;
+			mt.check = LZMA_CHECK_CRC64;
+
+			err = lzma_stream_encoder_mt(&zstream, &mt);
+		}
+		else
+			err = lzma_easy_encoder(&zstream, preset, LZMA_CHECK_CRC64);
+
+		return err == LZMA_OK;
+	}
+
+	/// \brief The actual work is done here
+	///
+	/// \param ch The character that did not fit, in case it is eof we need to flush
+	///
+	int_type overflow(int_type ch) override
+	{
+		if (not write_put_area(traits_type::eq_int_type(ch, traits_type::eof())))
+			return traits_type::eof();
+
+		if (not traits_type::eq_int_type(ch, traits_type::eof()))
+		{
+			*this->pptr() = traits_type::to_char_type(ch);
+			this->pbump(1);
 		}
 
 		return ch;
 	}
 
-  private:
-	/// \brief The xz internal structures are mainained as pointers to avoid having
-	/// to copy their content in move constructors.
-	std::unique_ptr<lzma_stream> m_xzstream;
+	/// \brief Compress the contents of the put area
+	bool drain() override
+	{
+		return write_put_area(false);
+	}
 
-	/// \brief Input buffer, this is the input for xz
-	std::array<char_type, BufferSize> m_in_buffer;
-};
+	/// \brief Compress the put area and empty it, the xz stream is finished if \a finish is true
+	bool write_put_area(bool finish)
+	{
+		if (m_pending and not init_codec())
+			return false;
 
-#endif
+		if (not m_xzstream)
+			return false;
 
-// --------------------------------------------------------------------
+		if (not compress(this->pbase(), this->pptr() - this->pbase(), finish ? LZMA_FINISH : LZMA_RUN))
+			return false;
 
-/// \brief An istream implementation that wraps a streambuf with a decompressing streambuf
-///
-/// \tparam CharT		Type of the character stream.
-/// \tparam Traits		Traits for character type, defaults to char_traits<_CharT>.
-///
-/// This is an istream implementation that can take a source streambuf and then wraps
-/// this streambuf with a decompressing streambuf class defined above.
-/// The class inherits from std::basic_istream and offers all the associated functionality.
+		if (finish and not write_trailer())
+			return false;
 
-template <typename CharT, typename Traits>
-class basic_istream : public std::basic_istream<CharT, Traits>
-{
-  public:
-	using base_type = std::basic_istream<CharT, Traits>;
+		if (not finish and not checkpoint_if_due())
+			return false;
 
-	using traits_type = Traits;
-	using char_type = typename traits_type::char_type;
-	using int_type = typename traits_type::int_type;
+		this->setp(this->m_in_buffer.data(), this->m_in_buffer.data() + this->m_in_buffer.size());
 
-	using z_streambuf_type = basic_streambuf<char_type, traits_type>;
-	using upstreambuf_type = std::basic_streambuf<char_type, traits_type>;
+		return true;
+	}
 
-	using gzip_streambuf_type = basic_igzip_streambuf<char_type, traits_type>;
-#if HAVE_LibLZMA
-	using xz_streambuf_type = basic_ixz_streambuf<char_type, traits_type>;
-#endif
+	/// \brief Write a checkpoint if checkpoint_interval bytes were compressed since the last
+	bool checkpoint_if_due()
+	{
+		if (this->m_options.checkpoint_interval > 0 and
+			this->m_total_in - m_last_checkpoint >= this->m_options.checkpoint_interval)
+			return write_checkpoint();
 
-	/// \brief Regular move constructor
-	basic_istream(basic_istream &&rhs)
-		: base_type(std::move(rhs))
+		return true;
+	}
+
+	/// \brief Write \a n characters, large writes are compressed directly from \a s
+	std::streamsize xsputn(const char_type *s, std::streamsize n) override
 	{
-		m_gxriobuf = std::move(rhs.m_gxriobuf);
+		if (n < static_cast<std::streamsize>(this->m_in_buffer.size()))
+			return streambuf_type::xsputn(s, n);
 
-		if (m_gxriobuf)
-			this->rdbuf(m_gxriobuf.get());
-		else
-			this->rdbuf(nullptr);
+		if (not write_put_area(false) or not compress(s, n, LZMA_RUN) or not checkpoint_if_due())
+			return 0;
+
+		return n;
 	}
 
-	/// \brief Regular move operator=
-	basic_istream &operator=(basic_istream &&rhs)
+	/// \brief Write fragments, batches that do not fit in the put area are passed
+	/// to the encoder directly, small fragments are collected first.
+	std::streamsize sputn_gather(const std::basic_string_view<CharT, Traits> *fragments, size_t count) override
 	{
-		base_type::operator=(std::move(rhs));
-		m_gxriobuf = std::move(rhs.m_gxriobuf);
+		auto length = detail::total_length(fragments, count);
 
-		if (m_gxriobuf)
-			this->rdbuf(m_gxriobuf.get());
-		else
-			this->rdbuf(nullptr);
+		if (length <= static_cast<size_t>(this->epptr() - this->pptr()))
+			return base_type::sputn_gather(fragments, count);
 
-		return *this;
+		auto compress_fragment = [this](const char_type *data, size_t size)
+		{
+			return compress(data, size, LZMA_RUN);
+		};
+
+		if (not write_put_area(false) or not detail::gather(fragments, count, compress_fragment) or not checkpoint_if_due())
+			return 0;
+
+		return length;
 	}
 
-	/// \brief Construct an istream with the passed in streambuf \a buf
-	///
-	/// \param buf The streambuf that provides the compressed data
+	/// \brief Compress \a size characters at \a data and write the result upstream
 	///
-	/// This constructor will initialize the zlib code with the \a buf streambuf.
-
-	explicit basic_istream(upstreambuf_type *buf)
-		: base_type(nullptr)
+	/// \param data The data to compress
+	/// \param size The number of characters in \a data
+	/// \param action The lzma action
+	/// \result false in case of an error
+	bool compress(const char_type *data, std::streamsize size, lzma_action action)
 	{
-		init_z(buf);
-	}
+		auto &zstream = *m_xzstream;
 
-  protected:
-	basic_istream()
-		: base_type(nullptr) {}
+		zstream.next_in = reinterpret_cast<const unsigned char *>(data);
+		zstream.avail_in = size;
 
-	/// \brief Initialise internals with streambuf \a sb
-	/// \param sb The upstream streambuf class
-	///
-	/// This will sniff the content in \a sb and decide upon what is found
-	/// what implementation is used. If it doesn't look like compressed data
-	/// the \a sb streambuf is used without any decompression being done.
+		this->m_total_in += size;
 
-	void init_z(upstreambuf_type *sb)
-	{
-		int_type ch = sb->sgetc();
-		if (ch == 0x1f)
-		{
-			sb->sbumpc();
-			ch = sb->sgetc();
-			sb->sungetc();
+		if (this->m_options.checkpoint_interval > 0 and size > 0)
+			m_crc = detail::crc32(m_crc, data, size);
 
-			if (ch == 0x8b) // Read gzip header
-				m_gxriobuf.reset(new gzip_streambuf_type);
+		if (m_reference_format and size > 0)
+		{
+			m_stream_crc = detail::crc32(m_stream_crc, data, size);
+			m_stream_size += size;
 		}
-#if HAVE_LibLZMA
-		else if (ch == 0xfd and sb->in_avail() >= 5)
+
+		char_type buffer[BufferSize];
+
+		for (;;)
 		{
-			sb->sbumpc();
-			char sig[4];
-			sb->sgetn(sig, 4);
+			zstream.next_out = reinterpret_cast<unsigned char *>(buffer);
+			zstream.avail_out = sizeof(buffer);
 
-			sb->sungetc();
-			sb->sungetc();
-			sb->sungetc();
-			sb->sungetc();
-			sb->sungetc();
+			int err = ::lzma_code(&zstream, action);
 
-			if (sig[0] == 0x37 and sig[1] == 0x7a and sig[2] == 0x58 and sig[3] == 0x5a)
-				m_gxriobuf.reset(new xz_streambuf_type);
-		}
-#endif
+			std::streamsize n = sizeof(buffer) - zstream.avail_out;
+			if (n > 0)
+			{
+				auto r = this->m_upstream->sputn(reinterpret_cast<char_type *>(buffer), n);
 
-		if (m_gxriobuf)
-		{
-			if (not m_gxriobuf->init(sb))
-				this->setstate(std::ios_base::failbit);
-			else
-				this->init(m_gxriobuf.get());
+				if (r != n)
+					return false;
+
+				this->m_total_out += n;
+			}
+
+			if (zstream.avail_out == 0)
+				continue;
+
+			if (err == LZMA_OK and action == LZMA_FINISH)
+				continue;
+
+			break;
 		}
-		else
-			this->init(sb);
+
+		return true;
+	}
+
+	/// \brief Write the header of a stream in the reference format and set up a raw encoder
+	///
+	/// The dictionary holds the reference and as much new data as the preset would.
+	bool start_reference_stream(uint32_t preset)
+	{
+		std::string_view reference = this->m_options.reference ? std::string_view(*this->m_options.reference) : std::string_view{};
+
+		lzma_options_lzma options;
+		if (lzma_lzma_preset(&options, preset))
+			return false;
+
+		auto dict_size = std::min<std::uint64_t>(reference.size() + options.dict_size, detail::kMaxDictSize);
+
+		detail::reference_filters filters(preset, dict_size, reference);
+
+		if (not filters.ok or ::lzma_raw_encoder(m_xzstream.get(), filters.filters) != LZMA_OK)
+			return false;
+
+		std::uint8_t header[detail::kReferenceHeaderSize];
+		std::copy(detail::kReferenceSignature.begin(), detail::kReferenceSignature.end(), header);
+		detail::put_le(header + 8, dict_size, 4);
+		detail::put_le(header + 12, reference.size(), 8);
+		detail::put_le(header + 20, detail::crc32(0, reference), 4);
+
+		if (this->m_upstream->sputn(reinterpret_cast<char_type *>(header), sizeof(header)) != sizeof(header))
+			return false;
+
+		this->m_total_out += sizeof(header);
+
+		m_stream_crc = 0;
+		m_stream_size = 0;
+
+		return true;
 	}
 
+	/// \brief Write the trailer of a stream in the reference format
+	bool write_trailer()
+	{
+		if (not m_reference_format)
+			return true;
+
+		std::uint8_t trailer[detail::kReferenceTrailerSize];
+		detail::put_le(trailer, m_stream_crc, 4);
+		detail::put_le(trailer + 4, m_stream_size, 8);
+
+		if (this->m_upstream->sputn(reinterpret_cast<char_type *>(trailer), sizeof(trailer)) != sizeof(trailer))
+			return false;
+
+		this->m_total_out += sizeof(trailer);
+
+		return true;
+	}
+
+	/// \brief Finish the current xz stream, report the checkpoint and start a new stream
+	bool write_checkpoint()
+	{
+		if (not compress(nullptr, 0, LZMA_FINISH) or not write_trailer() or not start_stream())
+			return false;
+
+		m_last_checkpoint = this->m_total_in;
+
+		checkpoint cp{ this->m_total_out, this->m_total_in, m_crc };
+
+		return not this->m_checkpoint_handler or this->m_checkpoint_handler(cp);
+	}
+
+  private:
+	/// \brief The xz internal structures are mainained as pointers to avoid having
+	/// to copy their content in move constructors.
+	std::unique_ptr<lzma_stream> m_xzstream;
+
+	/// \brief Set by init, the xz stream is created on first use
+	bool m_pending = false;
+
+	/// \brief The CRC-32 of the uncompressed data, only maintained with checkpoints
+	std::uint32_t m_crc = 0;
+
+	/// \brief The value of m_total_in at the last checkpoint
+	std::uint64_t m_last_checkpoint = 0;
+
+	/// \brief The CRC-32 and size of the data in the current stream in the reference format
+	std::uint32_t m_stream_crc = 0;
+	std::uint64_t m_stream_size = 0;
+
+	/// \brief Input buffer, this is the input for xz
+	std::array<char_type, BufferSize> m_in_buffer;
+
   protected:
-	/// \brief Our streambuf class
-	std::unique_ptr<z_streambuf_type> m_gxriobuf;
+	/// \brief Set for the reference format, see xz_reference_codec
+	bool m_reference_format = false;
+};
+
+/// \brief A streambuf class that compresses using compression_options::reference
+/// as preset dictionary, see basic_ixz_reference_streambuf.
+///
+/// The dictionary is made large enough to hold the reference, which takes about
+/// ten times its size in memory. Multiple threads are not used. The fast modes
+/// of levels 0 to 3 find few of the long matches in the reference, use level 4
+/// or higher.
+
+template <typename CharT, typename Traits, size_t BufferSize = kDefaultBufferSize>
+class basic_oxz_reference_streambuf : public basic_oxz_streambuf<CharT, Traits, BufferSize>
+{
+  public:
+	basic_oxz_reference_streambuf()
+	{
+		this->m_reference_format = true;
+	}
 };
 
+#endif
+
 // --------------------------------------------------------------------
+#if HAVE_Brotli
 
-/// \brief Control input from files compressed with gzip.
+/// \brief A streambuf class that can be used to decompress brotli data
 ///
 /// \tparam CharT		Type of the character stream.
 /// \tparam Traits		Traits for character type, defaults to char_traits<_CharT>.
+/// \tparam BufferSize	The size of the internal buffers.
 ///
-/// This is an ifstream implementation that can read from named files compressed with
-/// gzip directly. The class inherits from std::basic_istream and offers all the
-/// associated functionality.
+/// This implementation of streambuf can decompress data compressed
+/// using brotli. Brotli data has no signature, the codec is selected
+/// on the .br extension only.
 
-template <typename CharT, typename Traits>
-class basic_ifstream : public basic_istream<CharT, Traits>
+template <typename CharT, typename Traits, size_t BufferSize = kDefaultBufferSize, std::enable_if_t<sizeof(CharT) == 1, int> = 0>
+class basic_ibrotli_streambuf : public basic_streambuf<CharT, Traits>
 {
   public:
-	using base_type = basic_istream<CharT, Traits>;
-
 	using char_type = CharT;
 	using traits_type = Traits;
 
-	using filebuf_type = std::basic_filebuf<char_type, traits_type>;
+	using streambuf_type = std::basic_streambuf<char_type, traits_type>;
+	using base_type = basic_streambuf<CharT, Traits>;
 
-	using gzip_streambuf_type = typename base_type::gzip_streambuf_type;
-#if HAVE_LibLZMA
-	using xz_streambuf_type = typename base_type::xz_streambuf_type;
-#endif
+	using int_type = typename traits_type::int_type;
+	using pos_type = typename traits_type::pos_type;
+	using off_type = typename traits_type::off_type;
 
-	/// \brief Default constructor, does not open a file since none is specified
-	basic_ifstream() = default;
+	basic_ibrotli_streambuf() = default;
 
-	~basic_ifstream()
+	basic_ibrotli_streambuf(const basic_ibrotli_streambuf &) = delete;
+
+	/// \brief Move constructor
+	basic_ibrotli_streambuf(basic_ibrotli_streambuf &&rhs)
+		: base_type(std::move(rhs))
 	{
-		close();
+		move_from(rhs);
 	}
 
-	/// \brief Construct an ifstream
-	/// \param filename Null terminated string specifying the file to open
-	/// \param mode The mode in which to open the file
+	basic_ibrotli_streambuf &operator=(const basic_ibrotli_streambuf &) = delete;
 
-	explicit basic_ifstream(const char *filename, std::ios_base::openmode mode = std::ios_base::in)
+	/// \brief Move operator= implementation
+	basic_ibrotli_streambuf &operator=(basic_ibrotli_streambuf &&rhs)
 	{
-		open(filename, mode);
-	}
+		close();
 
-	/// \brief Construct an ifstream
-	/// \param filename std::string specifying the file to open
-	/// \param mode The mode in which to open the file
+		base_type::operator=(std::move(rhs));
+		move_from(rhs);
 
-	explicit basic_ifstream(const std::string &filename, std::ios_base::openmode mode = std::ios_base::in)
-	{
-		open(filename, mode);
+		return *this;
 	}
 
-	/// \brief Construct an ifstream
-	/// \param filename std::filesystem::path specifying the file to open
-	/// \param mode The mode in which to open the file
-
-	explicit basic_ifstream(const std::filesystem::path &filename, std::ios_base::openmode mode = std::ios_base::in)
+	~basic_ibrotli_streambuf()
 	{
-		open(filename, mode);
+		close();
 	}
 
-	/// \brief Move constructor
-	basic_ifstream(basic_ifstream &&rhs)
-		: base_type(std::move(rhs))
+	/// \brief This closes the brotli decoder and sets the get pointers to null.
+	base_type *close() override
 	{
-		m_filebuf = std::move(rhs.m_filebuf);
+		if (m_state)
+			::BrotliDecoderDestroyInstance(std::exchange(m_state, nullptr));
 
-		if (this->m_gxriobuf)
-			this->m_gxriobuf->set_upstream(&m_filebuf);
-		else
-			this->rdbuf(&m_filebuf);
-	}
+		m_pending = false;
+		m_in_begin = m_in_end = 0;
 
-	basic_ifstream(const basic_ifstream &) = delete;
+		this->setg(nullptr, nullptr, nullptr);
 
-	basic_ifstream &operator=(const basic_ifstream &) = delete;
+		return this;
+	}
 
-	/// \brief Move version of operator=
-	basic_ifstream &operator=(basic_ifstream &&rhs)
+	/// \brief Set the upstream, the brotli decoder is initialized on first use.
+	///
+	/// \param upstream The upstream streambuf
+	///
+	/// Nothing is read from \a upstream until the first call to underflow,
+	/// which makes opening a file cheap.
+	base_type *init(streambuf_type *upstream) override
 	{
-		base_type::operator=(std::move(rhs));
+		this->set_upstream(upstream);
 
-		m_filebuf = std::move(rhs.m_filebuf);
-		if (this->m_gxriobuf)
-			this->m_gxriobuf->set_upstream(&m_filebuf);
-		else
-			this->rdbuf(&m_filebuf);
+		close();
 
-		return *this;
-	}
+		this->reset_counters();
 
-	/// \brief Open the file \a filename with mode \a mode
-	/// \param filename std::filesystem::path specifying the file to open
-	/// \param mode The mode in which to open the file
+		m_pending = true;
 
-	void open(const std::filesystem::path &filename, std::ios_base::openmode mode = std::ios_base::in)
+		return this;
+	}
+
+  private:
+	/// \brief Take over the state of \a rhs
+	void move_from(basic_ibrotli_streambuf &rhs)
 	{
-		if (not m_filebuf.open(filename, mode | std::ios::binary))
-			this->setstate(std::ios_base::failbit);
-		else
-		{
-			if (filename.extension() == ".gz")
-				this->m_gxriobuf.reset(new gzip_streambuf_type);
-#if HAVE_LibLZMA
-			else if (filename.extension() == ".xz")
-				this->m_gxriobuf.reset(new xz_streambuf_type);
-#endif
+		m_state = std::exchange(rhs.m_state, nullptr);
+		m_pending = std::exchange(rhs.m_pending, false);
 
-			if (not this->m_gxriobuf)
-			{
-				this->rdbuf(&m_filebuf);
-				this->clear();
-			}
-			else if (not this->m_gxriobuf->init(&m_filebuf))
-				this->setstate(std::ios_base::failbit);
-			else
-			{
-				this->rdbuf(this->m_gxriobuf.get());
-				this->clear();
-			}
-		}
-	}
+		m_in_end = std::copy(rhs.m_in_buffer.data() + rhs.m_in_begin, rhs.m_in_buffer.data() + rhs.m_in_end, m_in_buffer.data()) - m_in_buffer.data();
+		m_in_begin = 0;
+		rhs.m_in_begin = rhs.m_in_end = 0;
 
-	/// \brief Open the file \a filename with mode \a mode
-	/// \param filename std::string specifying the file to open
-	/// \param mode The mode in which to open the file
+		auto p = std::copy(rhs.gptr(), rhs.egptr(), m_out_buffer.data());
+		this->setg(m_out_buffer.data(), m_out_buffer.data(), p);
+		rhs.setg(nullptr, nullptr, nullptr);
+	}
 
-	void open(const std::string &filename, std::ios_base::openmode mode = std::ios_base::in)
+	/// \brief Initialize the brotli decoder
+	bool init_codec()
 	{
-		open(std::filesystem::path{filename}, mode);
-	}
+		m_pending = false;
 
-	/// \brief Open the file \a filename with mode \a mode
-	/// \param filename Null terminated string specifying the file to open
-	/// \param mode The mode in which to open the file
+		m_state = ::BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
 
-	void open(const char *filename, std::ios_base::openmode mode = std::ios_base::in)
-	{
-		open(std::filesystem::path{filename}, mode);
+		return m_state != nullptr;
 	}
 
-	/// \brief Return true if the file is open
-	/// \return m_filebuf.is_open()
-
-	bool is_open() const
+	/// \brief The actual work is done here.
+	int_type underflow() override
 	{
-		return m_filebuf.is_open();
-	}
+		if (m_pending and not init_codec())
+			return traits_type::eof();
 
-	/// \brief Close the file
-	///
-	/// Calls m_filebuf.close(). If that fails, the failbit is set.
+		if (m_state and this->m_upstream)
+		{
+			while (this->gptr() == this->egptr())
+			{
+				std::streamsize read = 0;
+				if (m_in_begin == m_in_end)
+				{
+					m_in_begin = 0;
+					m_in_end = read = this->read_upstream(m_in_buffer.data(), m_in_buffer.size());
+				}
 
-	void close()
-	{
-		if (this->m_gxriobuf and not this->m_gxriobuf->close())
-			this->setstate(std::ios_base::failbit);
+				size_t avail_in = m_in_end - m_in_begin;
+				auto next_in = reinterpret_cast<const uint8_t *>(m_in_buffer.data() + m_in_begin);
 
-		if (not m_filebuf.close())
-			this->setstate(std::ios_base::failbit);
-	}
+				size_t avail_out = m_out_buffer.size();
+				auto next_out = reinterpret_cast<uint8_t *>(m_out_buffer.data());
 
-	/// \brief Swap the contents with those of \a rhs
-	/// \param rhs The ifstream to swap with
+				auto result = this->run_codec([&]
+					{ return ::BrotliDecoderDecompressStream(m_state, &avail_in, &next_in, &avail_out, &next_out, nullptr); });
 
-	void swap(basic_ifstream &rhs)
-	{
-		base_type::swap(rhs);
-		m_filebuf.swap(rhs.m_filebuf);
+				m_in_begin = m_in_end - avail_in;
+				std::streamsize n = m_out_buffer.size() - avail_out;
 
-		if (this->m_gxriobuf)
-		{
-			this->m_gxriobuf.set_upstream(&m_filebuf);
-			this->rdbuf(this->m_gxriobuf.get());
-		}
-		else
-			this->rdbuf(&m_filebuf);
+				this->account(read, n);
 
-		if (rhs.m_gxriobuf)
-		{
-			rhs.m_gxriobuf.set_upstream(&rhs.m_filebuf);
-			rhs.rdbuf(rhs.m_gxriobuf.get());
+				if (n > 0)
+				{
+					this->setg(
+						m_out_buffer.data(),
+						m_out_buffer.data(),
+						m_out_buffer.data() + n);
+					break;
+				}
+
+				// Stop at the end of the data, on errors and on truncated input
+				if (result == BROTLI_DECODER_RESULT_SUCCESS or result == BROTLI_DECODER_RESULT_ERROR or
+					(result == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT and read == 0 and m_in_begin == m_in_end))
+					break;
+			}
 		}
-		else
-			rhs.rdbuf(&rhs.m_filebuf);
+
+		return this->gptr() != this->egptr() ? traits_type::to_int_type(*this->gptr()) : traits_type::eof();
 	}
 
   private:
-	/// \brief The filebuf
-	filebuf_type m_filebuf;
+	/// \brief The brotli decoder
+	BrotliDecoderState *m_state = nullptr;
+
+	/// \brief Set by init, the decoder is created on first use
+	bool m_pending = false;
+
+	/// \brief Input buffer, this is the input for brotli
+	std::array<char_type, BufferSize> m_in_buffer;
+
+	/// \brief The range of unread data in m_in_buffer
+	size_t m_in_begin = 0, m_in_end = 0;
+
+	/// \brief Output buffer, where the istream finds the data
+	std::array<char_type, BufferSize> m_out_buffer;
 };
 
 // --------------------------------------------------------------------
 
-/// \brief An ostream implementation that wraps a streambuf with a compressing streambuf
+/// \brief A streambuf class that can be used to compress data using brotli
 ///
 /// \tparam CharT		Type of the character stream.
 /// \tparam Traits		Traits for character type, defaults to char_traits<_CharT>.
+/// \tparam BufferSize	The size of the internal buffers.
 ///
-/// This is an ostream implementation that can take an upstream streambuf and then wraps
-/// this streambuf with a compressing streambuf class defined above.
-/// The class inherits from std::basic_ostream and offers all the associated functionality.
+/// This implementation of streambuf can compress data using brotli. The
+/// compression level of the compression_options is used as brotli quality,
+/// window_bits sets the window size.
 
-template <typename CharT, typename Traits>
-class basic_ostream : public std::basic_ostream<CharT, Traits>
+template <typename CharT, typename Traits, size_t BufferSize = kDefaultBufferSize, std::enable_if_t<sizeof(CharT) == 1, int> = 0>
+class basic_obrotli_streambuf : public basic_streambuf<CharT, Traits>
 {
   public:
-	using base_type = std::basic_ostream<CharT, Traits>;
-
 	using char_type = CharT;
 	using traits_type = Traits;
 
-	using z_streambuf_type = basic_streambuf<char_type, traits_type>;
-	using upstreambuf_type = std::basic_streambuf<char_type, traits_type>;
+	using streambuf_type = std::basic_streambuf<char_type, traits_type>;
+	using base_type = basic_streambuf<CharT, Traits>;
 
-	/// \brief Regular move constructor
-	basic_ostream(basic_ostream &&rhs)
+	using int_type = typename traits_type::int_type;
+	using pos_type = typename traits_type::pos_type;
+	using off_type = typename traits_type::off_type;
+
+	basic_obrotli_streambuf() = default;
+
+	basic_obrotli_streambuf(const basic_obrotli_streambuf &) = delete;
+
+	/// \brief Move constructor
+	basic_obrotli_streambuf(basic_obrotli_streambuf &&rhs)
 		: base_type(std::move(rhs))
 	{
-		m_gxriobuf = std::move(rhs.m_gxriobuf);
-		this->rdbuf(m_gxriobuf.get());
+		m_state = std::exchange(rhs.m_state, nullptr);
+		m_pending = std::exchange(rhs.m_pending, false);
+
+		this->setp(m_in_buffer.data(), m_in_buffer.data() + m_in_buffer.size());
+		this->sputn(rhs.pbase(), rhs.pptr() - rhs.pbase());
+		rhs.setp(nullptr, nullptr);
 	}
 
-	/// \brief Regular move operator=
-	basic_ostream &operator=(basic_ostream &&rhs)
+	basic_obrotli_streambuf &operator=(const basic_obrotli_streambuf &) = delete;
+
+	/// \brief Move operator=
+	basic_obrotli_streambuf &operator=(basic_obrotli_streambuf &&rhs)
 	{
+		close();
+
 		base_type::operator=(std::move(rhs));
-		m_gxriobuf = std::move(rhs.m_gxriobuf);
 
-		this->rdbuf(m_gxriobuf.get());
+		m_state = std::exchange(rhs.m_state, nullptr);
+		m_pending = std::exchange(rhs.m_pending, false);
+
+		this->setp(m_in_buffer.data(), m_in_buffer.data() + m_in_buffer.size());
+		this->sputn(rhs.pbase(), rhs.pptr() - rhs.pbase());
+		rhs.setp(nullptr, nullptr);
 
 		return *this;
 	}
 
-	// One might expect a constructor taking a streambuf pointer
-	// as the regular std::ostream class does. However, that's not
-	// going to work since no information is known at this time
-	// what compression to use.
-	//
-	// explicit basic_ostream(upstreambuf_type *buf)
-	// {
-	// 	init_z(buf);
-	// 	this->init(m_gxriobuf.get());
-	// }
-
-  protected:
-	basic_ostream()
-		: base_type(nullptr) {}
-
-	/// \brief Initialise internals with streambuf \a sb
-	void init_z(std::streambuf *sb)
+	~basic_obrotli_streambuf()
 	{
-		if (not m_gxriobuf->init(sb))
-			this->setstate(std::ios_base::failbit);
+		close();
 	}
 
-  protected:
-	/// \brief Our streambuf class
-	std::unique_ptr<z_streambuf_type> m_gxriobuf;
-};
-
-// --------------------------------------------------------------------
+	/// \brief This finishes the brotli stream and sets the put pointers to null.
+	///
+	/// If nothing was written the encoder is initialized here
+	/// to make sure a valid, empty, brotli file is written.
+	/// Returns nullptr if finishing the compressed data failed.
+	base_type *close() override
+	{
+		bool result = true;
 
-/// \brief Control output to files compressing the contents with gzip.
-///
-/// \tparam CharT		Type of the character stream.
-/// \tparam Traits		Traits for character type, defaults to char_traits<_CharT>.
-///
-/// This is an ofstream implementation that can writeto named files compressing the content
-/// with gzip directly. The class inherits from std::basic_ostream and offers all the
-/// associated functionality.
+		if (m_state or m_pending)
+		{
+			result = write_put_area(true);
 
-template <typename CharT, typename Traits>
-class basic_ofstream : public basic_ostream<CharT, Traits>
-{
-  public:
-	using base_type = basic_ostream<CharT, Traits>;
+			if (m_state)
+				::BrotliEncoderDestroyInstance(std::exchange(m_state, nullptr));
+		}
 
-	using char_type = CharT;
-	using traits_type = Traits;
+		m_pending = false;
 
-	using filebuf_type = std::basic_filebuf<char_type, traits_type>;
-	using gzip_streambuf_type = basic_ogzip_streambuf<char_type, traits_type>;
-#if HAVE_LibLZMA
-	using xz_streambuf_type = basic_oxz_streambuf<char_type, traits_type>;
-#endif
+		this->setp(nullptr, nullptr);
 
-	basic_ofstream() = default;
+		return result ? this : nullptr;
+	}
 
-	~basic_ofstream()
+	/// \brief Set the upstream, the brotli encoder is initialized on first use
+	///
+	/// \param upstream The upstream streambuf
+	base_type *init(streambuf_type *upstream) override
 	{
+		this->set_upstream(upstream);
+
 		close();
-	}
 
-	/// \brief Construct an ofstream
-	/// \param filename Null terminated string specifying the file to open
-	/// \param mode The mode in which to open the file
+		this->reset_counters();
 
-	explicit basic_ofstream(const char *filename, std::ios_base::openmode mode = std::ios_base::out)
-	{
-		open(filename, mode);
-	}
+		m_pending = true;
 
-	/// \brief Construct an ofstream
-	/// \param filename std::string specifying the file to open
-	/// \param mode The mode in which to open the file
+		this->setp(this->m_in_buffer.data(), this->m_in_buffer.data() + this->m_in_buffer.size());
 
-	explicit basic_ofstream(const std::string &filename, std::ios_base::openmode mode = std::ios_base::out)
-	{
-		open(filename, mode);
+		return this;
 	}
 
-	/// \brief Construct an ofstream
-	/// \param filename std::filesystem::path specifying the file to open
-	/// \param mode The mode in which to open the file
-
-	explicit basic_ofstream(const std::filesystem::path &filename, std::ios_base::openmode mode = std::ios_base::out)
+  private:
+	/// \brief Create the encoder and set quality and window size
+	bool init_codec()
 	{
-		open(filename, mode);
-	}
+		m_pending = false;
 
-	/// \brief Move constructor
-	basic_ofstream(basic_ofstream &&rhs)
-		: base_type(std::move(rhs))
-	{
-		m_filebuf = std::move(rhs.m_filebuf);
-		if (this->m_gxriobuf)
-			this->m_gxriobuf->set_upstream(&m_filebuf);
-		else
-			this->rdbuf(&m_filebuf);
-	}
+		m_state = ::BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
+		if (m_state == nullptr)
+			return false;
 
-	basic_ofstream(const basic_ofstream &) = delete;
+		uint32_t quality = this->m_options.level < 0 ? BROTLI_MAX_QUALITY : std::min<uint32_t>(this->m_options.level, BROTLI_MAX_QUALITY);
 
-	basic_ofstream &operator=(const basic_ofstream &) = delete;
+		bool ok = ::BrotliEncoderSetParameter(m_state, BROTLI_PARAM_QUALITY, quality);
 
-	/// \brief Move operator=
-	basic_ofstream &operator=(basic_ofstream &&rhs)
-	{
-		base_type::operator=(std::move(rhs));
-		m_filebuf = std::move(rhs.m_filebuf);
-		if (this->m_gxriobuf)
-			this->m_gxriobuf->set_upstream(&m_filebuf);
-		else
-			this->rdbuf(&m_filebuf);
+		if (ok and this->m_options.window_bits != 0)
+		{
+			uint32_t lgwin = std::clamp<uint32_t>(this->m_options.window_bits, BROTLI_MIN_WINDOW_BITS, BROTLI_MAX_WINDOW_BITS);
+			ok = ::BrotliEncoderSetParameter(m_state, BROTLI_PARAM_LGWIN, lgwin);
+		}
+
+		if (not ok)
+			::BrotliEncoderDestroyInstance(std::exchange(m_state, nullptr));
+
+		return ok;
+	}
+
+	/// \brief The actual work is done here
+	///
+	/// \param ch The character that did not fit, in case it is eof we need to flush
+	///
+	int_type overflow(int_type ch) override
+	{
+		if (not write_put_area(traits_type::eq_int_type(ch, traits_type::eof())))
+			return traits_type::eof();
+
+		if (not traits_type::eq_int_type(ch, traits_type::eof()))
+		{
+			*this->pptr() = traits_type::to_char_type(ch);
+			this->pbump(1);
+		}
+
+		return ch;
+	}
+
+	/// \brief Compress the contents of the put area
+	bool drain() override
+	{
+		return write_put_area(false);
+	}
+
+	/// \brief Compress the put area and empty it, the brotli stream is finished if \a finish is true
+	bool write_put_area(bool finish)
+	{
+		if (m_pending and not init_codec())
+			return false;
+
+		if (not m_state)
+			return false;
+
+		if (not compress(this->pbase(), this->pptr() - this->pbase(),
+				finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS))
+			return false;
+
+		this->setp(this->m_in_buffer.data(), this->m_in_buffer.data() + this->m_in_buffer.size());
+
+		return true;
+	}
+
+	/// \brief Compress \a size characters at \a data and write the result upstream
+	///
+	/// \param data The data to compress
+	/// \param size The number of characters in \a data
+	/// \param op The brotli operation
+	/// \result false in case of an error
+	bool compress(const char_type *data, std::streamsize size, BrotliEncoderOperation op)
+	{
+		size_t avail_in = size;
+		auto next_in = reinterpret_cast<const uint8_t *>(data);
+
+		this->m_total_in += size;
+
+		char_type buffer[BufferSize];
+
+		for (;;)
+		{
+			size_t avail_out = sizeof(buffer);
+			auto next_out = reinterpret_cast<uint8_t *>(buffer);
+
+			if (not ::BrotliEncoderCompressStream(m_state, op, &avail_in, &next_in, &avail_out, &next_out, nullptr))
+				return false;
+
+			std::streamsize n = sizeof(buffer) - avail_out;
+			if (n > 0)
+			{
+				auto r = this->m_upstream->sputn(buffer, n);
+
+				if (r != n)
+					return false;
+
+				this->m_total_out += n;
+			}
+
+			if (avail_in > 0 or ::BrotliEncoderHasMoreOutput(m_state))
+				continue;
+
+			if (op == BROTLI_OPERATION_FINISH and not ::BrotliEncoderIsFinished(m_state))
+				continue;
+
+			break;
+		}
+
+		return true;
+	}
+
+  private:
+	/// \brief The brotli encoder
+	BrotliEncoderState *m_state = nullptr;
+
+	/// \brief Set by init, the encoder is created on first use
+	bool m_pending = false;
+
+	/// \brief Input buffer, this is the input for brotli
+	std::array<char_type, BufferSize> m_in_buffer;
+};
+
+#endif
+
+// --------------------------------------------------------------------
+
+/// \brief Description of the built-in gzip codec
+///
+/// A codec is described by a type with a name, a signature containing the
+/// magic bytes found at the start of the compressed data, a list of file name
+/// extensions and two alias templates for the decompressing and compressing
+/// streambuf classes. Codecs of your own can be added using register_codec.
+
+struct gzip_codec
+{
+	static constexpr std::string_view name = "gzip";
+	static constexpr std::string_view signature{ "\x1f\x8b", 2 };
+	static constexpr std::string_view extensions[] = { ".gz" };
+
+	template <typename CharT, typename Traits, size_t BufferSize>
+	using decompressor = basic_igzip_streambuf<CharT, Traits, BufferSize>;
+
+	template <typename CharT, typename Traits, size_t BufferSize>
+	using compressor = basic_ogzip_streambuf<CharT, Traits, BufferSize>;
+};
+
+#if HAVE_LibLZMA
+/// \brief Description of the built-in xz codec
+
+struct xz_codec
+{
+	static constexpr std::string_view name = "xz";
+	static constexpr std::string_view signature{ "\xfd\x37\x7a\x58\x5a\x00", 6 };
+	static constexpr std::string_view extensions[] = { ".xz" };
+
+	template <typename CharT, typename Traits, size_t BufferSize>
+	using decompressor = basic_ixz_streambuf<CharT, Traits, BufferSize>;
+
+	template <typename CharT, typename Traits, size_t BufferSize>
+	using compressor = basic_oxz_streambuf<CharT, Traits, BufferSize>;
+};
+
+/// \brief Description of the xz reference format, LZMA2 data compressed
+/// with compression_options::reference as preset dictionary
+
+struct xz_reference_codec
+{
+	static constexpr std::string_view name = "xz-reference";
+	static constexpr std::string_view signature = detail::kReferenceSignature;
+	static constexpr std::string_view extensions[] = { ".xzr" };
+
+	template <typename CharT, typename Traits, size_t BufferSize>
+	using decompressor = basic_ixz_reference_streambuf<CharT, Traits, BufferSize>;
+
+	template <typename CharT, typename Traits, size_t BufferSize>
+	using compressor = basic_oxz_reference_streambuf<CharT, Traits, BufferSize>;
+};
+#endif
+
+#if HAVE_Brotli
+/// \brief Description of the built-in brotli codec, brotli data has no signature
+
+struct brotli_codec
+{
+	static constexpr std::string_view name = "brotli";
+	static constexpr std::string_view signature{};
+	static constexpr std::string_view extensions[] = { ".br" };
+
+	template <typename CharT, typename Traits, size_t BufferSize>
+	using decompressor = basic_ibrotli_streambuf<CharT, Traits, BufferSize>;
+
+	template <typename CharT, typename Traits, size_t BufferSize>
+	using compressor = basic_obrotli_streambuf<CharT, Traits, BufferSize>;
+};
+#endif
+
+/// \brief A list of codec types
+template <typename... Codecs>
+struct codec_list
+{
+	/// \brief The length of the longest signature
+	static constexpr size_t max_signature_length = std::max({ size_t{ 0 }, Codecs::signature.length()... });
+};
+
+/// \brief The codecs that are built into gxrio, these are selected at compile time
+using builtin_codecs = codec_list<gzip_codec
+#if HAVE_LibLZMA
+	,
+	xz_codec, xz_reference_codec
+#endif
+#if HAVE_Brotli
+	,
+	brotli_codec
+#endif
+	>;
+
+/// \brief The maximum length of a codec signature, this is the number
+/// of bytes sniffed at the start of the input.
+inline constexpr size_t kMaxSignatureLength = 16;
+
+static_assert(builtin_codecs::max_signature_length <= kMaxSignatureLength);
+
+// --------------------------------------------------------------------
+
+/// \brief A registry for codecs that are not built into gxrio
+///
+/// \tparam CharT Type of the character stream.
+/// \tparam Traits Traits for character type, defaults to char_traits<_CharT>.
+///
+/// Codecs added here are consulted before the built-in codecs, a codec
+/// registered later takes precedence over one registered earlier. This makes
+/// it possible to replace the implementation of a built-in format.
+
+template <typename CharT, typename Traits>
+class basic_codec_registry
+{
+  public:
+	using streambuf_type = basic_streambuf<CharT, Traits>;
+
+	/// \brief A function creating a streambuf for a codec
+	using factory_type = std::function<std::unique_ptr<streambuf_type>()>;
+
+	/// \brief The information stored for a codec
+	struct codec_info
+	{
+		std::string name;
+		std::string signature;
+		std::vector<std::string> extensions;
+		factory_type decompressor, compressor;
+	};
+
+	/// \brief The global registry
+	static basic_codec_registry &instance()
+	{
+		static basic_codec_registry s_instance;
+		return s_instance;
+	}
+
+	/// \brief Add the codec described by \a info
+	///
+	/// The signature may be empty for codecs that are only selected by extension.
+	/// Throws std::invalid_argument if the signature is longer than kMaxSignatureLength.
+	void add(codec_info info)
+	{
+		if (info.signature.length() > kMaxSignatureLength)
+			throw std::invalid_argument("Codec signature is too long");
+
+		std::unique_lock lock(m_mutex);
+		m_codecs.insert(m_codecs.begin(), std::move(info));
+	}
+
+	/// \brief Add the codec described by type \a Codec, see gzip_codec for an example
+	template <typename Codec, size_t BufferSize = kDefaultBufferSize>
+	void add()
+	{
+		add({ std::string{ Codec::name },
+			std::string{ Codec::signature },
+			std::vector<std::string>(std::begin(Codec::extensions), std::end(Codec::extensions)),
+			[] { return std::make_unique<typename Codec::template decompressor<CharT, Traits, BufferSize>>(); },
+			[] { return std::make_unique<typename Codec::template compressor<CharT, Traits, BufferSize>>(); } });
+	}
+
+	/// \brief Return a decompressor for data starting with \a lookahead, or null
+	std::unique_ptr<streambuf_type> make_decompressor(std::string_view lookahead) const
+	{
+		std::unique_lock lock(m_mutex);
+
+		for (auto &codec : m_codecs)
+		{
+			if (codec.decompressor and not codec.signature.empty() and
+				lookahead.substr(0, codec.signature.length()) == codec.signature)
+				return codec.decompressor();
+		}
+
+		return {};
+	}
+
+	/// \brief Return a decompressor for files with extension \a ext, or null
+	std::unique_ptr<streambuf_type> make_decompressor(const std::filesystem::path &ext) const
+	{
+		std::unique_lock lock(m_mutex);
+
+		if (auto codec = find(ext); codec != nullptr and codec->decompressor)
+			return codec->decompressor();
+
+		return {};
+	}
+
+	/// \brief Return a compressor for files with extension \a ext, or null
+	std::unique_ptr<streambuf_type> make_compressor(const std::filesystem::path &ext) const
+	{
+		std::unique_lock lock(m_mutex);
+
+		if (auto codec = find(ext); codec != nullptr and codec->compressor)
+			return codec->compressor();
+
+		return {};
+	}
+
+	/// \brief Return the name of the codec for files with extension \a ext, or an empty string
+	std::string name(const std::filesystem::path &ext) const
+	{
+		std::unique_lock lock(m_mutex);
+
+		auto codec = find(ext);
+		return codec ? codec->name : std::string{};
+	}
+
+  private:
+	basic_codec_registry() = default;
+
+	const codec_info *find(const std::filesystem::path &ext) const
+	{
+		for (auto &codec : m_codecs)
+		{
+			if (std::find(codec.extensions.begin(), codec.extensions.end(), ext.string()) != codec.extensions.end())
+				return &codec;
+		}
+
+		return nullptr;
+	}
+
+	mutable std::mutex m_mutex;
+	std::vector<codec_info> m_codecs;
+};
+
+/// \brief Register codec \a Codec for streams of type \a CharT
+///
+/// \tparam Codec		A type describing the codec, see gzip_codec.
+/// \tparam CharT		Type of the character stream.
+/// \tparam Traits		Traits for character type, defaults to char_traits<_CharT>.
+/// \tparam BufferSize	The size of the buffers of the codec's streambufs.
+
+template <typename Codec, typename CharT = char, typename Traits = std::char_traits<CharT>, size_t BufferSize = kDefaultBufferSize>
+void register_codec()
+{
+	basic_codec_registry<CharT, Traits>::instance().template add<Codec, BufferSize>();
+}
+
+namespace detail
+{
+
+/// \brief Return the decompressor for the first of \a Codecs whose signature matches \a lookahead,
+/// codecs without a signature are skipped
+template <typename CharT, typename Traits, size_t BufferSize, typename... Codecs>
+std::unique_ptr<basic_streambuf<CharT, Traits>> sniff(std::string_view lookahead, codec_list<Codecs...>)
+{
+	std::unique_ptr<basic_streambuf<CharT, Traits>> result;
+
+	((not Codecs::signature.empty() and lookahead.substr(0, Codecs::signature.length()) == Codecs::signature and
+		 (result = std::make_unique<typename Codecs::template decompressor<CharT, Traits, BufferSize>>(), true)) or
+		...);
+
+	return result;
+}
+
+/// \brief Return true if \a ext is one of the extensions of \a Codec
+template <typename Codec>
+bool has_extension(const std::filesystem::path &ext)
+{
+	return std::find(std::begin(Codec::extensions), std::end(Codec::extensions), ext.string()) != std::end(Codec::extensions);
+}
+
+/// \brief Return the decompressor, if \a Decompress is true, or compressor for the
+/// first of \a Codecs that handles extension \a ext
+template <typename CharT, typename Traits, size_t BufferSize, bool Decompress, typename... Codecs>
+std::unique_ptr<basic_streambuf<CharT, Traits>> by_extension(const std::filesystem::path &ext, codec_list<Codecs...>)
+{
+	std::unique_ptr<basic_streambuf<CharT, Traits>> result;
+
+	((has_extension<Codecs>(ext) and
+		 (result = Decompress
+					   ? std::unique_ptr<basic_streambuf<CharT, Traits>>(std::make_unique<typename Codecs::template decompressor<CharT, Traits, BufferSize>>())
+					   : std::unique_ptr<basic_streambuf<CharT, Traits>>(std::make_unique<typename Codecs::template compressor<CharT, Traits, BufferSize>>()),
+			 true)) or
+		...);
+
+	return result;
+}
+
+/// \brief Return the name of the built-in codec for extension \a ext, or none
+template <typename... Codecs>
+std::string_view codec_name(const std::filesystem::path &ext, codec_list<Codecs...>)
+{
+	std::string_view result = "none";
+	((has_extension<Codecs>(ext) ? (result = Codecs::name, true) : false) or ...);
+	return result;
+}
+
+/// \brief Return the name of the codec used for \a filename, none for uncompressed files
+template <typename CharT, typename Traits>
+std::string codec_name(const std::filesystem::path &filename)
+{
+	auto result = basic_codec_registry<CharT, Traits>::instance().name(filename.extension());
+	if (result.empty())
+		result = codec_name(filename.extension(), builtin_codecs{});
+	return result;
+}
+
+/// \brief Give \a filebuf a buffer of the size configured in gxrio::settings for
+/// the codec of \a filename, \a buffer holds the storage. Must be called while
+/// \a filebuf is closed.
+template <typename CharT, typename Traits>
+void set_file_buffer(std::basic_filebuf<CharT, Traits> &filebuf, std::vector<CharT> &buffer,
+	const std::filesystem::path &filename, settings::direction dir)
+{
+	auto size = settings::defaults().get(codec_name<CharT, Traits>(filename), dir).buffer_size;
+	if (size > 0)
+	{
+		buffer.resize(size);
+		filebuf.pubsetbuf(buffer.data(), buffer.size());
+	}
+}
+
+/// \brief Copy up to \a size characters at the start of \a sb into \a buffer
+///
+/// When these characters are buffered in \a sb they are put back and \a consumed
+/// is set to false. Otherwise, e.g. for an unbuffered streambuf, they are read
+/// from \a sb and \a consumed is set to true.
+template <typename CharT, typename Traits>
+std::string_view lookahead(std::basic_streambuf<CharT, Traits> *sb, char *buffer, size_t size, bool &consumed)
+{
+	consumed = false;
+
+	if (Traits::eq_int_type(sb->sgetc(), Traits::eof()))
+		return {};
+
+	CharT data[kMaxSignatureLength];
+	auto n = static_cast<std::streamsize>(std::min(size, kMaxSignatureLength));
+
+	// Putting back is only safe for characters in the get area
+	consumed = sb->in_avail() < n;
+	n = std::max<std::streamsize>(sb->sgetn(data, n), 0);
+
+	for (std::streamsize i = 0; i < n; ++i)
+	{
+		buffer[i] = static_cast<char>(data[i]);
+		if (not consumed)
+			sb->sungetc();
+	}
+
+	return { buffer, static_cast<size_t>(n) };
+}
+
+/// \brief A streambuf returning a prefix, read from \a upstream before, followed
+/// by the rest of \a upstream
+///
+/// There is no buffering, once the prefix is read all calls are passed on to
+/// upstream. Seeking drops the prefix when upstream could be positioned.
+template <typename CharT, typename Traits>
+class basic_prefix_streambuf : public std::basic_streambuf<CharT, Traits>
+{
+  public:
+	using char_type = CharT;
+	using traits_type = Traits;
+
+	using streambuf_type = std::basic_streambuf<char_type, traits_type>;
+
+	using int_type = typename traits_type::int_type;
+	using pos_type = typename traits_type::pos_type;
+	using off_type = typename traits_type::off_type;
+
+	/// \brief Read \a prefix first and then \a upstream
+	basic_prefix_streambuf(streambuf_type *upstream, std::string_view prefix)
+		: m_upstream(upstream)
+		, m_prefix(prefix.length())
+	{
+		std::transform(prefix.begin(), prefix.end(), m_prefix.begin(),
+			[](char ch) { return static_cast<char_type>(ch); });
+		this->setg(m_prefix.data(), m_prefix.data(), m_prefix.data() + m_prefix.size());
+	}
+
+	basic_prefix_streambuf(const basic_prefix_streambuf &) = delete;
+	basic_prefix_streambuf &operator=(const basic_prefix_streambuf &) = delete;
+
+  protected:
+	std::streamsize showmanyc() override
+	{
+		return this->gptr() != this->egptr() ? this->egptr() - this->gptr() : m_upstream->in_avail();
+	}
+
+	int_type underflow() override
+	{
+		return this->gptr() != this->egptr() ? traits_type::to_int_type(*this->gptr()) : m_upstream->sgetc();
+	}
+
+	int_type uflow() override
+	{
+		if (this->gptr() == this->egptr())
+			return m_upstream->sbumpc();
+
+		auto result = traits_type::to_int_type(*this->gptr());
+		this->gbump(1);
+		return result;
+	}
+
+	std::streamsize xsgetn(char_type *s, std::streamsize n) override
+	{
+		std::streamsize result = std::min<std::streamsize>(this->egptr() - this->gptr(), n);
+		traits_type::copy(s, this->gptr(), result);
+		this->gbump(static_cast<int>(result));
+
+		if (result < n)
+			result += std::max<std::streamsize>(m_upstream->sgetn(s + result, n - result), 0);
+
+		return result;
+	}
+
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override
+	{
+		if (dir == std::ios_base::cur)
+			off -= this->egptr() - this->gptr();
+
+		return drop_prefix(m_upstream->pubseekoff(off, dir, which));
+	}
+
+	pos_type seekpos(pos_type pos, std::ios_base::openmode which) override
+	{
+		return drop_prefix(m_upstream->pubseekpos(pos, which));
+	}
+
+  private:
+	pos_type drop_prefix(pos_type pos)
+	{
+		if (pos != pos_type(off_type(-1)))
+			this->setg(m_prefix.data(), m_prefix.data() + m_prefix.size(), m_prefix.data() + m_prefix.size());
+		return pos;
+	}
+
+	streambuf_type *m_upstream;
+	std::vector<char_type> m_prefix;
+};
+
+/// \brief Create a decompressor for data starting with \a lookahead
+template <typename CharT, typename Traits, size_t BufferSize>
+std::unique_ptr<basic_streambuf<CharT, Traits>> make_decompressor(std::string_view lookahead)
+{
+	auto result = basic_codec_registry<CharT, Traits>::instance().make_decompressor(lookahead);
+	if (not result)
+		result = sniff<CharT, Traits, BufferSize>(lookahead, builtin_codecs{});
+	return result;
+}
+
+/// \brief Create a decompressor for a file named \a filename
+template <typename CharT, typename Traits, size_t BufferSize>
+std::unique_ptr<basic_streambuf<CharT, Traits>> make_decompressor(const std::filesystem::path &filename)
+{
+	auto result = basic_codec_registry<CharT, Traits>::instance().make_decompressor(filename.extension());
+	if (not result)
+		result = by_extension<CharT, Traits, BufferSize, true>(filename.extension(), builtin_codecs{});
+	return result;
+}
+
+/// \brief Create a compressor for a file named \a filename
+template <typename CharT, typename Traits, size_t BufferSize>
+std::unique_ptr<basic_streambuf<CharT, Traits>> make_compressor(const std::filesystem::path &filename)
+{
+	auto result = basic_codec_registry<CharT, Traits>::instance().make_compressor(filename.extension());
+	if (not result)
+		result = by_extension<CharT, Traits, BufferSize, false>(filename.extension(), builtin_codecs{});
+	return result;
+}
+
+} // namespace detail
+
+// --------------------------------------------------------------------
+
+namespace detail
+{
+
+/// \brief Waits for a file to grow, used by basic_ifstream::follow
+class follower
+{
+  public:
+	follower(const follow_options &options)
+		: m_options(options)
+	{
+	}
+
+	follower(const follower &) = delete;
+	follower &operator=(const follower &) = delete;
+
+	~follower()
+	{
+#if defined(__linux__)
+		if (m_fd >= 0)
+			::close(m_fd);
+#endif
+	}
+
+	const follow_options &options() const
+	{
+		return m_options;
+	}
+
+	/// \brief Start watching \a file for changes
+	void watch(const std::filesystem::path &file)
+	{
+#if defined(__linux__)
+		if (m_fd >= 0)
+			::close(m_fd);
+
+		m_fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (m_fd >= 0 and ::inotify_add_watch(m_fd, file.c_str(), IN_MODIFY | IN_CLOSE_WRITE) < 0)
+		{
+			::close(m_fd);
+			m_fd = -1;
+		}
+#endif
+	}
+
+	void stop()
+	{
+		m_stopped = true;
+	}
+
+	/// \brief Wait until the file may have grown, \a idle is the time waited so far.
+	/// Returns false if following should stop.
+	bool wait(std::chrono::steady_clock::duration idle)
+	{
+		if (m_stopped)
+			return false;
+
+		auto timeout = m_options.poll_interval;
+
+		if (m_options.idle_timeout.count() > 0)
+		{
+			if (idle >= m_options.idle_timeout)
+				return false;
+
+			timeout = std::min(timeout,
+				std::chrono::ceil<std::chrono::milliseconds>(m_options.idle_timeout - idle));
+		}
+
+#if defined(__linux__)
+		if (m_fd >= 0)
+		{
+			pollfd pfd{ m_fd, POLLIN, 0 };
+			if (::poll(&pfd, 1, static_cast<int>(timeout.count())) > 0)
+			{
+				// drain the events, we only need to know something happened
+				char events[4096];
+				while (::read(m_fd, events, sizeof(events)) > 0)
+					;
+			}
+		}
+		else
+#endif
+			std::this_thread::sleep_for(timeout);
+
+		return not m_stopped;
+	}
+
+  private:
+	follow_options m_options;
+	std::atomic<bool> m_stopped{ false };
+#if defined(__linux__)
+	int m_fd = -1;
+#endif
+};
+
+} // namespace detail
+
+// --------------------------------------------------------------------
+
+/// \brief A streambuf that keeps a window of the data read from another streambuf
+///
+/// \tparam CharT Type of the character stream.
+/// \tparam Traits Traits for character type, defaults to char_traits<_CharT>.
+///
+/// The last \a history characters read remain available, seeking back
+/// into this window and tellg work, without reading the upstream again.
+/// Used by basic_istream::set_history.
+
+template <typename CharT, typename Traits>
+class basic_rewind_streambuf : public basic_streambuf<CharT, Traits>
+{
+  public:
+	using char_type = CharT;
+	using traits_type = Traits;
+
+	using streambuf_type = std::basic_streambuf<char_type, traits_type>;
+	using base_type = basic_streambuf<CharT, Traits>;
+
+	using int_type = typename traits_type::int_type;
+	using pos_type = typename traits_type::pos_type;
+	using off_type = typename traits_type::off_type;
+
+	/// \brief Construct a streambuf that keeps at least \a history characters
+	explicit basic_rewind_streambuf(size_t history)
+		: m_history(history)
+		, m_buffer(history + std::max<size_t>(history, 4096))
+	{
+	}
+
+	basic_rewind_streambuf(const basic_rewind_streambuf &) = delete;
+	basic_rewind_streambuf &operator=(const basic_rewind_streambuf &) = delete;
+
+	/// \brief Start reading from \a upstream, the history is cleared
+	base_type *init(streambuf_type *upstream) override
+	{
+		return init(upstream, {});
+	}
+
+	/// \brief Start reading from \a upstream, the history is cleared and the
+	/// characters in \a pending, already read from \a upstream, are read first.
+	base_type *init(streambuf_type *upstream, std::basic_string_view<CharT, Traits> pending)
+	{
+		this->set_upstream(upstream);
+
+		if (m_buffer.size() < pending.length())
+			m_buffer.resize(pending.length());
+
+		auto e = std::copy(pending.begin(), pending.end(), m_buffer.data());
+
+		m_start = 0;
+		this->setg(m_buffer.data(), m_buffer.data(), e);
+
+		return this;
+	}
+
+	/// \brief The streambuf read from
+	streambuf_type *get_upstream() const
+	{
+		return this->m_upstream;
+	}
+
+	/// \brief The characters read from upstream that were not read from this streambuf yet
+	std::basic_string_view<CharT, Traits> pending() const
+	{
+		return { this->gptr(), static_cast<size_t>(this->egptr() - this->gptr()) };
+	}
+
+	/// \brief Clear the history
+	base_type *close() override
+	{
+		m_start = 0;
+		this->setg(nullptr, nullptr, nullptr);
+
+		return this;
+	}
+
+  protected:
+	int_type underflow() override
+	{
+		if (this->gptr() == this->egptr() and this->m_upstream)
+		{
+			size_t used = this->egptr() - this->eback();
+
+			// Buffer is full, keep the last m_history characters
+			if (used == m_buffer.size())
+			{
+				size_t drop = used - m_history;
+				std::copy(m_buffer.data() + drop, m_buffer.data() + used, m_buffer.data());
+				m_start += drop;
+				used = m_history;
+			}
+
+			auto n = this->m_upstream->sgetn(m_buffer.data() + used, m_buffer.size() - used);
+			this->setg(m_buffer.data(), m_buffer.data() + used, m_buffer.data() + used + std::max<std::streamsize>(n, 0));
+		}
+
+		return this->gptr() != this->egptr() ? traits_type::to_int_type(*this->gptr()) : traits_type::eof();
+	}
+
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override
+	{
+		if (dir == std::ios_base::cur)
+			off += m_start + (this->gptr() - this->eback());
+		else if (dir != std::ios_base::beg)
+			return pos_type(off_type(-1));
+
+		return seekpos(pos_type(off), which);
+	}
+
+	/// \brief Seek to \a pos, this fails if \a pos is before the start of the history.
+	/// Seeking forward reads up to \a pos.
+	pos_type seekpos(pos_type pos, std::ios_base::openmode which) override
+	{
+		off_type target = pos;
+
+		if (not(which & std::ios_base::in) or this->eback() == nullptr or target < static_cast<off_type>(m_start))
+			return pos_type(off_type(-1));
+
+		while (target > static_cast<off_type>(m_start + (this->egptr() - this->eback())))
+		{
+			this->setg(this->eback(), this->egptr(), this->egptr());
+			if (traits_type::eq_int_type(underflow(), traits_type::eof()))
+				return pos_type(off_type(-1));
+		}
+
+		this->setg(this->eback(), this->eback() + (target - m_start), this->egptr());
+
+		return pos;
+	}
+
+  private:
+	/// \brief The number of characters kept
+	size_t m_history;
+
+	/// \brief The buffer, the get area always starts at its beginning
+	std::vector<char_type> m_buffer;
+
+	/// \brief The position in the stream of the first character in m_buffer
+	std::uint64_t m_start = 0;
+};
+
+// --------------------------------------------------------------------
+
+/// \brief An istream implementation that wraps a streambuf with a decompressing streambuf
+///
+/// \tparam CharT		Type of the character stream.
+/// \tparam Traits		Traits for character type, defaults to char_traits<_CharT>.
+/// \tparam BufferSize	The size of the buffers of the decompressing streambuf.
+///
+/// This is an istream implementation that can take a source streambuf and then wraps
+/// this streambuf with a decompressing streambuf class defined above.
+/// The class inherits from std::basic_istream and offers all the associated functionality.
+
+template <typename CharT, typename Traits, size_t BufferSize = kDefaultBufferSize>
+class basic_istream : public std::basic_istream<CharT, Traits>
+{
+  public:
+	using base_type = std::basic_istream<CharT, Traits>;
+
+	using traits_type = Traits;
+	using char_type = typename traits_type::char_type;
+	using int_type = typename traits_type::int_type;
+
+	using z_streambuf_type = basic_streambuf<char_type, traits_type>;
+	using upstreambuf_type = std::basic_streambuf<char_type, traits_type>;
+	using rewind_streambuf_type = basic_rewind_streambuf<char_type, traits_type>;
+	using prefix_streambuf_type = detail::basic_prefix_streambuf<char_type, traits_type>;
+
+	using gzip_streambuf_type = basic_igzip_streambuf<char_type, traits_type, BufferSize>;
+#if HAVE_LibLZMA
+	using xz_streambuf_type = basic_ixz_streambuf<char_type, traits_type, BufferSize>;
+#endif
+
+	/// \brief Regular move constructor
+	basic_istream(basic_istream &&rhs)
+		: base_type(std::move(rhs))
+	{
+		m_gxriobuf = std::move(rhs.m_gxriobuf);
+		m_limits = rhs.m_limits;
+		m_reference = rhs.m_reference;
+		m_history = rhs.m_history;
+		m_rewindbuf = std::move(rhs.m_rewindbuf);
+		m_prefixbuf = std::move(rhs.m_prefixbuf);
+
+		if (m_gxriobuf)
+			this->rdbuf(wrap(m_gxriobuf.get(), false));
+		else
+			this->rdbuf(nullptr);
+	}
+
+	/// \brief Regular move operator=
+	basic_istream &operator=(basic_istream &&rhs)
+	{
+		base_type::operator=(std::move(rhs));
+		m_gxriobuf = std::move(rhs.m_gxriobuf);
+		m_limits = rhs.m_limits;
+		m_reference = rhs.m_reference;
+		m_history = rhs.m_history;
+		m_rewindbuf = std::move(rhs.m_rewindbuf);
+		m_prefixbuf = std::move(rhs.m_prefixbuf);
+
+		if (m_gxriobuf)
+			this->rdbuf(wrap(m_gxriobuf.get(), false));
+		else
+			this->rdbuf(nullptr);
+
+		return *this;
+	}
+
+	/// \brief Keep the last \a size characters read available for seeking back
+	///
+	/// With a history, seekg to a position inside the window of the last \a size
+	/// characters succeeds without decompressing again, and tellg returns the
+	/// position in the decompressed data. Seeking forward reads up to the new
+	/// position. This should be set before opening the stream, when set on an
+	/// open stream positions count from the current point.
+
+	void set_history(size_t size)
+	{
+		m_history = size;
+
+		if (not m_rewindbuf or this->rdbuf() != m_rewindbuf.get())
+		{
+			m_rewindbuf.reset();
+
+			if (size > 0 and this->rdbuf() != nullptr)
+				this->rdbuf(wrap(this->rdbuf()));
+
+			return;
+		}
+
+		// Replace the active rewind streambuf, the characters it read ahead
+		// from upstream are passed on. Without a history these are read from
+		// a rewind streambuf that keeps nothing, until the next open.
+		std::unique_ptr<rewind_streambuf_type> active(std::move(m_rewindbuf));
+		auto pending = active->pending();
+
+		if (size == 0 and pending.empty())
+			this->rdbuf(active->get_upstream());
+		else
+		{
+			m_rewindbuf.reset(new rewind_streambuf_type(size));
+			m_rewindbuf->init(active->get_upstream(), pending);
+			this->rdbuf(m_rewindbuf.get());
+		}
+	}
+
+	/// \brief Construct an istream with the passed in streambuf \a buf
+	///
+	/// \param buf The streambuf that provides the compressed data
+	///
+	/// This constructor will initialize the zlib code with the \a buf streambuf.
+
+	explicit basic_istream(upstreambuf_type *buf)
+		: base_type(nullptr)
+	{
+		init_z(buf);
+	}
+
+	/// \brief Construct an istream with the passed in streambuf \a buf and resource budgets \a limits
+	///
+	/// \param buf The streambuf that provides the compressed data
+	/// \param limits The resource budgets for decompressing the data in \a buf
+	///
+	/// This constructor will initialize the zlib code with the \a buf streambuf.
+
+	basic_istream(upstreambuf_type *buf, const decompression_limits &limits)
+		: base_type(nullptr)
+		, m_limits(limits)
+	{
+		init_z(buf);
+	}
+
+	/// \brief Set the resource budgets for decompression
+	///
+	/// \param limits The new limits, these are also used for files opened later on
+	///
+	/// Limits only apply to compressed data, uncompressed data is passed through as is.
+
+	void set_limits(const decompression_limits &limits)
+	{
+		m_limits = limits;
+
+		if (m_gxriobuf)
+			m_gxriobuf->set_limits(limits);
+	}
+
+	/// \brief Return the resource budgets for decompression
+	const decompression_limits &get_limits() const
+	{
+		return m_limits;
+	}
+
+	/// \brief Set the reference needed to read data written with compression_options::reference
+	///
+	/// \param reference The reference, this is also used for files opened later on
+
+	void set_reference(std::shared_ptr<const std::string> reference)
+	{
+		m_reference = reference;
+
+		if (m_gxriobuf)
+			m_gxriobuf->set_reference(std::move(reference));
+	}
+
+	/// \brief Return the header of gzip compressed data
+	///
+	/// Right after opening a file this only reads the header, which makes
+	/// collecting the name, mtime and extra field of many files cheap.
+	/// Returns nothing if the data is not gzip compressed.
+
+	std::optional<gzip_header> get_gzip_header()
+	{
+		if (not m_gxriobuf)
+			return std::nullopt;
+
+		return m_gxriobuf->get_gzip_header();
+	}
+
+  protected:
+	basic_istream()
+		: base_type(nullptr) {}
+
+	/// \brief Initialise internals with streambuf \a sb
+	/// \param sb The upstream streambuf class
+	///
+	/// This will sniff the content in \a sb and decide upon what is found
+	/// what implementation is used, the signatures of the registered and
+	/// built-in codecs are checked. If it doesn't look like compressed data
+	/// the \a sb streambuf is used without any decompression being done.
+
+	void init_z(upstreambuf_type *sb)
+	{
+		char buffer[kMaxSignatureLength];
+		bool consumed;
+		auto signature = detail::lookahead(sb, buffer, sizeof(buffer), consumed);
+
+		// The characters read while sniffing are read again from m_prefixbuf
+		if (consumed)
+		{
+			m_prefixbuf.reset(new prefix_streambuf_type(sb, signature));
+			sb = m_prefixbuf.get();
+		}
+
+		m_gxriobuf = detail::make_decompressor<char_type, traits_type, BufferSize>(signature);
+
+		if (m_gxriobuf)
+		{
+			m_gxriobuf->set_limits(m_limits);
+			m_gxriobuf->set_reference(m_reference);
+
+			if (not m_gxriobuf->init(sb))
+				this->setstate(std::ios_base::failbit);
+			else
+				this->init(wrap(m_gxriobuf.get()));
+		}
+		else
+			this->init(wrap(sb));
+	}
+
+	/// \brief Return the streambuf to read from when reading \a sb
+	///
+	/// If a history was set, this is the rewind streambuf reading from \a sb.
+	/// Its history is cleared, unless \a reset is false.
+	upstreambuf_type *wrap(upstreambuf_type *sb, bool reset = true)
+	{
+		if (m_history == 0 or sb == nullptr)
+			return sb;
+
+		if (not m_rewindbuf)
+		{
+			m_rewindbuf.reset(new rewind_streambuf_type(m_history));
+			reset = true;
+		}
+
+		if (reset)
+			m_rewindbuf->init(sb);
+		else
+			m_rewindbuf->set_upstream(sb);
+
+		return m_rewindbuf.get();
+	}
+
+  protected:
+	/// \brief Our streambuf class
+	std::unique_ptr<z_streambuf_type> m_gxriobuf;
+
+	/// \brief The resource budgets for decompression
+	decompression_limits m_limits;
+
+	/// \brief The reference for the xz reference format
+	std::shared_ptr<const std::string> m_reference;
+
+	/// \brief The number of characters kept for seeking back, zero for none
+	size_t m_history = 0;
+
+	/// \brief The streambuf keeping the history
+	std::unique_ptr<rewind_streambuf_type> m_rewindbuf;
+
+	/// \brief The streambuf returning the characters consumed while sniffing
+	/// the upstream, if these could not be put back
+	std::unique_ptr<prefix_streambuf_type> m_prefixbuf;
+};
+
+// --------------------------------------------------------------------
+
+/// \brief Control input from files compressed with gzip.
+///
+/// \tparam CharT		Type of the character stream.
+/// \tparam Traits		Traits for character type, defaults to char_traits<_CharT>.
+/// \tparam BufferSize	The size of the buffers of the decompressing streambuf.
+///
+/// This is an ifstream implementation that can read from named files compressed with
+/// gzip directly. The class inherits from std::basic_istream and offers all the
+/// associated functionality.
+
+template <typename CharT, typename Traits, size_t BufferSize = kDefaultBufferSize>
+class basic_ifstream : public basic_istream<CharT, Traits, BufferSize>
+{
+  public:
+	using base_type = basic_istream<CharT, Traits, BufferSize>;
+
+	using char_type = CharT;
+	using traits_type = Traits;
+
+	using filebuf_type = std::basic_filebuf<char_type, traits_type>;
+
+	using gzip_streambuf_type = typename base_type::gzip_streambuf_type;
+#if HAVE_LibLZMA
+	using xz_streambuf_type = typename base_type::xz_streambuf_type;
+#endif
+
+	/// \brief Default constructor, does not open a file since none is specified
+	basic_ifstream() = default;
+
+	~basic_ifstream()
+	{
+		close();
+	}
+
+	/// \brief Construct an ifstream
+	/// \param filename Null terminated string specifying the file to open
+	/// \param mode The mode in which to open the file
+
+	explicit basic_ifstream(const char *filename, std::ios_base::openmode mode = std::ios_base::in)
+	{
+		open(filename, mode);
+	}
+
+	/// \brief Construct an ifstream
+	/// \param filename std::string specifying the file to open
+	/// \param mode The mode in which to open the file
+
+	explicit basic_ifstream(const std::string &filename, std::ios_base::openmode mode = std::ios_base::in)
+	{
+		open(filename, mode);
+	}
+
+	/// \brief Construct an ifstream
+	/// \param filename std::filesystem::path specifying the file to open
+	/// \param mode The mode in which to open the file
+
+	explicit basic_ifstream(const std::filesystem::path &filename, std::ios_base::openmode mode = std::ios_base::in)
+	{
+		open(filename, mode);
+	}
+
+	/// \brief Construct an ifstream with resource budgets
+	/// \param filename std::filesystem::path specifying the file to open
+	/// \param limits The resource budgets for decompressing the file
+	/// \param mode The mode in which to open the file
+
+	basic_ifstream(const std::filesystem::path &filename, const decompression_limits &limits, std::ios_base::openmode mode = std::ios_base::in)
+	{
+		this->m_limits = limits;
+		open(filename, mode);
+	}
+
+	/// \brief Move constructor
+	basic_ifstream(basic_ifstream &&rhs)
+		: base_type(std::move(rhs))
+	{
+		m_filebuf = std::move(rhs.m_filebuf);
+		m_buffer = std::move(rhs.m_buffer);
+		m_filename = std::move(rhs.m_filename);
+		m_follower = std::move(rhs.m_follower);
+
+		if (this->m_gxriobuf)
+			this->m_gxriobuf->set_upstream(&m_filebuf);
+		else
+			this->rdbuf(this->wrap(&m_filebuf, false));
+	}
+
+	basic_ifstream(const basic_ifstream &) = delete;
+
+	basic_ifstream &operator=(const basic_ifstream &) = delete;
+
+	/// \brief Move version of operator=
+	basic_ifstream &operator=(basic_ifstream &&rhs)
+	{
+		base_type::operator=(std::move(rhs));
+
+		m_filebuf = std::move(rhs.m_filebuf);
+		m_buffer = std::move(rhs.m_buffer);
+		m_filename = std::move(rhs.m_filename);
+		m_follower = std::move(rhs.m_follower);
+		if (this->m_gxriobuf)
+			this->m_gxriobuf->set_upstream(&m_filebuf);
+		else
+			this->rdbuf(this->wrap(&m_filebuf, false));
+
+		return *this;
+	}
+
+	/// \brief Open the file \a filename with mode \a mode
+	/// \param filename std::filesystem::path specifying the file to open
+	/// \param mode The mode in which to open the file
+
+	void open(const std::filesystem::path &filename, std::ios_base::openmode mode = std::ios_base::in)
+	{
+		detail::set_file_buffer(m_filebuf, m_buffer, filename, settings::direction::read);
+
+		if (not m_filebuf.open(filename, mode | std::ios::binary))
+			this->setstate(std::ios_base::failbit);
+		else
+		{
+			m_filename = filename;
+
+			this->m_gxriobuf = detail::make_decompressor<char_type, traits_type, BufferSize>(filename);
+
+			if (this->m_gxriobuf)
+			{
+				this->m_gxriobuf->set_limits(this->m_limits);
+				this->m_gxriobuf->set_reference(this->m_reference);
+
+				if (m_follower)
+					follow(m_follower->options());
+			}
+
+			if (not this->m_gxriobuf)
+			{
+				this->rdbuf(this->wrap(&m_filebuf));
+				this->clear();
+			}
+			else if (not this->m_gxriobuf->init(&m_filebuf))
+				this->setstate(std::ios_base::failbit);
+			else
+			{
+				this->rdbuf(this->wrap(this->m_gxriobuf.get()));
+				this->clear();
+			}
+		}
+	}
+
+	/// \brief Open the file \a filename with mode \a mode
+	/// \param filename std::string specifying the file to open
+	/// \param mode The mode in which to open the file
+
+	void open(const std::string &filename, std::ios_base::openmode mode = std::ios_base::in)
+	{
+		open(std::filesystem::path{filename}, mode);
+	}
+
+	/// \brief Open the file \a filename with mode \a mode
+	/// \param filename Null terminated string specifying the file to open
+	/// \param mode The mode in which to open the file
+
+	void open(const char *filename, std::ios_base::openmode mode = std::ios_base::in)
+	{
+		open(std::filesystem::path{filename}, mode);
+	}
+
+	/// \brief Return true if the file is open
+	/// \return m_filebuf.is_open()
+
+	bool is_open() const
+	{
+		return m_filebuf.is_open();
+	}
+
+	/// \brief Close the file
+	///
+	/// Calls m_filebuf.close(). If that fails, the failbit is set.
+
+	void close()
+	{
+		if (this->m_gxriobuf and not this->m_gxriobuf->close())
+			this->setstate(std::ios_base::failbit);
+
+		if (not m_filebuf.close())
+			this->setstate(std::ios_base::failbit);
+	}
+
+	/// \brief Keep reading when the end of the data is reached, waiting for the file to grow
+	/// \param options The options for following the file
+	///
+	/// This is intended for reading compressed files that are still being written
+	/// and that are flushed regularly by the writer, like log files. Instead of
+	/// reporting end of file, reading blocks until more data was appended and the
+	/// decompressor continues where it stopped. Following ends when the idle timeout
+	/// expires or stop_following() is called. Only compressed files can be followed.
+
+	void follow(const follow_options &options = {})
+	{
+		m_follower = std::make_shared<detail::follower>(options);
+
+		if (this->m_gxriobuf and is_open())
+		{
+			m_follower->watch(m_filename);
+			this->m_gxriobuf->set_wait_handler(
+				[follower = m_follower](std::chrono::steady_clock::duration idle)
+				{ return follower->wait(idle); });
+		}
+	}
+
+	/// \brief Stop following the file, this may be called from another thread
+	///
+	/// A reader waiting for more data will report end of file within the poll interval.
+
+	void stop_following()
+	{
+		if (m_follower)
+			m_follower->stop();
+	}
+
+	/// \brief Swap the contents with those of \a rhs
+	/// \param rhs The ifstream to swap with
+
+	void swap(basic_ifstream &rhs)
+	{
+		base_type::swap(rhs);
+		std::swap(this->m_gxriobuf, rhs.m_gxriobuf);
+		std::swap(this->m_limits, rhs.m_limits);
+		std::swap(this->m_reference, rhs.m_reference);
+		std::swap(this->m_history, rhs.m_history);
+		std::swap(this->m_rewindbuf, rhs.m_rewindbuf);
+		std::swap(this->m_prefixbuf, rhs.m_prefixbuf);
+		m_buffer.swap(rhs.m_buffer);
+		m_filebuf.swap(rhs.m_filebuf);
+		std::swap(m_filename, rhs.m_filename);
+		std::swap(m_follower, rhs.m_follower);
+
+		if (this->m_gxriobuf)
+		{
+			this->m_gxriobuf->set_upstream(&m_filebuf);
+			this->rdbuf(this->wrap(this->m_gxriobuf.get(), false));
+		}
+		else
+			this->rdbuf(this->wrap(&m_filebuf, false));
+
+		if (rhs.m_gxriobuf)
+		{
+			rhs.m_gxriobuf->set_upstream(&rhs.m_filebuf);
+			rhs.rdbuf(rhs.wrap(rhs.m_gxriobuf.get(), false));
+		}
+		else
+			rhs.rdbuf(rhs.wrap(&rhs.m_filebuf, false));
+	}
+
+  private:
+	/// \brief The buffer for m_filebuf when set from gxrio::settings, declared
+	/// first since m_filebuf uses it while closing
+	std::vector<char_type> m_buffer;
+
+	/// \brief The filebuf
+	filebuf_type m_filebuf;
+
+	/// \brief The name of the file that is open
+	std::filesystem::path m_filename;
+
+	/// \brief The state for follow mode, shared with the wait handler
+	std::shared_ptr<detail::follower> m_follower;
+};
+
+// --------------------------------------------------------------------
+
+/// \brief An ostream implementation that wraps a streambuf with a compressing streambuf
+///
+/// \tparam CharT		Type of the character stream.
+/// \tparam Traits		Traits for character type, defaults to char_traits<_CharT>.
+///
+/// This is an ostream implementation that can take an upstream streambuf and then wraps
+/// this streambuf with a compressing streambuf class defined above.
+/// The class inherits from std::basic_ostream and offers all the associated functionality.
+
+template <typename CharT, typename Traits>
+class basic_ostream : public std::basic_ostream<CharT, Traits>
+{
+  public:
+	using base_type = std::basic_ostream<CharT, Traits>;
+
+	using char_type = CharT;
+	using traits_type = Traits;
+
+	using z_streambuf_type = basic_streambuf<char_type, traits_type>;
+	using upstreambuf_type = std::basic_streambuf<char_type, traits_type>;
+
+	/// \brief Regular move constructor
+	basic_ostream(basic_ostream &&rhs)
+		: base_type(std::move(rhs))
+	{
+		m_gxriobuf = std::move(rhs.m_gxriobuf);
+		m_options = rhs.m_options;
+		this->rdbuf(m_gxriobuf.get());
+	}
+
+	/// \brief Regular move operator=
+	basic_ostream &operator=(basic_ostream &&rhs)
+	{
+		base_type::operator=(std::move(rhs));
+		m_gxriobuf = std::move(rhs.m_gxriobuf);
+		m_options = rhs.m_options;
+
+		this->rdbuf(m_gxriobuf.get());
+
+		return *this;
+	}
+
+	// One might expect a constructor taking a streambuf pointer
+	// as the regular std::ostream class does. However, that's not
+	// going to work since no information is known at this time
+	// what compression to use.
+	//
+	// explicit basic_ostream(upstreambuf_type *buf)
+	// {
+	// 	init_z(buf);
+	// 	this->init(m_gxriobuf.get());
+	// }
+
+	/// \brief Set the options for compression
+	///
+	/// \param options The new options, these are also used for files opened later on
+	///
+	/// The codec is initialized when the first data is written, so options
+	/// can be changed right after opening a file.
+
+	void set_options(const compression_options &options)
+	{
+		m_options = options;
+
+		if (m_gxriobuf)
+			m_gxriobuf->set_options(options);
+	}
+
+	/// \brief Return the options for compression
+	const compression_options &get_options() const
+	{
+		return m_options;
+	}
+
+	/// \brief Set the gzip header for the data written
+	///
+	/// \param header The header, it only applies to the file currently open
+	/// \result false if this stream is not writing gzip or data was already compressed
+
+	bool set_gzip_header(const gzip_header &header)
+	{
+		return m_gxriobuf and m_gxriobuf->set_gzip_header(header);
+	}
+
+	/// \brief Write the \a count fragments at \a fragments as if they were one string
+	///
+	/// This is meant for records built from many small fragments. For compressed
+	/// output the fragments of a batch that does not fit in the buffer are passed
+	/// to the codec at once, without concatenating them first. Sets the badbit on error.
+
+	basic_ostream &write_gather(const std::basic_string_view<CharT, Traits> *fragments, size_t count)
+	{
+		typename base_type::sentry sentry(*this);
+
+		if (sentry)
+		{
+			auto length = detail::total_length(fragments, count);
+			std::streamsize n = 0;
+
+			if (m_gxriobuf and this->rdbuf() == m_gxriobuf.get())
+				n = m_gxriobuf->sputn_gather(fragments, count);
+			else
+			{
+				for (size_t i = 0; i < count; ++i)
+					n += this->rdbuf()->sputn(fragments[i].data(), fragments[i].length());
+			}
+
+			if (n != static_cast<std::streamsize>(length))
+				this->setstate(std::ios_base::badbit);
+		}
+
+		return *this;
+	}
+
+	/// \brief Write \a fragments as if they were one string
+	basic_ostream &write_gather(std::initializer_list<std::basic_string_view<CharT, Traits>> fragments)
+	{
+		return write_gather(fragments.begin(), fragments.size());
+	}
+
+#if GXRIO_CXX20
+	/// \brief Write \a fragments as if they were one string
+	basic_ostream &write_gather(std::span<const std::basic_string_view<CharT, Traits>> fragments)
+	{
+		return write_gather(fragments.data(), fragments.size());
+	}
+#endif
+
+  protected:
+	basic_ostream()
+		: base_type(nullptr) {}
+
+	/// \brief Initialise internals with streambuf \a sb
+	void init_z(std::streambuf *sb)
+	{
+		m_gxriobuf->set_options(m_options);
+
+		if (not m_gxriobuf->init(sb))
+			this->setstate(std::ios_base::failbit);
+	}
+
+  protected:
+	/// \brief Our streambuf class
+	std::unique_ptr<z_streambuf_type> m_gxriobuf;
+
+	/// \brief The options for compression
+	compression_options m_options;
+};
+
+// --------------------------------------------------------------------
+
+namespace detail
+{
+
+/// \brief Flush the contents of \a file to disk, returns false on error
+inline bool sync_file(const std::filesystem::path &file)
+{
+#if defined(_WIN32)
+	int fd = ::_wopen(file.c_str(), _O_RDWR | _O_BINARY);
+	if (fd < 0)
+		return false;
+	bool result = ::_commit(fd) == 0;
+	::_close(fd);
+#else
+	int fd = ::open(file.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	bool result = ::fsync(fd) == 0;
+	::close(fd);
+#endif
+	return result;
+}
+
+/// \brief Return the name of the checkpoint journal for \a file
+inline std::filesystem::path journal_path(const std::filesystem::path &file)
+{
+	auto result = file;
+	result += ".ckpt";
+	return result;
+}
+
+/// \brief Atomically replace the checkpoint journal for \a file with \a cp
+inline bool write_journal(const std::filesystem::path &file, const checkpoint &cp)
+{
+	auto journal = journal_path(file);
+	auto tmp = journal;
+	tmp += ".tmp";
+
+	{
+		std::ofstream out(tmp, std::ios_base::trunc);
+		out << "gxrio-checkpoint 1 " << cp.compressed << ' ' << cp.uncompressed << ' ' << cp.crc << '\n';
+		out.close();
+
+		if (out.fail())
+			return false;
+	}
+
+	std::error_code ec;
+	if (not sync_file(tmp) or (std::filesystem::rename(tmp, journal, ec), ec))
+		return false;
+
+#if not defined(_WIN32)
+	// make the rename durable as well
+	auto dir = journal.parent_path();
+	sync_file(dir.empty() ? "." : dir);
+#endif
+
+	return true;
+}
+
+/// \brief Read the checkpoint journal for \a file into \a cp
+inline bool read_journal(const std::filesystem::path &file, checkpoint &cp)
+{
+	std::ifstream in(journal_path(file));
+
+	std::string magic;
+	int version = 0;
+
+	in >> magic >> version >> cp.compressed >> cp.uncompressed >> cp.crc;
+
+	return not in.fail() and magic == "gxrio-checkpoint" and version == 1;
+}
+
+} // namespace detail
+
+// --------------------------------------------------------------------
+
+/// \brief Control output to files compressing the contents with gzip.
+///
+/// \tparam CharT		Type of the character stream.
+/// \tparam Traits		Traits for character type, defaults to char_traits<_CharT>.
+/// \tparam BufferSize	The size of the buffers of the compressing streambuf.
+///
+/// This is an ofstream implementation that can writeto named files compressing the content
+/// with gzip directly. The class inherits from std::basic_ostream and offers all the
+/// associated functionality.
+
+template <typename CharT, typename Traits, size_t BufferSize = kDefaultBufferSize>
+class basic_ofstream : public basic_ostream<CharT, Traits>
+{
+  public:
+	using base_type = basic_ostream<CharT, Traits>;
+
+	using char_type = CharT;
+	using traits_type = Traits;
+
+	using filebuf_type = std::basic_filebuf<char_type, traits_type>;
+	using gzip_streambuf_type = basic_ogzip_streambuf<char_type, traits_type, BufferSize>;
+#if HAVE_LibLZMA
+	using xz_streambuf_type = basic_oxz_streambuf<char_type, traits_type, BufferSize>;
+#endif
+
+	basic_ofstream() = default;
+
+	~basic_ofstream()
+	{
+		close();
+	}
+
+	/// \brief Construct an ofstream
+	/// \param filename Null terminated string specifying the file to open
+	/// \param mode The mode in which to open the file
+
+	explicit basic_ofstream(const char *filename, std::ios_base::openmode mode = std::ios_base::out)
+	{
+		open(filename, mode);
+	}
+
+	/// \brief Construct an ofstream
+	/// \param filename std::string specifying the file to open
+	/// \param mode The mode in which to open the file
+
+	explicit basic_ofstream(const std::string &filename, std::ios_base::openmode mode = std::ios_base::out)
+	{
+		open(filename, mode);
+	}
+
+	/// \brief Construct an ofstream
+	/// \param filename std::filesystem::path specifying the file to open
+	/// \param mode The mode in which to open the file
+
+	explicit basic_ofstream(const std::filesystem::path &filename, std::ios_base::openmode mode = std::ios_base::out)
+	{
+		open(filename, mode);
+	}
+
+	/// \brief Construct an ofstream with compression options
+	/// \param filename std::filesystem::path specifying the file to open
+	/// \param options The options for compressing the data
+	/// \param mode The mode in which to open the file
+
+	basic_ofstream(const std::filesystem::path &filename, const compression_options &options, std::ios_base::openmode mode = std::ios_base::out)
+	{
+		this->m_options = options;
+		open(filename, mode);
+	}
+
+	/// \brief Move constructor
+	basic_ofstream(basic_ofstream &&rhs)
+		: base_type(std::move(rhs))
+	{
+		m_filebuf = std::move(rhs.m_filebuf);
+		m_buffer = std::move(rhs.m_buffer);
+		m_filename = std::move(rhs.m_filename);
+		if (this->m_gxriobuf)
+		{
+			this->m_gxriobuf->set_upstream(&m_filebuf);
+			install_checkpoint_handler();
+		}
+		else
+			this->rdbuf(&m_filebuf);
+	}
+
+	basic_ofstream(const basic_ofstream &) = delete;
+
+	basic_ofstream &operator=(const basic_ofstream &) = delete;
+
+	/// \brief Move operator=
+	basic_ofstream &operator=(basic_ofstream &&rhs)
+	{
+		base_type::operator=(std::move(rhs));
+		m_filebuf = std::move(rhs.m_filebuf);
+		m_buffer = std::move(rhs.m_buffer);
+		m_filename = std::move(rhs.m_filename);
+		if (this->m_gxriobuf)
+		{
+			this->m_gxriobuf->set_upstream(&m_filebuf);
+			install_checkpoint_handler();
+		}
+		else
+			this->rdbuf(&m_filebuf);
+
+		return *this;
+	}
+
+	/// \brief Open the file \a filename with mode \a mode
+	/// \param filename std::filesystem::path specifying the file to open
+	/// \param mode The mode in which to open the file
+	///
+	/// A compression algorithm is chosen upon the contents of the
+	/// extension() of \a filename with .gz mapping to gzip compression,
+	/// .xz to xz compression and .br to brotli. Codecs added with register_codec are
+	/// checked first.
+
+	void open(const std::filesystem::path &filename, std::ios_base::openmode mode = std::ios_base::out)
+	{
+		detail::set_file_buffer(m_filebuf, m_buffer, filename, settings::direction::write);
+
+		if (not m_filebuf.open(filename, mode | std::ios::binary))
+			this->setstate(std::ios_base::failbit);
+		else
+		{
+			m_filename = filename;
+
+			this->m_gxriobuf = detail::make_compressor<char_type, traits_type, BufferSize>(filename);
+
+			if (this->m_gxriobuf)
+			{
+				this->m_gxriobuf->set_options(this->m_options);
+				install_checkpoint_handler();
+
+				if (not this->m_gxriobuf->init(&m_filebuf))
+					this->setstate(std::ios_base::failbit);
+				else
+				{
+					this->rdbuf(this->m_gxriobuf.get());
+					this->clear();
+				}
+			}
+			else
+			{
+				this->rdbuf(&m_filebuf);
+				this->clear();
+			}
+		}
+	}
+
+	/// \brief Open the file \a filename with mode \a mode
+	/// \param filename std::string specifying the file to open
+	/// \param mode The mode in which to open the file
+	///
+	/// A compression algorithm is chosen upon the contents of the
+	/// extension of \a filename with .gz mapping to gzip compression
+	/// and .xz to xz compression.
+
+	void open(const std::string &filename, std::ios_base::openmode mode = std::ios_base::out)
+	{
+		open(std::filesystem::path{filename}, mode);
+	}
+
+	/// \brief Open the file \a filename with mode \a mode
+	/// \param filename Null terminated string specifying the file to open
+	/// \param mode The mode in which to open the file
+	///
+	/// A compression algorithm is chosen upon the contents of the
+	/// extension of \a filename with .gz mapping to gzip compression
+	/// and .xz to xz compression.
+
+	void open(const char *filename, std::ios_base::openmode mode = std::ios_base::out)
+	{
+		open(std::filesystem::path{filename}, mode);
+	}
+
+	/// \brief Return true if the file is open
+	/// \return m_filebuf.is_open()
+
+	bool is_open() const
+	{
+		return m_filebuf.is_open();
+	}
+
+	/// \brief Close the file
+	///
+	/// Calls m_filebuf.close(). If that fails, the failbit is set.
+
+	void close()
+	{
+		bool was_open = m_filebuf.is_open();
+
+		if (this->m_gxriobuf and not this->m_gxriobuf->close())
+			this->setstate(std::ios_base::failbit);
+
+		if (not m_filebuf.close())
+			this->setstate(std::ios_base::failbit);
+
+		// The file is complete, the journal is no longer needed
+		if (was_open and this->m_gxriobuf and this->m_options.checkpoint_interval > 0 and not this->fail())
+		{
+			std::error_code ec;
+			std::filesystem::remove(detail::journal_path(m_filename), ec);
+		}
+	}
+
+	/// \brief Close the file on a background thread
+	/// \param sync Flush the file to disk as well
+	/// \return A future whose value is false if finishing the compressed data,
+	/// writing or syncing the file failed
+	///
+	/// The codec and the file are handed over to the background task, the stream
+	/// is closed on return and can be used to open the next file right away.
+	/// Destroying the future waits for the task to finish.
+
+	[[nodiscard]] std::future<bool> close_async(bool sync = false)
+	{
+		auto state = std::make_unique<closing>();
+
+		state->codec = std::move(this->m_gxriobuf);
+		// a moved-from filebuf may be left unbuffered, swap in a fresh one instead
+		state->filebuf.swap(m_filebuf);
+		state->buffer = std::move(m_buffer);
+		state->filename = m_filename;
+		state->sync = sync;
+		state->remove_journal = state->codec and this->m_options.checkpoint_interval > 0 and not this->fail();
+		state->failed = this->fail();
+
+		if (state->codec)
+		{
+			// checkpoints are no longer reported, the journal refers to this stream
+			state->codec->set_checkpoint_handler({});
+			state->codec->set_upstream(&state->filebuf);
+		}
+
+		this->rdbuf(&m_filebuf);
+
+		return std::async(std::launch::async, [state = std::move(state)]
+			{ return state->close(); });
+	}
+
+	/// \brief Resume writing \a filename after the last checkpoint
+	/// \param filename The file whose compression was interrupted
+	/// \return The checkpoint at which compression continues
+	///
+	/// The checkpoint journal written for \a filename, see compression_options::checkpoint_interval,
+	/// is read and the file is truncated to the size recorded at the last checkpoint.
+	/// The caller should then write the uncompressed data starting at offset
+	/// checkpoint::uncompressed. If the file cannot be resumed, the failbit is set.
+
+	checkpoint resume(const std::filesystem::path &filename)
+	{
+		checkpoint cp;
+
+		std::error_code ec;
+		if (not detail::read_journal(filename, cp) or
+			std::filesystem::file_size(filename, ec) < cp.compressed or ec or
+			(std::filesystem::resize_file(filename, cp.compressed, ec), ec))
+		{
+			this->setstate(std::ios_base::failbit);
+			return {};
+		}
+
+		open(filename, std::ios_base::out | std::ios_base::app);
+
+		if (not this->m_gxriobuf or not this->m_gxriobuf->resume(cp))
+		{
+			this->setstate(std::ios_base::failbit);
+			return {};
+		}
+
+		return cp;
+	}
+
+	/// \brief Swap the contents with those of \a rhs
+	/// \param rhs The ifstream to swap with
+
+	void swap(basic_ofstream &rhs)
+	{
+		base_type::swap(rhs);
+		m_buffer.swap(rhs.m_buffer);
+		m_filebuf.swap(rhs.m_filebuf);
+
+		if (this->m_gxriobuf)
+		{
+			this->m_gxriobuf.set_upstream(&m_filebuf);
+			this->rdbuf(this->m_gxriobuf.get());
+		}
+		else
+			this->rdbuf(&m_filebuf);
+
+		if (rhs.m_gxriobuf)
+		{
+			rhs.m_gxriobuf.set_upstream(&rhs.m_filebuf);
+			rhs.rdbuf(rhs.m_gxriobuf.get());
+		}
+		else
+			rhs.rdbuf(&rhs.m_filebuf);
+	}
+
+  private:
+	/// \brief The state handed over to the background task by close_async
+	struct closing
+	{
+		std::vector<char_type> buffer;
+		filebuf_type filebuf;
+		std::unique_ptr<typename base_type::z_streambuf_type> codec;
+		std::filesystem::path filename;
+		bool sync = false;
+		bool remove_journal = false;
+		bool failed = false;
+
+		bool close()
+		{
+			bool ok = not failed;
+			bool was_open = filebuf.is_open();
+
+			if (codec and not codec->close())
+				ok = false;
+
+			if (not filebuf.close())
+				ok = false;
+
+			if (ok and was_open and sync)
+				ok = detail::sync_file(filename);
+
+			if (ok and was_open and remove_journal)
+			{
+				std::error_code ec;
+				std::filesystem::remove(detail::journal_path(filename), ec);
+			}
+
+			return ok;
+		}
+	};
+
+	/// \brief Sync the file to disk and record the checkpoint in the journal
+	void install_checkpoint_handler()
+	{
+		if (this->m_options.checkpoint_interval == 0)
+			return;
+
+		this->m_gxriobuf->set_checkpoint_handler([this](const checkpoint &cp)
+		{
+			return m_filebuf.pubsync() == 0 and
+				detail::sync_file(m_filename) and
+				detail::write_journal(m_filename, cp);
+		});
+	}
+
+	/// \brief The buffer for m_filebuf when set from gxrio::settings, declared
+	/// first since m_filebuf uses it while closing
+	std::vector<char_type> m_buffer;
+
+	/// \brief The filebuf
+	filebuf_type m_filebuf;
+
+	/// \brief The name of the file that is open
+	std::filesystem::path m_filename;
+};
+
+// --------------------------------------------------------------------
+
+/// \brief Convenience typedefs
+using istream = basic_istream<char, std::char_traits<char>>;
+using ifstream = basic_ifstream<char, std::char_traits<char>>;
+
+/// \brief Read the contents of \a file for use as reference, the file is decompressed
+/// if needed. Returns nullptr if the file cannot be read.
+inline std::shared_ptr<const std::string> load_reference(const std::filesystem::path &file)
+{
+	ifstream in(file);
+	if (not in.is_open())
+		return {};
+
+	std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	if (in.bad())
+		return {};
+
+	return std::make_shared<const std::string>(std::move(data));
+}
+
+// using ostream = basic_ostream<char, std::char_traits<char>>;
+using ofstream = basic_ofstream<char, std::char_traits<char>>;
+
+// --------------------------------------------------------------------
+
+/// \brief Zero-copy access to the data produced by a streambuf
+///
+/// For gxrio streambufs the decompressed data is read directly
+/// from their buffer, for other streambufs, like the filebuf used
+/// for uncompressed files, data is copied into an internal buffer first.
+
+template <typename CharT, typename Traits>
+class basic_view_reader
+{
+  public:
+	using streambuf_type = std::basic_streambuf<CharT, Traits>;
+	using gxrio_streambuf_type = basic_streambuf<CharT, Traits>;
+	using string_view_type = std::basic_string_view<CharT, Traits>;
+
+	static constexpr size_t kBufferSize = 64 * 1024;
+
+	basic_view_reader() = default;
+
+	explicit basic_view_reader(streambuf_type *sb)
+		: m_sb(sb)
+		, m_gxriobuf(dynamic_cast<gxrio_streambuf_type *>(sb))
+	{
+		if (m_sb and not m_gxriobuf)
+			m_buffer.resize(kBufferSize);
+	}
+
+	/// \brief Return the available data, empty at end of input
+	string_view_type peek()
+	{
+		if (m_gxriobuf)
+			return m_gxriobuf->peek();
+
+		if (m_offset == m_size and m_sb)
+		{
+			m_offset = 0;
+			m_size = static_cast<size_t>(m_sb->sgetn(m_buffer.data(), m_buffer.size()));
+		}
+
+		return { m_buffer.data() + m_offset, m_size - m_offset };
+	}
+
+	/// \brief Mark \a n characters returned by peek as read
+	void consume(size_t n)
+	{
+		if (m_gxriobuf)
+			m_gxriobuf->consume(n);
+		else
+			m_offset += n;
+	}
+
+  private:
+	streambuf_type *m_sb = nullptr;
+	gxrio_streambuf_type *m_gxriobuf = nullptr;
+	std::vector<CharT> m_buffer;
+	size_t m_offset = 0, m_size = 0;
+};
+
+using view_reader = basic_view_reader<char, std::char_traits<char>>;
+
+// --------------------------------------------------------------------
+
+/// \brief Options for delimited_reader
+
+struct delimited_options
+{
+	/// \brief The character separating the fields
+	char delimiter = '\t';
+
+	/// \brief Recognize quoted fields, as used in CSV files
+	///
+	/// Quoted fields may contain delimiters and newlines, a quote
+	/// character inside a quoted field is written twice.
+	bool quoted = false;
+
+	/// \brief The quote character
+	char quote = '"';
+};
+
+namespace detail
+{
+
+/// \brief Return a pointer to the first \a a or \a b in [\a p, \a e), or \a e if not found
+inline const char *find_either(const char *p, const char *e, char a, char b)
+{
+#if defined(__SSE2__)
+	const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+
+	for (; e - p >= 16; p += 16)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+		int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+		if (mask != 0)
+			return p + __builtin_ctz(static_cast<unsigned>(mask));
+	}
+#endif
+
+	while (p != e and *p != a and *p != b)
+		++p;
+
+	return p;
+}
+
+/// \brief Return a pointer to the first \a a or \a b in [\a p, \a e), or \a e if not found
+template <typename CharT>
+const CharT *find_either(const CharT *p, const CharT *e, CharT a, CharT b)
+{
+	while (p != e and *p != a and *p != b)
+		++p;
+
+	return p;
+}
+
+/// \brief Return a pointer to the first \a a in [\a p, \a e), or \a e if not found
+inline const char *find(const char *p, const char *e, char a)
+{
+	auto r = static_cast<const char *>(std::memchr(p, a, e - p));
+	return r ? r : e;
+}
+
+/// \brief Return a pointer to the first \a a in [\a p, \a e), or \a e if not found
+template <typename CharT>
+const CharT *find(const CharT *p, const CharT *e, CharT a)
+{
+	return std::find(p, e, a);
+}
+
+} // namespace detail
+
+/// \brief Read selected columns from delimited text, like TSV or CSV files
+///
+/// Rows are split directly in a large buffer filled from the streambuf,
+/// which can be any of the decompressing streambufs. Only the requested columns
+/// are located and no strings are created, fields are returned as string_views
+/// that are valid until the next call to next(). When all requested columns are
+/// found, the rest of the row is skipped by scanning for the newline only.
+///
+/// \code
+/// gxrio::ifstream in("data.tsv.gz");
+/// gxrio::delimited_reader reader(in, { 0, 17, 3 });
+///
+/// int count;
+/// while (reader.next())
+/// 	if (reader.get(2, count))
+/// 		process(reader[0], reader[1], count);
+/// \endcode
+
+template <typename CharT, typename Traits>
+class basic_delimited_reader
+{
+  public:
+	using char_type = CharT;
+	using traits_type = Traits;
+
+	using streambuf_type = std::basic_streambuf<char_type, traits_type>;
+	using istream_type = std::basic_istream<char_type, traits_type>;
+	using string_view_type = std::basic_string_view<char_type, traits_type>;
+
+	static constexpr size_t kBufferSize = 256 * 1024;
+
+	/// \brief Construct a reader for \a columns, zero based, reading from \a sb
+	basic_delimited_reader(streambuf_type *sb, std::vector<size_t> columns, const delimited_options &options = {})
+		: m_sb(sb)
+		, m_options(options)
+		, m_delimiter(static_cast<char_type>(options.delimiter))
+		, m_quote(static_cast<char_type>(options.quote))
+		, m_fields(columns.size())
+		, m_offsets(columns.size())
+		, m_buffer(kBufferSize)
+	{
+		for (size_t i = 0; i < columns.size(); ++i)
+			m_order.emplace_back(columns[i], i);
+
+		std::sort(m_order.begin(), m_order.end());
+	}
+
+	/// \brief Construct a reader for \a columns, zero based, reading from \a in
+	basic_delimited_reader(istream_type &in, std::vector<size_t> columns, const delimited_options &options = {})
+		: basic_delimited_reader(in.rdbuf(), std::move(columns), options)
+	{
+	}
+
+	/// \brief Advance to the next row, returns false at end of input
+	///
+	/// Fields that are missing in a row are returned as empty string_views.
+	bool next()
+	{
+		std::fill(m_offsets.begin(), m_offsets.end(), std::make_pair(size_t{ 0 }, size_t{ 0 }));
+
+		size_t length;
+		if (not(m_options.quoted ? split_quoted(length) : split(length)))
+			return false;
+
+		for (size_t i = 0; i < m_fields.size(); ++i)
+			m_fields[i] = { m_buffer.data() + m_begin + m_offsets[i].first, m_offsets[i].second };
+
+		// skip the newline as well, if there is one
+		m_begin = std::min(m_begin + length + 1, m_end);
+
+		++m_row;
+		return true;
+	}
+
+	/// \brief The number of requested columns
+	size_t size() const
+	{
+		return m_fields.size();
+	}
+
+	/// \brief Return the field for the \a i-th requested column
+	string_view_type operator[](size_t i) const
+	{
+		return m_fields[i];
+	}
+
+	/// \brief Convert the field for the \a i-th requested column to a number
+	///
+	/// Returns false if the field does not contain a number, or contains more.
+	template <typename T>
+	bool get(size_t i, T &value) const
+	{
+		auto f = m_fields[i];
+
+		if constexpr (std::is_same_v<char_type, char>)
+		{
+			auto r = std::from_chars(f.data(), f.data() + f.size(), value);
+			return r.ec == std::errc() and r.ptr == f.data() + f.size();
+		}
+		else
+		{
+			// from_chars takes char, numbers only contain ASCII characters
+			std::string s;
+			for (auto ch : f)
+			{
+				auto c = static_cast<char>(ch);
+				if ((c & 0x80) != 0 or static_cast<char_type>(c) != ch)
+					return false;
+				s += c;
+			}
+
+			auto r = std::from_chars(s.data(), s.data() + s.size(), value);
+			return r.ec == std::errc() and r.ptr == s.data() + s.size();
+		}
+	}
+
+	/// \brief The number of rows read so far
+	std::uint64_t row() const
+	{
+		return m_row;
+	}
+
+  private:
+	/// \brief Move the unread data to the front of the buffer and read more,
+	/// returns false at end of input
+	bool fill()
+	{
+		if (m_eof)
+			return false;
+
+		if (m_begin > 0)
+		{
+			traits_type::move(m_buffer.data(), m_buffer.data() + m_begin, m_end - m_begin);
+			m_end -= m_begin;
+			m_begin = 0;
+		}
+
+		// a row that does not fit
+		if (m_end == m_buffer.size())
+			m_buffer.resize(m_buffer.size() * 2);
+
+		auto n = m_sb->sgetn(m_buffer.data() + m_end, m_buffer.size() - m_end);
+		if (n <= 0)
+			m_eof = true;
+		else
+			m_end += n;
+
+		return n > 0;
+	}
+
+	/// \brief Store the field [\a start, \a end), offsets relative to m_begin, if \a column is requested
+	void store(size_t &k, size_t column, size_t start, size_t end)
+	{
+		for (; k < m_order.size() and m_order[k].first == column; ++k)
+			m_offsets[m_order[k].second] = { start, end - start };
+	}
+
+	/// \brief Remove a carriage return from the end of fields ending at \a length
+	void strip_cr(size_t length)
+	{
+		if (length > 0 and m_buffer[m_begin + length - 1] == '\r')
+		{
+			for (auto &[offset, size] : m_offsets)
+			{
+				if (size > 0 and offset + size == length)
+					--size;
+			}
+		}
+	}
+
+	/// \brief Split a row without quoting, in a single scan for delimiters and newlines
+	bool split(size_t &length)
+	{
+		size_t column = 0, k = 0, start = 0, p = 0;
+
+		for (;;)
+		{
+			auto b = m_buffer.data() + m_begin;
+			auto e = m_buffer.data() + m_end;
+
+			// after the last requested column only the end of the row is interesting
+			auto f = k < m_order.size()
+			             ? detail::find_either(b + p, e, m_delimiter, char_type('\n'))
+			             : detail::find(b + p, e, char_type('\n'));
+
+			if (f == e)
+			{
+				p = m_end - m_begin;
+				if (fill())
+					continue;
+
+				if (p == 0)
+					return false;
+			}
+			else
+				p = f - b;
+
+			store(k, column, start, p);
+
+			if (p == m_end - m_begin or b[p] == '\n')
+				break;
+
+			++column;
+			start = ++p;
+		}
+
+		length = p;
+		strip_cr(length);
+
+		return true;
+	}
+
+	/// \brief Split a row with quoted fields
+	///
+	/// The end of the row is located first, quoted fields are then unescaped in place.
+	bool split_quoted(size_t &length)
+	{
+		const char_type quote = m_quote, delimiter = m_delimiter;
+
+		size_t p = 0;
+		bool in_quotes = false;
+
+		for (;;)
+		{
+			auto b = m_buffer.data() + m_begin;
+			auto e = m_buffer.data() + m_end;
+
+			auto f = in_quotes ? detail::find(b + p, e, quote) : detail::find_either(b + p, e, quote, char_type('\n'));
+
+			if (f != e)
+			{
+				p = f - b;
+				if (*f == '\n')
+					break;
+
+				in_quotes = not in_quotes;
+				++p;
+				continue;
+			}
+
+			p = m_end - m_begin;
+			if (fill())
+				continue;
+
+			if (p == 0)
+				return false;
+			break;
+		}
+
+		length = p;
+
+		char_type *row = m_buffer.data() + m_begin;
+		size_t end = length > 0 and row[length - 1] == '\r' ? length - 1 : length;
+		size_t column = 0, k = 0;
+
+		for (p = 0; k < m_order.size(); ++column, ++p)
+		{
+			size_t start = p, out = p;
+
+			if (p < end and row[p] == quote)
+			{
+				start = out = ++p;
+
+				for (;;)
+				{
+					auto q = detail::find(row + p, row + end, quote) - row;
+					traits_type::move(row + out, row + p, q - p);
+					out += q - p;
+					p = q + 1;
+
+					if (p < end and row[p] == quote)
+					{
+						row[out++] = quote;
+						++p;
+						continue;
+					}
+
+					break;
+				}
+
+				// ignore anything between the closing quote and the delimiter
+				p = std::min<size_t>(detail::find(row + std::min(p, end), row + end, delimiter) - row, end);
+			}
+			else
+				p = out = detail::find(row + p, row + end, delimiter) - row;
+
+			store(k, column, start, out);
+
+			if (p >= end)
+				break;
+		}
+
+		return true;
+	}
+
+	streambuf_type *m_sb;
+	delimited_options m_options;
+	char_type m_delimiter, m_quote;
+
+	/// \brief The requested columns as pairs of column number and index, sorted
+	std::vector<std::pair<size_t, size_t>> m_order;
+
+	std::vector<string_view_type> m_fields;
+
+	/// \brief Offset and length of the fields relative to the start of the row
+	std::vector<std::pair<size_t, size_t>> m_offsets;
+
+	std::vector<char_type> m_buffer;
+	size_t m_begin = 0, m_end = 0;
+	bool m_eof = false;
+	std::uint64_t m_row = 0;
+};
+
+using delimited_reader = basic_delimited_reader<char, std::char_traits<char>>;
+
+// --------------------------------------------------------------------
+
+/// \brief Write formatted output without the overhead of iostreams
+///
+/// Text and numbers are formatted directly into the put area of a
+/// compressing streambuf, the data is compressed when that buffer is
+/// full. Use a larger BufferSize for the stream to reduce the number of
+/// calls into the codec. For other streambufs an internal buffer is used
+/// that is written using sputn.
+///
+/// Pending output is handed to the streambuf by flush() and by the destructor,
+/// the stream should not be written to by other means in the mean time.
+///
+/// \code
+/// gxrio::basic_ofstream<char, std::char_traits<char>, 64 * 1024> out("report.tsv.gz");
+/// gxrio::fast_writer w(out);
+///
+/// for (auto &r : records)
+/// 	w.append(r.name).append('\t').append(r.count).append('\n');
+/// \endcode
+
+template <typename CharT, typename Traits>
+class basic_fast_writer
+{
+  public:
+	using char_type = CharT;
+	using traits_type = Traits;
+
+	using streambuf_type = std::basic_streambuf<char_type, traits_type>;
+	using ostream_type = std::basic_ostream<char_type, traits_type>;
+	using gxrio_streambuf_type = basic_streambuf<char_type, traits_type>;
+	using string_view_type = std::basic_string_view<char_type, traits_type>;
+
+	static constexpr size_t kBufferSize = 64 * 1024;
+
+	/// \brief Construct a writer for streambuf \a sb
+	explicit basic_fast_writer(streambuf_type *sb)
+		: m_sb(sb)
+		, m_gxriobuf(dynamic_cast<gxrio_streambuf_type *>(sb))
+	{
+		if (not m_gxriobuf)
+			m_buffer.resize(kBufferSize);
+	}
+
+	/// \brief Construct a writer for the streambuf of \a os
+	explicit basic_fast_writer(ostream_type &os)
+		: basic_fast_writer(os.rdbuf())
+	{
+	}
+
+	basic_fast_writer(const basic_fast_writer &) = delete;
+	basic_fast_writer &operator=(const basic_fast_writer &) = delete;
+
+	~basic_fast_writer()
+	{
+		flush();
+	}
+
+	/// \brief Return a pointer to space for at least \a n characters, or nullptr on error
+	///
+	/// Call commit() with the number of characters actually written.
+	char_type *reserve(size_t n)
+	{
+		if (static_cast<size_t>(m_end - m_cur) >= n)
+			return m_cur;
+
+		if (not make_room(n))
+			return nullptr;
+
+		if (static_cast<size_t>(m_end - m_cur) >= n)
+			return m_cur;
+
+		// larger than the buffer, use a scratch buffer that is written in commit
+		m_scratch.resize(n);
+		return m_scratch.data();
+	}
+
+	/// \brief Add the \a n characters written at the result of reserve to the output
+	void commit(size_t n)
+	{
+		if (not m_scratch.empty())
+		{
+			if (m_sb->sputn(m_scratch.data(), n) != static_cast<std::streamsize>(n))
+				m_failed = true;
+			m_scratch.clear();
+
+			// sputn may have used the put area, start over at its current position
+			if (m_gxriobuf)
+			{
+				m_begin = m_cur = m_end = nullptr;
+				make_room(0);
+			}
+		}
+		else
+			m_cur += n;
+	}
+
+	/// \brief Append the text in \a s
+	basic_fast_writer &append(string_view_type s)
+	{
+		while (not s.empty())
+		{
+			if (m_cur == m_end and not make_room(1))
+				break;
+
+			auto n = std::min(s.length(), static_cast<size_t>(m_end - m_cur));
+			traits_type::copy(m_cur, s.data(), n);
+			m_cur += n;
+			s.remove_prefix(n);
+		}
+
+		return *this;
+	}
+
+	/// \brief Append the character \a ch
+	basic_fast_writer &append(char_type ch)
+	{
+		if (m_cur != m_end or make_room(1))
+			*m_cur++ = ch;
+
+		return *this;
+	}
+
+	/// \brief Append the text in \a s
+	basic_fast_writer &append(const char_type *s)
+	{
+		return append(string_view_type{ s });
+	}
+
+	/// \brief Append the text in \a s
+	basic_fast_writer &append(const std::basic_string<char_type, traits_type> &s)
+	{
+		return append(string_view_type{ s });
+	}
+
+	/// \brief Append \a value, formatted using std::to_chars
+	template <typename T, std::enable_if_t<std::is_integral_v<T> and not std::is_same_v<T, char> and
+	                                           not std::is_same_v<T, char_type> and not std::is_same_v<T, bool>, int> = 0>
+	basic_fast_writer &append(T value)
+	{
+		// enough for 64 bit integers including the sign
+		return format([value](char *b, char *e)
+			{ return std::to_chars(b, e, value); }, 24);
+	}
+
+	/// \brief Append \a value in the shortest representation that reads back exactly
+	template <typename T, std::enable_if_t<std::is_floating_point_v<T>, int> = 0>
+	basic_fast_writer &append(T value)
+	{
+		return format([value](char *b, char *e)
+			{ return std::to_chars(b, e, value); });
+	}
+
+	/// \brief Append \a value using \a format and \a precision, as std::to_chars does
+	template <typename T, std::enable_if_t<std::is_floating_point_v<T>, int> = 0>
+	basic_fast_writer &append(T value, std::chars_format format, int precision)
+	{
+		return this->format([value, format, precision](char *b, char *e)
+			{ return std::to_chars(b, e, value, format, precision); });
+	}
+
+	/// \brief Hand the pending output to the streambuf, returns false if an error occurred
+	bool flush()
+	{
+		if (m_gxriobuf)
+		{
+			m_gxriobuf->commit(m_cur - m_begin);
+			m_begin = m_cur;
+		}
+		else if (m_cur != m_begin)
+		{
+			auto n = m_cur - m_begin;
+			if (m_sb->sputn(m_begin, n) != n)
+				m_failed = true;
+			m_cur = m_begin;
+		}
+
+		return not m_failed;
+	}
+
+	/// \brief Return false if an error occurred
+	bool good() const
+	{
+		return not m_failed;
+	}
+
+  private:
+	/// \brief Make sure there is room for \a n characters, if the buffer is large enough
+	bool make_room(size_t n)
+	{
+		if (m_failed or not flush())
+			return false;
+
+		if (m_gxriobuf)
+		{
+			auto [p, size] = m_gxriobuf->prepare(n);
+			m_begin = m_cur = p;
+			m_end = p + size;
+		}
+		else
+		{
+			m_begin = m_cur = m_buffer.data();
+			m_end = m_begin + m_buffer.size();
+		}
+
+		if (m_begin == nullptr)
+			m_failed = true;
+
+		return not m_failed;
+	}
+
+	/// \brief Format using \a f, a call to one of the std::to_chars functions, trying
+	/// buffers of \a size characters and larger
+	///
+	/// For char the text is formatted in place, other character types
+	/// receive a copy of the ASCII text formatted in a local buffer.
+	template <typename F>
+	basic_fast_writer &format(F &&f, size_t size = 32)
+	{
+		if constexpr (std::is_same_v<char_type, char>)
+		{
+			for (; size <= 4096; size *= 4)
+			{
+				auto p = reserve(size);
+				if (p == nullptr)
+					break;
+
+				auto r = f(p, p + size);
+				if (r.ec == std::errc())
+				{
+					commit(r.ptr - p);
+					break;
+				}
+
+				if (not m_scratch.empty())
+					m_scratch.clear();
+			}
+		}
+		else
+		{
+			char buffer[4096];
+			auto r = f(buffer, buffer + sizeof(buffer));
+			auto n = static_cast<size_t>(r.ptr - buffer);
+
+			if (r.ec == std::errc())
+			{
+				if (auto p = reserve(n))
+				{
+					std::transform(buffer, r.ptr, p, [](char ch) { return static_cast<char_type>(ch); });
+					commit(n);
+				}
+			}
+		}
+
+		return *this;
+	}
+
+	streambuf_type *m_sb;
+	gxrio_streambuf_type *m_gxriobuf;
+
+	/// \brief The space to write in, either the put area or m_buffer
+	char_type *m_begin = nullptr, *m_cur = nullptr, *m_end = nullptr;
+
+	std::vector<char_type> m_buffer, m_scratch;
+	bool m_failed = false;
+};
+
+using fast_writer = basic_fast_writer<char, std::char_traits<char>>;
+
+// --------------------------------------------------------------------
+
+/// \brief Write one gzip file from several threads without a shared compressor
+///
+/// Each thread writes to its own parallel_member_writer::ostream. The data
+/// written to such a stream is collected in a buffer, when it is full or the
+/// stream is flushed the buffer is compressed into a complete gzip member.
+/// Space for that member is then reserved in the file using an atomic
+/// counter and the member is written at that offset, no locks are needed.
+///
+/// The result is a multi-member gzip file, as e.g. created by concatenating
+/// gzip files. Output written by one thread appears in the file in the order
+/// it was written, output of different threads is interleaved at member boundaries.
+/// When the buffer is full, the member ends after the last newline in the buffer
+/// so that lines written by different threads are not mixed. Flushing the
+/// stream writes all buffered data.
+///
+/// \code
+/// gxrio::parallel_member_writer writer("out.gz");
+///
+/// // in each worker thread
+/// gxrio::parallel_member_writer::ostream out(writer);
+/// out << "Hello, world!" << std::endl;
+/// \endcode
+
+class parallel_member_writer
+{
+  public:
+	static constexpr size_t kDefaultMemberSize = 1024 * 1024;
+
+	/// \brief Open \a file for writing
+	/// \param file The file to write, it is truncated unless \a append is true
+	/// \param options The compression options, only the level is used
+	/// \param member_size The amount of uncompressed data per member, must be larger than zero
+	/// \param append Add the new members after the existing contents of \a file
+	parallel_member_writer(const std::filesystem::path &file, const compression_options &options = {},
+		size_t member_size = kDefaultMemberSize, bool append = false)
+		: m_options(options)
+		, m_member_size(member_size)
+	{
+		if (member_size == 0)
+			throw std::invalid_argument("Member size must be larger than zero");
+
+#if defined(_WIN32)
+		m_fd = ::_wopen(file.c_str(), _O_WRONLY | _O_CREAT | _O_BINARY | (append ? 0 : _O_TRUNC), _S_IREAD | _S_IWRITE);
+		if (m_fd >= 0)
+			m_offset = m_start = ::_lseeki64(m_fd, 0, SEEK_END);
+#else
+		m_fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (append ? 0 : O_TRUNC), 0666);
+		if (m_fd >= 0)
+			m_offset = m_start = ::lseek(m_fd, 0, SEEK_END);
+#endif
+	}
+
+	parallel_member_writer(const parallel_member_writer &) = delete;
+	parallel_member_writer &operator=(const parallel_member_writer &) = delete;
+
+	~parallel_member_writer()
+	{
+		close();
+	}
+
+	/// \brief Return true if the file is open
+	bool is_open() const
+	{
+		return m_fd >= 0;
+	}
+
+	/// \brief Return false if writing a member failed
+	bool good() const
+	{
+		return not m_failed;
+	}
+
+	/// \brief Close the file, all streams should have been destroyed before.
+	/// Returns false if an error occurred.
+	bool close()
+	{
+		if (m_fd < 0)
+			return false;
+
+		// nothing was written, make sure the result is a valid gzip file
+		if (m_offset == m_start)
+			ostream(*this).flush_member(true);
+
+#if defined(_WIN32)
+		if (::_close(m_fd) != 0)
+			m_failed = true;
+#else
+		if (::close(m_fd) != 0)
+			m_failed = true;
+#endif
+		m_fd = -1;
+
+		return not m_failed;
+	}
+
+	/// \brief The streambuf used by ostream, compresses its buffer into a gzip member
+	class streambuf : public std::streambuf
+	{
+	  public:
+		explicit streambuf(parallel_member_writer &writer)
+			: m_writer(writer)
+			, m_buffer(writer.m_member_size)
+		{
+			this->setp(m_buffer.data(), m_buffer.data() + m_buffer.size());
+		}
+
+		streambuf(const streambuf &) = delete;
+		streambuf &operator=(const streambuf &) = delete;
+
+		~streambuf()
+		{
+			flush_member(false);
+
+			if (m_zstream)
+				::deflateEnd(m_zstream.get());
+		}
+
+		/// \brief Compress the buffered data into a member and write it,
+		/// an empty member is only written if \a force is true
+		bool flush_member(bool force)
+		{
+			return write_member(this->pptr() - this->pbase(), force);
+		}
+
+	  protected:
+		int_type overflow(int_type ch) override
+		{
+			// end the member after the last complete line, if there is one
+			size_t size = this->pptr() - this->pbase();
+			for (auto p = this->pptr(); p != this->pbase(); --p)
+			{
+				if (p[-1] == '\n')
+				{
+					size = p - this->pbase();
+					break;
+				}
+			}
+
+			if (not write_member(size, false))
+				return traits_type::eof();
+
+			if (not traits_type::eq_int_type(ch, traits_type::eof()))
+			{
+				*this->pptr() = traits_type::to_char_type(ch);
+				this->pbump(1);
+			}
+
+			return traits_type::not_eof(ch);
+		}
+
+		int sync() override
+		{
+			return flush_member(false) ? 0 : -1;
+		}
+
+	  private:
+		/// \brief Compress the first \a size bytes of the buffer into a member and
+		/// write it, the remaining bytes are moved to the front of the buffer
+		bool write_member(size_t size, bool force)
+		{
+			if (size == 0 and not force)
+				return true;
+
+			if (not m_zstream and not init_codec())
+				return false;
+
+			auto &zstream = *m_zstream;
+
+			m_member.resize(::deflateBound(&zstream, static_cast<uLong>(size)));
+
+			zstream.next_in = reinterpret_cast<unsigned char *>(this->pbase());
+			zstream.avail_in = static_cast<uInt>(size);
+			zstream.next_out = reinterpret_cast<unsigned char *>(m_member.data());
+			zstream.avail_out = static_cast<uInt>(m_member.size());
+
+			int err = ::deflate(&zstream, Z_FINISH);
+			size_t n = m_member.size() - zstream.avail_out;
+
+			auto rest = std::copy(this->pbase() + size, this->pptr(), m_buffer.data());
+			this->setp(m_buffer.data(), m_buffer.data() + m_buffer.size());
+			this->pbump(static_cast<int>(rest - m_buffer.data()));
+
+			return err == Z_STREAM_END and ::deflateReset(&zstream) == Z_OK and
+			       m_writer.write_member(m_member.data(), n);
+		}
+
+		bool init_codec()
+		{
+			const int WINDOW_BITS = 15, GZIP_ENCODING = 16;
+
+			int level = m_writer.m_options.level < 0 ? Z_BEST_COMPRESSION : std::min(m_writer.m_options.level, Z_BEST_COMPRESSION);
+
+			m_zstream.reset(new z_stream_s{});
+
+			if (deflateInit2(m_zstream.get(), level, Z_DEFLATED, WINDOW_BITS | GZIP_ENCODING, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			{
+				m_zstream.reset();
+				return false;
+			}
+
+			return true;
+		}
+
+		parallel_member_writer &m_writer;
+		std::unique_ptr<z_stream_s> m_zstream;
+		std::vector<char> m_buffer;
+		std::vector<char> m_member;
+	};
+
+	/// \brief A stream writing to a parallel_member_writer, use one per thread
+	class ostream : public std::ostream
+	{
+	  public:
+		explicit ostream(parallel_member_writer &writer)
+			: std::ostream(nullptr)
+			, m_streambuf(writer)
+		{
+			this->init(&m_streambuf);
+		}
+
+		/// \brief Write the buffered data as a member
+		bool flush_member(bool force)
+		{
+			return m_streambuf.flush_member(force);
+		}
+
+	  private:
+		streambuf m_streambuf;
+	};
+
+  private:
+	/// \brief Reserve space for a member of \a size bytes and write it, this is thread safe
+	bool write_member(const char *data, size_t size)
+	{
+		if (m_failed)
+			return false;
+
+		auto offset = m_offset.fetch_add(size);
+
+#if defined(_WIN32)
+		std::unique_lock lock(m_mutex);
+		if (::_lseeki64(m_fd, offset, SEEK_SET) < 0 or ::_write(m_fd, data, static_cast<unsigned>(size)) != static_cast<int>(size))
+			m_failed = true;
+#else
+		while (size > 0)
+		{
+			auto r = ::pwrite(m_fd, data, size, static_cast<off_t>(offset));
+			if (r < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				m_failed = true;
+				break;
+			}
+
+			data += r;
+			size -= r;
+			offset += r;
+		}
+#endif
+
+		return not m_failed;
+	}
+
+	int m_fd = -1;
+	compression_options m_options;
+	size_t m_member_size;
+
+	std::uint64_t m_start = 0;
+	std::atomic<std::uint64_t> m_offset{ 0 };
+	std::atomic<bool> m_failed{ false };
+
+#if defined(_WIN32)
+	/// \brief Windows has no pwrite, seek and write are done while holding this lock
+	std::mutex m_mutex;
+#endif
+};
+
+// --------------------------------------------------------------------
+
+/// \brief Decompress once, read many times
+///
+/// A broadcast_reader decompresses its input on a background thread into
+/// reference counted chunks. Any number of subscribers, each an
+/// std::istream of type broadcast_reader::istream, read all of the data at
+/// their own pace. A chunk is released once every subscriber has passed it.
+/// The decompressing thread pauses when the chunks not yet read by the
+/// slowest subscriber take more than the budget.
+///
+/// Subscribers should be created before calling start(), a subscriber created
+/// later starts at the oldest chunk still available. Subscribers must be
+/// destroyed before the broadcast_reader.
+///
+/// \code
+/// gxrio::broadcast_reader reader("data.xz");
+///
+/// gxrio::broadcast_reader::istream a(reader), b(reader);
+/// reader.start();
+///
+/// std::thread ta([&a] { analyse_1(a); }), tb([&b] { analyse_2(b); });
+/// \endcode
+
+class broadcast_reader
+{
+  public:
+	static constexpr size_t kChunkSize = 256 * 1024;
+	static constexpr size_t kDefaultBudget = 64 * 1024 * 1024;
+
+	/// \brief Read the possibly compressed file \a file
+	/// \param file The file to read, opened using gxrio::ifstream
+	/// \param budget The maximum number of bytes buffered for the slowest subscriber
+	explicit broadcast_reader(const std::filesystem::path &file, size_t budget = kDefaultBudget)
+		: m_file(std::make_unique<ifstream>(file))
+		, m_in(m_file.get())
+		, m_budget(budget)
+	{
+	}
+
+	/// \brief Read from stream \a in, which should remain valid while reading
+	/// \param in The stream to read, e.g. a gxrio::istream
+	/// \param budget The maximum number of bytes buffered for the slowest subscriber
+	explicit broadcast_reader(std::istream &in, size_t budget = kDefaultBudget)
+		: m_in(&in)
+		, m_budget(budget)
+	{
+	}
+
+	broadcast_reader(const broadcast_reader &) = delete;
+	broadcast_reader &operator=(const broadcast_reader &) = delete;
+
+	~broadcast_reader()
+	{
+		{
+			std::unique_lock lock(m_mutex);
+			m_stop = true;
+		}
+
+		m_cv.notify_all();
+
+		if (m_thread.joinable())
+			m_thread.join();
+	}
+
+	/// \brief Return true if the input could be opened
+	bool is_open() const
+	{
+		return m_file ? m_file->is_open() : m_in->rdbuf() != nullptr;
+	}
+
+	/// \brief Start decompressing
+	void start()
+	{
+		if (not m_thread.joinable())
+			m_thread = std::thread([this] { produce(); });
+	}
+
+	/// \brief The streambuf of a subscriber
+	class streambuf : public std::streambuf
+	{
+	  public:
+		explicit streambuf(broadcast_reader &reader)
+			: m_reader(reader)
+		{
+			std::unique_lock lock(m_reader.m_mutex);
+			m_next = m_reader.m_first;
+			m_reader.m_subscribers.push_back(this);
+		}
+
+		streambuf(const streambuf &) = delete;
+		streambuf &operator=(const streambuf &) = delete;
+
+		~streambuf()
+		{
+			{
+				std::unique_lock lock(m_reader.m_mutex);
+				auto &s = m_reader.m_subscribers;
+				s.erase(std::remove(s.begin(), s.end(), this), s.end());
+				m_reader.release();
+			}
+
+			m_reader.m_cv.notify_all();
+		}
+
+	  protected:
+		int_type underflow() override
+		{
+			{
+				std::unique_lock lock(m_reader.m_mutex);
+
+				m_reader.m_cv.wait(lock, [this]
+					{ return m_next < m_reader.m_first + m_reader.m_chunks.size() or m_reader.m_eof; });
+
+				if (m_next >= m_reader.m_first + m_reader.m_chunks.size())
+				{
+					if (m_reader.m_error)
+						std::rethrow_exception(m_reader.m_error);
+
+					m_chunk.reset();
+					this->setg(nullptr, nullptr, nullptr);
+					return traits_type::eof();
+				}
+
+				m_chunk = m_reader.m_chunks[m_next - m_reader.m_first];
+				++m_next;
+
+				m_reader.release();
+			}
+
+			m_reader.m_cv.notify_all();
+
+			auto data = const_cast<char *>(m_chunk->data());
+			this->setg(data, data, data + m_chunk->size());
+
+			return traits_type::to_int_type(*data);
+		}
+
+	  private:
+		friend class broadcast_reader;
+
+		broadcast_reader &m_reader;
+
+		/// \brief The index of the next chunk to read
+		std::uint64_t m_next = 0;
+
+		/// \brief The chunk in the get area, kept alive by this reference
+		std::shared_ptr<const std::vector<char>> m_chunk;
+	};
+
+	/// \brief A subscriber, reads all data decompressed by the broadcast_reader
+	class istream : public std::istream
+	{
+	  public:
+		explicit istream(broadcast_reader &reader)
+			: std::istream(nullptr)
+			, m_streambuf(reader)
+		{
+			this->init(&m_streambuf);
+		}
+
+	  private:
+		streambuf m_streambuf;
+	};
+
+  private:
+	/// \brief The decompressing thread
+	void produce()
+	{
+		try
+		{
+			for (;;)
+			{
+				{
+					std::unique_lock lock(m_mutex);
+					m_cv.wait(lock, [this] { return m_stop or m_buffered < m_budget; });
+
+					if (m_stop)
+						break;
+				}
+
+				auto chunk = std::make_shared<std::vector<char>>(kChunkSize);
+				auto n = m_in->rdbuf() ? m_in->rdbuf()->sgetn(chunk->data(), chunk->size()) : 0;
+
+				if (n <= 0)
+					break;
+
+				chunk->resize(n);
+
+				{
+					std::unique_lock lock(m_mutex);
+					m_chunks.emplace_back(std::move(chunk));
+					m_buffered += n;
+
+					// without subscribers the chunk is dropped right away
+					release();
+				}
+
+				m_cv.notify_all();
+			}
+		}
+		catch (...)
+		{
+			std::unique_lock lock(m_mutex);
+			m_error = std::current_exception();
+		}
+
+		{
+			std::unique_lock lock(m_mutex);
+			m_eof = true;
+		}
+
+		m_cv.notify_all();
+	}
+
+	/// \brief Drop the chunks every subscriber has passed, m_mutex must be locked
+	void release()
+	{
+		auto first_needed = m_first + m_chunks.size();
+		for (auto s : m_subscribers)
+			first_needed = std::min(first_needed, s->m_next);
+
+		while (m_first < first_needed)
+		{
+			m_buffered -= m_chunks.front()->size();
+			m_chunks.pop_front();
+			++m_first;
+		}
+	}
+
+	std::unique_ptr<ifstream> m_file;
+	std::istream *m_in;
+	size_t m_budget;
+
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+
+	/// \brief The chunks not yet read by all subscribers, m_first is the index of the first
+	std::deque<std::shared_ptr<const std::vector<char>>> m_chunks;
+	std::uint64_t m_first = 0;
+	size_t m_buffered = 0;
+
+	std::vector<streambuf *> m_subscribers;
+
+	bool m_eof = false, m_stop = false;
+	std::exception_ptr m_error;
+};
+
+// --------------------------------------------------------------------
+
+/// \brief A simple pool of worker threads
+///
+/// Jobs posted to the pool are executed in order of submission by the
+/// first available worker thread. The destructor waits until all jobs
+/// that were posted have been executed. An exception thrown by a job is
+/// ignored, jobs should report errors themselves.
+
+class thread_pool
+{
+  public:
+	/// \brief Construct a thread pool
+	/// \param thread_count The number of worker threads, at least one thread is started
+	explicit thread_pool(size_t thread_count = std::thread::hardware_concurrency())
+	{
+		if (thread_count == 0)
+			thread_count = 1;
+
+		for (size_t i = 0; i < thread_count; ++i)
+			m_threads.emplace_back([this] { run(); });
+	}
+
+	thread_pool(const thread_pool &) = delete;
+	thread_pool &operator=(const thread_pool &) = delete;
+
+	~thread_pool()
+	{
+		{
+			std::unique_lock lock(m_mutex);
+			m_stop = true;
+		}
+
+		m_cv.notify_all();
+
+		for (auto &t : m_threads)
+			t.join();
+	}
+
+	/// \brief Schedule \a job for execution on one of the worker threads
+	void post(std::function<void()> job)
+	{
+		{
+			std::unique_lock lock(m_mutex);
+			m_queue.emplace_back(std::move(job));
+		}
+
+		m_cv.notify_one();
+	}
+
+	/// \brief Return the number of worker threads
+	size_t size() const
+	{
+		return m_threads.size();
+	}
+
+  private:
+	void run()
+	{
+		for (;;)
+		{
+			std::function<void()> job;
+
+			{
+				std::unique_lock lock(m_mutex);
+				m_cv.wait(lock, [this] { return m_stop or not m_queue.empty(); });
+
+				if (m_queue.empty())
+					break;
+
+				job = std::move(m_queue.front());
+				m_queue.pop_front();
+			}
+
+			try
+			{
+				job();
+			}
+			catch (...)
+			{
+			}
+		}
+	}
+
+	std::vector<std::thread> m_threads;
+	std::deque<std::function<void()>> m_queue;
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	bool m_stop = false;
+};
+
+// --------------------------------------------------------------------
+
+/// \brief Options for partitioned_writer
+
+struct partition_options
+{
+	/// \brief The options for the compressor
+	compression_options compression;
+
+	/// \brief The data for a partition is compressed when this many bytes are collected
+	size_t batch_size = 1024 * 1024;
+
+	/// \brief The maximum number of bytes allocated for collecting the data of all partitions together
+	size_t memory_budget = 256 * 1024 * 1024;
+
+	/// \brief The number of threads compressing batches, zero means one per core
+	size_t threads = 0;
+};
+
+/// \brief Write records to many compressed files at once
+///
+/// Records written to a partition are collected in a contiguous buffer,
+/// when it reaches the batch size it is compressed on a worker thread and
+/// appended to the partition's file as a separate gzip member or xz stream.
+/// The codec state only exists while a batch is compressed, so the memory
+/// used does not depend on the number of partitions. When the memory budget
+/// is exceeded, the largest batch is compressed early and writing blocks until
+/// memory is available again.
+///
+/// The format is chosen on the extension of the file names. Only formats
+/// that allow concatenation can be used, brotli does not.
+/// The write function should be called from one thread only.
+
+class partitioned_writer
+{
+  public:
+	/// \brief Create a writer for the partitions \a files, these are truncated
+	partitioned_writer(const std::vector<std::filesystem::path> &files, const partition_options &options = {})
+		: m_options(options)
+		, m_pool(options.threads ? options.threads : std::thread::hardware_concurrency())
+	{
+		for (auto &file : files)
+		{
+			if (file.extension() == ".br")
+				throw std::invalid_argument("Brotli files cannot be written in batches");
+
+			std::ofstream out(file, std::ios::binary | std::ios::trunc);
+			if (not out.is_open())
+				m_failed = true;
+
+			m_partitions.emplace_back(file);
+		}
+	}
+
+	partitioned_writer(const partitioned_writer &) = delete;
+	partitioned_writer &operator=(const partitioned_writer &) = delete;
+
+	~partitioned_writer()
+	{
+		close();
+	}
+
+	/// \brief The number of partitions
+	size_t size() const
+	{
+		return m_partitions.size();
+	}
+
+	/// \brief Append \a record to \a partition, returns false if an error occurred
+	bool write(size_t partition, std::string_view record)
+	{
+		std::unique_lock lock(m_mutex);
+
+		if (m_failed)
+			return false;
+
+		auto &p = m_partitions.at(partition);
+
+		// the arena grows on demand, the memory it allocates counts against the budget
+		auto capacity = p.arena.capacity();
+		p.arena.insert(p.arena.end(), record.begin(), record.end());
+		m_buffered += p.arena.capacity() - capacity;
+
+		if (p.arena.size() >= m_options.batch_size)
+			submit(p);
+
+		while (m_buffered > m_options.memory_budget and not m_failed)
+		{
+			// nothing is being compressed that would free memory, compress the largest batch
+			if (m_queued == 0)
+			{
+				auto largest = std::max_element(m_partitions.begin(), m_partitions.end(),
+					[](const auto &a, const auto &b)
+					{ return a.arena.size() < b.arena.size(); });
+
+				submit(*largest);
+			}
+
+			m_cv.wait(lock);
+		}
+
+		return not m_failed;
+	}
+
+	/// \brief Compress the remaining data and wait until all has been written.
+	/// Returns false if an error occurred.
+	bool close()
+	{
+		std::unique_lock lock(m_mutex);
+
+		// partitions that were never written still get a valid, empty, file
+		for (auto &p : m_partitions)
+		{
+			if (not p.arena.empty() or not p.written)
+				submit(p);
+		}
+
+		m_cv.wait(lock, [this] { return m_queued == 0 and m_busy == 0; });
+
+		return not m_failed;
+	}
+
+  private:
+	struct partition
+	{
+		partition(const std::filesystem::path &file)
+			: file(file)
+		{
+		}
+
+		std::filesystem::path file;
+
+		/// \brief The data collected for the next batch
+		std::vector<char> arena;
+
+		/// \brief Batches waiting to be compressed, in order
+		std::deque<std::vector<char>> pending;
+
+		/// \brief Set while a worker is compressing batches for this partition
+		bool busy = false;
+
+		/// \brief Set once a batch was submitted
+		bool written = false;
+	};
+
+	/// \brief Queue the arena of \a p for compression, m_mutex must be locked
+	///
+	/// Only one worker at a time handles a partition, to keep the batches in order.
+	void submit(partition &p)
+	{
+		m_queued += p.arena.size();
+		p.pending.emplace_back(std::move(p.arena));
+		p.arena = {};
+		p.written = true;
+
+		if (not p.busy)
+		{
+			p.busy = true;
+			++m_busy;
+			m_pool.post([this, &p] { compress(p); });
+		}
+	}
+
+	/// \brief Compress and write the pending batches of \a p, runs on a worker thread
+	void compress(partition &p)
+	{
+		std::unique_lock lock(m_mutex);
+
+		while (not p.pending.empty())
+		{
+			auto batch = std::move(p.pending.front());
+			p.pending.pop_front();
+
+			lock.unlock();
+
+			// an exception must not escape, the counters below are needed by close
+			bool ok;
+			try
+			{
+				ok = write_batch(p.file, batch);
+			}
+			catch (...)
+			{
+				ok = false;
+			}
+
+			lock.lock();
+
+			if (not ok)
+				m_failed = true;
+
+			m_queued -= batch.size();
+			m_buffered -= batch.capacity();
+			m_cv.notify_all();
+		}
+
+		p.busy = false;
+		--m_busy;
+		m_cv.notify_all();
+	}
+
+	/// \brief Compress \a batch and append it to \a file
+	bool write_batch(const std::filesystem::path &file, const std::vector<char> &batch)
+	{
+		std::stringbuf compressed;
+
+		auto sb = detail::make_compressor<char, std::char_traits<char>, kBatchBufferSize>(file);
+		if (sb)
+		{
+			sb->set_options(m_options.compression);
+			bool ok = sb->init(&compressed) and
+			          sb->sputn(batch.data(), batch.size()) == static_cast<std::streamsize>(batch.size()) and
+			          sb->close();
+			if (not ok)
+				return false;
+		}
+		else
+			compressed.sputn(batch.data(), batch.size());
+
+		auto data = compressed.str();
+
+		std::ofstream out(file, std::ios::binary | std::ios::app);
+		out.write(data.data(), data.size());
+		out.close();
+
+		return not out.fail();
+	}
+
+	/// \brief The buffer size used by the compressors
+	static constexpr size_t kBatchBufferSize = 64 * 1024;
+
+	partition_options m_options;
+	std::deque<partition> m_partitions;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+
+	/// \brief Bytes allocated for the data not yet written, and the bytes of data queued for compression
+	size_t m_buffered = 0, m_queued = 0;
+
+	/// \brief The number of partitions being handled by a worker
+	size_t m_busy = 0;
+
+	bool m_failed = false;
+
+	/// \brief Declared last, so the workers are stopped before the other members are destroyed
+	thread_pool m_pool;
+};
+
+// --------------------------------------------------------------------
+
+/// \brief Options for sorted_index
+
+struct sorted_index_options
+{
+	/// \brief The character that ends the key at the start of each line
+	char delimiter = '\t';
+
+	/// \brief The minimal number of uncompressed bytes between two index points in gzip files
+	std::uint64_t span = 1024 * 1024;
+
+	/// \brief Store the index next to the file, as <file>.gxi, and reuse it while the file is unchanged
+	bool persist = true;
+};
+
+/// \brief A sparse index for looking up keys in a sorted, compressed, text file
+///
+/// The file contains lines that start with a key, followed by the delimiter,
+/// sorted on that key. The index records the first key after each point where
+/// decompression can start: for gzip files, including BGZF, these are deflate
+/// block boundaries about \a span bytes apart, stored with the preceding 32 KiB
+/// of data; for xz files these are the blocks, as written by a multithreaded
+/// compressor or at checkpoints. A lookup does a binary search over the index
+/// and then decompresses a single region. Other files are scanned from the start.
+/// When the index is loaded from a stored index, the windows are read from it
+/// by the lookups that need them.
+///
+/// \code
+/// gxrio::sorted_index index("keys.tsv.gz");
+/// for (auto &key : keys)
+/// 	if (auto line = index.find(key))
+/// 		process(*line);
+/// \endcode
+
+class sorted_index
+{
+  public:
+	static constexpr size_t kBufferSize = 256 * 1024;
+	static constexpr size_t kWindowSize = 32 * 1024;
+
+	/// \brief Load the index for \a file or build it if there is none or when it is out of date
+	explicit sorted_index(const std::filesystem::path &file, const sorted_index_options &options = {})
+		: m_file(file)
+		, m_options(options)
+	{
+		std::error_code ec;
+		m_size = std::filesystem::file_size(file, ec);
+		if (not ec)
+			m_time = std::filesystem::last_write_time(file, ec).time_since_epoch().count();
+		if (ec)
+			return;
+
+		if (not load())
+		{
+			m_valid = build();
+
+			if (m_valid and m_options.persist)
+				save();
+		}
+
+		m_searchable = std::find_if(m_points.begin(), m_points.end(),
+						   [](const point &p)
+						   { return p.line == kNoLine; }) -
+		               m_points.begin();
+	}
+
+	/// \brief Return true if the index could be loaded or built
+	explicit operator bool() const
+	{
+		return m_valid;
+	}
+
+	/// \brief The number of points in the index
+	size_t size() const
+	{
+		return m_points.size();
+	}
+
+	/// \brief Return the first line with key \a key, using \a comp to order keys
+	///
+	/// The line is returned without the trailing newline, if there is no such
+	/// line an empty optional is returned.
+	template <typename Compare = std::less<>>
+	std::optional<std::string> find(std::string_view key, Compare comp = {}) const
+	{
+		if (not m_valid or m_points.empty())
+			return {};
+
+		// start at the last point with a smaller key, lines with the same key may precede the point
+		auto i = std::partition_point(m_points.begin() + 1, m_points.begin() + std::max<size_t>(m_searchable, 1),
+					 [&](const point &p)
+					 { return comp(std::string_view(p.key), key); }) -
+		         m_points.begin() - 1;
+
+		std::optional<std::string> result;
+
+		for_each_line(i, m_points[i].line, [&](std::string_view line, std::uint64_t)
+			{
+				auto k = line.substr(0, line.find(m_options.delimiter));
+				if (comp(key, k))
+					return false;
+				if (not comp(k, key))
+				{
+					result.emplace(line);
+					return false;
+				}
+				return true;
+			});
+
+		return result;
+	}
+
+  private:
+	static constexpr std::uint64_t kNoLine = ~std::uint64_t{ 0 };
+
+	enum class format
+	{
+		other,
+		gzip,
+		xz
+	};
+
+	/// \brief A point where decompression can start
+	struct point
+	{
+		/// \brief The offset in the file, for gzip the first complete byte
+		std::uint64_t compressed;
+
+		/// \brief The offset in the uncompressed data
+		std::uint64_t uncompressed;
+
+		/// \brief The offset of the first line starting after this point, kNoLine if there is none
+		std::uint64_t line;
+
+		/// \brief For gzip the number of bits in the preceding byte, for xz the check type
+		int bits;
+
+		/// \brief The key of the line at \a line
+		std::string key;
+
+		/// \brief For gzip the uncompressed data preceding the point
+		std::string window;
+
+		/// \brief For a gzip index that was loaded, the offset of the window in the
+		/// index file, the window is then read when needed
+		std::uint64_t window_offset = 0;
+
+		/// \brief The size of the window at \a window_offset
+		size_t window_size = 0;
+	};
+
+	/// \brief Decompress starting at an index point
+	class reader
+	{
+	  public:
+		reader(const sorted_index &index, size_t i)
+			: m_index(index)
+			, m_in(kBufferSize)
+		{
+			auto &p = index.m_points[i];
+
+			switch (index.m_format)
+			{
+				case format::gzip:
+				{
+					std::string loaded;
+					auto &window = p.window_offset != 0 ? loaded : p.window;
+
+					m_file.open(index.m_file, std::ios::binary);
+					m_file.seekg(p.compressed - (p.bits ? 1 : 0));
+					m_eof = inflateInit2(&m_z, -MAX_WBITS) != Z_OK;
+					m_initialized = not m_eof;
+					if (p.bits and not m_eof)
+						m_eof = inflatePrime(&m_z, p.bits, m_file.get() >> (8 - p.bits)) != Z_OK;
+					if (p.window_offset != 0 and not m_eof)
+						m_eof = not index.load_window(p, loaded);
+					if (not window.empty() and not m_eof)
+						m_eof = inflateSetDictionary(&m_z, reinterpret_cast<const Bytef *>(window.data()),
+									static_cast<uInt>(window.size())) != Z_OK;
+					break;
+				}
+
+#if HAVE_LibLZMA
+				case format::xz:
+					m_file.open(index.m_file, std::ios::binary);
+					m_eof = not start_block(i);
+					break;
+#endif
+
+				default:
+					m_stream.open(index.m_file);
+					break;
+			}
+		}
+
+		reader(const reader &) = delete;
+		reader &operator=(const reader &) = delete;
+
+		~reader()
+		{
+			if (m_initialized)
+				inflateEnd(&m_z);
+#if HAVE_LibLZMA
+			lzma_end(&m_lzma);
+#endif
+		}
+
+		/// \brief Read up to \a size bytes into \a data, returns zero at the end or on error
+		size_t read(char *data, size_t size)
+		{
+			switch (m_index.m_format)
+			{
+				case format::gzip:
+					return read_gzip(data, size);
+#if HAVE_LibLZMA
+				case format::xz:
+					return read_xz(data, size);
+#endif
+				default:
+					m_stream.read(data, size);
+					return m_stream.gcount();
+			}
+		}
+
+	  private:
+		/// \brief Read more compressed data, returns false at end of file
+		bool fill(const std::uint8_t *&next_in, size_t &avail_in)
+		{
+			m_file.read(m_in.data(), m_in.size());
+			next_in = reinterpret_cast<const std::uint8_t *>(m_in.data());
+			avail_in = m_file.gcount();
+			return avail_in > 0;
+		}
+
+		size_t read_gzip(char *data, size_t size)
+		{
+			m_z.next_out = reinterpret_cast<Bytef *>(data);
+			m_z.avail_out = static_cast<uInt>(size);
+
+			while (m_z.avail_out == size and not m_eof)
+			{
+				if (m_z.avail_in == 0)
+				{
+					const std::uint8_t *next_in;
+					size_t avail_in;
+					if (not fill(next_in, avail_in))
+						break;
+					m_z.next_in = const_cast<Bytef *>(next_in);
+					m_z.avail_in = static_cast<uInt>(avail_in);
+				}
+
+				// skip the trailer of the member, the next members are read as gzip
+				if (m_skip > 0)
+				{
+					auto n = std::min<size_t>(m_skip, m_z.avail_in);
+					m_z.next_in += n;
+					m_z.avail_in -= static_cast<uInt>(n);
+					if ((m_skip -= n) == 0)
+						inflateReset2(&m_z, MAX_WBITS + 16);
+					continue;
+				}
+
+				int err = inflate(&m_z, Z_NO_FLUSH);
+
+				if (err == Z_STREAM_END)
+				{
+					if (m_raw)
+					{
+						m_raw = false;
+						m_skip = 8;
+					}
+					else
+						inflateReset(&m_z);
+				}
+				else if (err != Z_OK)
+					m_eof = true;
+			}
+
+			return size - m_z.avail_out;
+		}
+
+#if HAVE_LibLZMA
+		/// \brief Start decoding the xz block at point \a i
+		bool start_block(size_t i)
+		{
+			auto &p = m_index.m_points[i];
+
+			std::uint8_t header[LZMA_BLOCK_HEADER_SIZE_MAX];
+
+			m_file.clear();
+			m_file.seekg(p.compressed);
+			m_file.read(reinterpret_cast<char *>(header), 1);
+			if (not m_file or header[0] == 0)
+				return false;
+
+			lzma_filter filters[LZMA_FILTERS_MAX + 1];
+			lzma_block block{};
+			block.check = static_cast<lzma_check>(p.bits);
+			block.filters = filters;
+			block.header_size = lzma_block_header_size_decode(header[0]);
+
+			m_file.read(reinterpret_cast<char *>(header) + 1, block.header_size - 1);
+			if (not m_file or lzma_block_header_decode(&block, nullptr, header) != LZMA_OK)
+				return false;
+
+			auto err = lzma_block_decoder(&m_lzma, &block);
+
+			for (size_t f = 0; filters[f].id != LZMA_VLI_UNKNOWN; ++f)
+				free(filters[f].options);
+
+			m_lzma.avail_in = 0;
+			m_point = i;
+
+			return err == LZMA_OK;
+		}
+
+		size_t read_xz(char *data, size_t size)
+		{
+			m_lzma.next_out = reinterpret_cast<std::uint8_t *>(data);
+			m_lzma.avail_out = size;
+
+			while (m_lzma.avail_out == size and not m_eof)
+			{
+				if (m_lzma.avail_in == 0)
+					fill(m_lzma.next_in, m_lzma.avail_in);
+
+				auto err = lzma_code(&m_lzma, LZMA_RUN);
+
+				// at the end of a block continue with the next, every block is an index point
+				if (err == LZMA_STREAM_END)
+					m_eof = m_point + 1 >= m_index.m_points.size() or not start_block(m_point + 1);
+				else if (err != LZMA_OK or (m_lzma.avail_in == 0 and m_lzma.avail_out == size))
+					m_eof = true;
+			}
+
+			return size - m_lzma.avail_out;
+		}
+#endif
+
+		const sorted_index &m_index;
+		std::ifstream m_file;
+		std::vector<char> m_in;
+		bool m_eof = false;
+
+		z_stream m_z{};
+		bool m_initialized = false;
+		bool m_raw = true;
+		size_t m_skip = 0;
+
+#if HAVE_LibLZMA
+		lzma_stream m_lzma = LZMA_STREAM_INIT;
+		size_t m_point = 0;
+#endif
+
+		gxrio::ifstream m_stream;
+	};
+
+	/// \brief Call \a f with each line and its offset, starting at offset \a offset
+	/// in the data decompressed from point \a i, until it returns false
+	template <typename F>
+	void for_each_line(size_t i, std::uint64_t offset, F &&f) const
+	{
+		reader r(*this, i);
+		std::vector<char> buffer(kBufferSize);
+
+		for (auto pos = m_points[i].uncompressed; pos < offset;)
+		{
+			auto n = r.read(buffer.data(), std::min<std::uint64_t>(buffer.size(), offset - pos));
+			if (n == 0)
+				return;
+			pos += n;
+		}
+
+		std::string pending;
+
+		for (;;)
+		{
+			auto n = r.read(buffer.data(), buffer.size());
+			if (n == 0)
+				break;
+
+			for (const char *b = buffer.data(), *e = b + n; b < e;)
+			{
+				auto nl = detail::find(b, e, '\n');
+				if (nl == e)
+				{
+					pending.append(b, e);
+					break;
+				}
+
+				std::string_view line(b, nl - b);
+				if (not pending.empty())
+					line = pending.append(b, nl);
+
+				if (not f(line, offset))
+					return;
+
+				offset += line.length() + 1;
+				pending.clear();
+				b = nl + 1;
+			}
+		}
+
+		if (not pending.empty())
+			f(std::string_view(pending), offset);
+	}
+
+	/// \brief Build the index by reading the whole file, returns false on error
+	bool build()
+	{
+		std::ifstream file(m_file, std::ios::binary);
+		if (not file.is_open())
+			return false;
+
+		char signature[6] = {};
+		file.read(signature, sizeof(signature));
+		file.clear();
+		file.seekg(0);
+
+		bool result = true;
+		if (std::string_view(signature, 2) == "\x1f\x8b")
+		{
+			m_format = format::gzip;
+			result = build_gzip(file);
+		}
+#if HAVE_LibLZMA
+		else if (std::string_view(signature, 6) == std::string_view("\xfd" "7zXZ\0", 6))
+		{
+			m_format = format::xz;
+			result = build_xz(file);
+		}
+#endif
+
+		if (m_points.empty())
+		{
+			m_format = format::other;
+			m_points.push_back({ 0, 0, 0, 0, {}, {} });
+		}
+
+		// Record the first line starting after each point, other than the first
+		for (size_t i = 1; result and i < m_points.size(); ++i)
+		{
+			auto &p = m_points[i];
+			p.line = kNoLine;
+
+			bool first = true;
+			for_each_line(i, p.uncompressed, [&](std::string_view line, std::uint64_t offset)
+				{
+					if (std::exchange(first, false))
+						return true;
+					p.line = offset;
+					p.key = line.substr(0, line.find(m_options.delimiter));
+					return false;
+				});
+		}
+
+		return result;
+	}
+
+	/// \brief Collect the points at deflate block boundaries
+	bool build_gzip(std::ifstream &file)
+	{
+		z_stream z{};
+		if (inflateInit2(&z, MAX_WBITS + 16) != Z_OK)
+			return false;
+
+		std::vector<char> in(kBufferSize);
+		std::vector<char> window(kWindowSize);
+		std::uint64_t total_in = 0, total_out = 0;
+
+		int err = Z_OK;
+		do
+		{
+			if (z.avail_in == 0)
+			{
+				file.read(in.data(), in.size());
+				z.next_in = reinterpret_cast<Bytef *>(in.data());
+				z.avail_in = static_cast<uInt>(file.gcount());
+				total_in += z.avail_in;
+			}
+
+			// the output rotates through the window
+			if (z.avail_out == 0)
+			{
+				z.next_out = reinterpret_cast<Bytef *>(window.data());
+				z.avail_out = static_cast<uInt>(window.size());
+			}
+
+			auto avail_out = z.avail_out;
+			err = inflate(&z, Z_BLOCK);
+			total_out += avail_out - z.avail_out;
+
+			// at the end of a gzip header or a deflate block that is not the last
+			if ((z.data_type & 0xc0) == 0x80 and (m_points.empty() or total_out - m_points.back().uncompressed >= m_options.span))
+			{
+				std::string dict(window.data() + window.size() - z.avail_out, z.avail_out);
+				dict.append(window.data(), window.size() - z.avail_out);
+				dict.erase(0, dict.size() - std::min<std::uint64_t>(dict.size(), total_out));
+
+				m_points.push_back({ total_in - z.avail_in, total_out, 0, z.data_type & 7, {}, std::move(dict) });
+			}
+
+			// another member follows
+			if (err == Z_STREAM_END and (z.avail_in > 0 or file.peek() != std::char_traits<char>::eof()))
+				err = inflateReset(&z);
+		} while (err == Z_OK);
+
+		inflateEnd(&z);
+
+		return err == Z_STREAM_END;
+	}
+
+#if HAVE_LibLZMA
+	/// \brief Collect the xz blocks from the indices in the file
+	///
+	/// Reading the indices requires liblzma 5.4, with older versions no points are
+	/// collected and the file is scanned from the start.
+	bool build_xz([[maybe_unused]] std::ifstream &file)
+	{
+#if LZMA_VERSION >= 50040002
+		lzma_stream strm = LZMA_STREAM_INIT;
+		lzma_index *index = nullptr;
+
+		if (lzma_file_info_decoder(&strm, &index, UINT64_MAX, m_size) != LZMA_OK)
+			return false;
+
+		std::vector<char> in(kBufferSize);
+
+		lzma_ret err;
+		do
+		{
+			if (strm.avail_in == 0)
+			{
+				file.read(in.data(), in.size());
+				strm.next_in = reinterpret_cast<std::uint8_t *>(in.data());
+				strm.avail_in = file.gcount();
+			}
+
+			err = lzma_code(&strm, LZMA_RUN);
+
+			if (err == LZMA_SEEK_NEEDED)
+			{
+				file.clear();
+				file.seekg(strm.seek_pos);
+				strm.avail_in = 0;
+				err = LZMA_OK;
+			}
+		} while (err == LZMA_OK);
+
+		lzma_end(&strm);
+
+		if (err != LZMA_STREAM_END)
+			return false;
+
+		lzma_index_iter iter;
+		lzma_index_iter_init(&iter, index);
+
+		while (not lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK))
+		{
+			m_points.push_back({ iter.block.compressed_file_offset, iter.block.uncompressed_file_offset, 0,
+				static_cast<int>(iter.stream.flags->check), {}, {} });
+		}
+
+		lzma_index_end(index, nullptr);
+#endif
+
+		return true;
+	}
+#endif
+
+	/// \brief The name of the index file
+	std::filesystem::path index_path() const
+	{
+		auto result = m_file;
+		result += ".gxi";
+		return result;
+	}
+
+	/// \brief Load the stored index if it was made for this version of the file and these options
+	bool load()
+	{
+		std::ifstream in(index_path(), std::ios::binary);
+
+		std::string magic;
+		int version = 0, fmt = 0, delimiter = 0;
+		std::uint64_t size = 0, span = 0, count = 0;
+		long long time = 0;
+
+		in >> magic >> version >> fmt >> size >> time >> span >> delimiter >> count;
+
+		if (in.fail() or magic != "gxrio-index" or version != 1 or size != m_size or time != m_time or
+			span != m_options.span or delimiter != m_options.delimiter or fmt > static_cast<int>(format::xz))
+			return false;
+
+		m_format = static_cast<format>(fmt);
+
+		for (std::uint64_t i = 0; i < count; ++i)
+		{
+			point p;
+			size_t key_size = 0, window_size = 0;
+
+			in >> p.compressed >> p.uncompressed >> p.line >> p.bits >> key_size >> window_size;
+			if (in.get() != '\n' or key_size > kBufferSize or window_size > kWindowSize)
+				break;
+
+			p.key.resize(key_size);
+			in.read(p.key.data(), key_size);
+
+			if (window_size > 0)
+			{
+				p.window_offset = in.tellg();
+				p.window_size = window_size;
+				in.seekg(window_size, std::ios::cur);
+			}
+
+			if (in.fail())
+				break;
+
+			m_points.push_back(std::move(p));
+		}
+
+		// the last window must be complete
+		auto end = in.tellg();
+		in.seekg(0, std::ios::end);
+
+		if (m_points.size() != count or count == 0 or in.fail() or in.tellg() != end)
+		{
+			m_points.clear();
+			return false;
+		}
+
+		m_valid = true;
+		return true;
+	}
+
+	/// \brief Read the window of \a p from the index file into \a window, returns false on error
+	bool load_window(const point &p, std::string &window) const
+	{
+		std::ifstream in(index_path(), std::ios::binary);
+		in.seekg(p.window_offset);
+
+		window.resize(p.window_size);
+		in.read(window.data(), window.size());
+
+		return not in.fail();
+	}
+
+	/// \brief Store the index, failing to do so is not an error
+	void save() const
+	{
+		auto file = index_path();
+		auto tmp = file;
+		tmp += ".tmp";
+
+		{
+			std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+
+			out << "gxrio-index 1 " << static_cast<int>(m_format) << ' ' << m_size << ' ' << m_time << ' '
+				<< m_options.span << ' ' << static_cast<int>(m_options.delimiter) << ' ' << m_points.size() << '\n';
+
+			for (auto &p : m_points)
+			{
+				out << p.compressed << ' ' << p.uncompressed << ' ' << p.line << ' ' << p.bits << ' '
+					<< p.key.size() << ' ' << p.window.size() << '\n'
+					<< p.key << p.window;
+			}
+
+			out.close();
+
+			if (out.fail())
+				return;
+		}
+
+		std::error_code ec;
+		std::filesystem::rename(tmp, file, ec);
+	}
+
+	std::filesystem::path m_file;
+	sorted_index_options m_options;
+	format m_format = format::other;
+	std::vector<point> m_points;
+	size_t m_searchable = 0;
+	bool m_valid = false;
+
+	/// \brief The size and modification time of the file the index was built for
+	std::uint64_t m_size = 0;
+	long long m_time = 0;
+};
+
+/// \brief Return the first line in the sorted file \a file with key \a key
+///
+/// A convenience wrapper around sorted_index, the index is built on the first call
+/// and stored next to the file for subsequent calls. Each call loads the stored
+/// index again, for many lookups in the same file keep a sorted_index instead.
+
+template <typename Compare = std::less<>>
+std::optional<std::string> sorted_lookup(const std::filesystem::path &file, std::string_view key, Compare comp = {},
+	const sorted_index_options &options = {})
+{
+	return sorted_index(file, options).find(key, comp);
+}
+
+#if GXRIO_CXX20
+
+// --------------------------------------------------------------------
+
+/// \brief Read decompressed data in chunks from a coroutine
+///
+/// \tparam CharT		Type of the character stream.
+/// \tparam Traits		Traits for character type, defaults to char_traits<_CharT>.
+///
+/// Reading and decompressing is done on an executor, the awaiting coroutine
+/// is resumed on the executor's thread once a chunk is available. An executor
+/// is anything that has a post member accepting a std::function<void()>, like
+/// gxrio::thread_pool. This way many compressed files can be read concurrently
+/// using only a few threads.
+///
+/// \code
+/// 	gxrio::thread_pool pool(4);
+/// 	gxrio::async_reader reader("data.xz", pool);
+///
+/// 	for (;;)
+/// 	{
+/// 		auto chunk = co_await reader.next_chunk();
+/// 		if (chunk.empty())
+/// 			break;
+/// 		...
+/// 	}
+/// \endcode
+
+template <typename CharT, typename Traits>
+class basic_async_reader
+{
+  public:
+	using char_type = CharT;
+	using traits_type = Traits;
+
+	using ifstream_type = basic_ifstream<char_type, traits_type>;
+	using chunk_type = std::span<const char_type>;
+
+	static constexpr size_t kDefaultChunkSize = 64 * 1024;
+
+	/// \brief Construct an async_reader
+	/// \param filename The file to read
+	/// \param executor The executor on which the decompression is done
+	/// \param chunk_size The maximum size of the chunks returned by next_chunk
+	template <typename Executor>
+	basic_async_reader(const std::filesystem::path &filename, Executor &executor, size_t chunk_size = kDefaultChunkSize)
+		: m_in(filename)
+		, m_post([&executor](std::function<void()> job) { executor.post(std::move(job)); })
+		, m_buffer(chunk_size)
+	{
+		m_in.exceptions(std::ios_base::badbit);
+	}
+
+	basic_async_reader(const basic_async_reader &) = delete;
+	basic_async_reader &operator=(const basic_async_reader &) = delete;
+
+	/// \brief Return true if the file is open
+	bool is_open() const
+	{
+		return m_in.is_open();
+	}
+
+	/// \brief Return true if all data has been read
+	bool eof() const
+	{
+		return m_eof;
+	}
+
+	/// \brief The awaitable returned by next_chunk
+	class chunk_awaiter
+	{
+	  public:
+		explicit chunk_awaiter(basic_async_reader &reader)
+			: m_reader(reader)
+		{
+		}
+
+		bool await_ready() const noexcept
+		{
+			return m_reader.m_eof;
+		}
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			m_reader.m_post([&reader = m_reader, handle]
+			{
+				reader.fill();
+				handle.resume();
+			});
+		}
+
+		chunk_type await_resume()
+		{
+			if (m_reader.m_error)
+				std::rethrow_exception(std::exchange(m_reader.m_error, nullptr));
+
+			return { m_reader.m_buffer.data(), m_reader.m_size };
+		}
+
+	  private:
+		basic_async_reader &m_reader;
+	};
+
+	/// \brief Return the next chunk of decompressed data
+	///
+	/// The returned span remains valid until the next call to next_chunk,
+	/// an empty span is returned at end of file.
+	chunk_awaiter next_chunk()
+	{
+		m_size = 0;
+		return chunk_awaiter{ *this };
+	}
+
+  private:
+	/// \brief Read the next chunk, called on the executor
+	void fill()
+	{
+		try
+		{
+			m_in.read(m_buffer.data(), m_buffer.size());
+			m_size = static_cast<size_t>(m_in.gcount());
+
+			if (m_size == 0)
+				m_eof = true;
+		}
+		catch (...)
+		{
+			m_error = std::current_exception();
+			m_eof = true;
+		}
+	}
+
+	ifstream_type m_in;
+	std::function<void(std::function<void()>)> m_post;
+	std::vector<char_type> m_buffer;
+	size_t m_size = 0;
+	bool m_eof = false;
+	std::exception_ptr m_error;
+};
+
+using async_reader = basic_async_reader<char, std::char_traits<char>>;
+
+// --------------------------------------------------------------------
+
+/// \brief An input range over the decompressed contents of a file
+///
+/// \tparam CharT		Type of the character stream.
+/// \tparam Traits		Traits for character type, defaults to char_traits<_CharT>.
+/// \tparam Splitter	Function object that splits off the next element
+///
+/// The elements are string_views pointing directly into the buffer of the
+/// decompressing streambuf whenever possible. Only when an element straddles
+/// two buffers its contents are collected in a scratch buffer that is
+/// reused for every element. An element is valid until the iterator is
+/// incremented.
+///
+/// Use gxrio::lines and gxrio::chunks to create these views.
+
+template <typename CharT, typename Traits, typename Splitter>
+class basic_split_view : public std::ranges::view_interface<basic_split_view<CharT, Traits, Splitter>>
+{
+  public:
+	using string_view_type = std::basic_string_view<CharT, Traits>;
+
+	basic_split_view() = default;
+
+	basic_split_view(const std::filesystem::path &filename, Splitter splitter)
+		: m_state(new state(filename, std::move(splitter)))
+	{
+	}
+
+  private:
+	struct state
+	{
+		state(const std::filesystem::path &filename, Splitter splitter)
+			: m_in(filename)
+			, m_reader(m_in.rdbuf())
+			, m_splitter(std::move(splitter))
+		{
+		}
+
+		/// \brief Advance to the next element
+		void next()
+		{
+			m_reader.consume(std::exchange(m_pending, 0));
+			m_scratch.clear();
+
+			for (;;)
+			{
+				auto data = m_reader.peek();
+
+				if (data.empty())
+				{
+					// end of input, return what was collected
+					m_done = m_scratch.empty();
+					m_current = m_scratch;
+					break;
+				}
+
+				// The splitter returns the length of the element and the number
+				// of characters to consume, or npos if more data is needed.
+				auto [length, skip] = m_splitter(data, m_scratch.length());
+
+				if (length == string_view_type::npos)
+				{
+					m_scratch.append(data);
+					m_reader.consume(data.length());
+					continue;
+				}
+
+				if (m_scratch.empty())
+				{
+					m_current = data.substr(0, length);
+					m_pending = skip;
+				}
+				else
+				{
+					m_scratch.append(data.substr(0, length));
+					m_reader.consume(skip);
+					m_current = m_scratch;
+				}
+
+				break;
+			}
+		}
+
+		basic_ifstream<CharT, Traits> m_in;
+		basic_view_reader<CharT, Traits> m_reader;
+		Splitter m_splitter;
+		std::basic_string<CharT, Traits> m_scratch;
+		string_view_type m_current;
+		size_t m_pending = 0;
+		bool m_started = false;
+		bool m_done = false;
+	};
+
+  public:
+	class iterator
+	{
+	  public:
+		using value_type = string_view_type;
+		using difference_type = std::ptrdiff_t;
+
+		iterator() = default;
+
+		explicit iterator(state *st)
+			: m_state(st)
+		{
+		}
 
-		return *this;
+		string_view_type operator*() const
+		{
+			return m_state->m_current;
+		}
+
+		iterator &operator++()
+		{
+			m_state->next();
+			return *this;
+		}
+
+		void operator++(int)
+		{
+			m_state->next();
+		}
+
+		friend bool operator==(const iterator &i, std::default_sentinel_t)
+		{
+			return i.m_state == nullptr or i.m_state->m_done;
+		}
+
+	  private:
+		state *m_state = nullptr;
+	};
+
+	/// \brief Return an iterator to the first element, can be called only once
+	iterator begin()
+	{
+		if (m_state and not m_state->m_started)
+		{
+			m_state->m_started = true;
+			m_state->next();
+		}
+
+		return iterator{ m_state.get() };
 	}
 
-	/// \brief Open the file \a filename with mode \a mode
-	/// \param filename std::filesystem::path specifying the file to open
-	/// \param mode The mode in which to open the file
-	///
-	/// A compression algorithm is chosen upon the contents of the
-	/// extension() of \a filename with .gz mapping to gzip compression
-	/// and .xz to xz compression.
+	std::default_sentinel_t end() const
+	{
+		return {};
+	}
 
-	void open(const std::filesystem::path &filename, std::ios_base::openmode mode = std::ios_base::out)
+  private:
+	std::unique_ptr<state> m_state;
+};
+
+namespace detail
+{
+
+/// \brief Splits off lines, the newline character is not included
+template <typename CharT, typename Traits>
+struct line_splitter
+{
+	std::pair<size_t, size_t> operator()(std::basic_string_view<CharT, Traits> data, size_t) const
 	{
-		if (not m_filebuf.open(filename, mode | std::ios::binary))
-			this->setstate(std::ios_base::failbit);
-		else
+		auto nl = data.find(Traits::to_char_type('\n'));
+		if (nl == data.npos)
+			return { data.npos, 0 };
+		return { nl, nl + 1 };
+	}
+};
+
+/// \brief Splits off chunks of a fixed size
+template <typename CharT, typename Traits>
+struct chunk_splitter
+{
+	size_t m_size;
+
+	std::pair<size_t, size_t> operator()(std::basic_string_view<CharT, Traits> data, size_t collected) const
+	{
+		if (collected + data.length() < m_size)
+			return { data.npos, 0 };
+		return { m_size - collected, m_size - collected };
+	}
+};
+
+} // namespace detail
+
+template <typename CharT, typename Traits>
+using basic_line_view = basic_split_view<CharT, Traits, detail::line_splitter<CharT, Traits>>;
+
+template <typename CharT, typename Traits>
+using basic_chunk_view = basic_split_view<CharT, Traits, detail::chunk_splitter<CharT, Traits>>;
+
+using line_view = basic_line_view<char, std::char_traits<char>>;
+using chunk_view = basic_chunk_view<char, std::char_traits<char>>;
+
+/// \brief Return an input range of the lines in \a filename
+///
+/// The file is decompressed on the fly if needed. The lines are
+/// string_views without the trailing newline.
+inline line_view lines(const std::filesystem::path &filename)
+{
+	return { filename, {} };
+}
+
+/// \brief Return an input range of chunks of \a size characters in \a filename
+///
+/// The file is decompressed on the fly if needed. All chunks
+/// have length \a size, except perhaps the last one. Throws
+/// std::invalid_argument if \a size is zero.
+inline chunk_view chunks(const std::filesystem::path &filename, size_t size)
+{
+	if (size == 0)
+		throw std::invalid_argument("Chunk size must be larger than zero");
+
+	return { filename, { size } };
+}
+
+// --------------------------------------------------------------------
+
+/// \brief The output of decompress_batch, the decompressed blobs are stored
+/// one after the other in data.
+///
+/// Passing the same batch_output to subsequent calls reuses its memory.
+
+struct batch_output
+{
+	/// \brief The decompressed data of all blobs
+	std::vector<char> data;
+
+	/// \brief Blob i is stored in data from offsets[i] up to offsets[i + 1]
+	std::vector<size_t> offsets;
+
+	/// \brief The indices of the blobs that could not be decompressed, these are empty in data
+	std::vector<size_t> failed;
+
+	/// \brief The number of blobs
+	size_t size() const
+	{
+		return offsets.empty() ? 0 : offsets.size() - 1;
+	}
+
+	/// \brief The decompressed data of blob \a i
+	std::string_view operator[](size_t i) const
+	{
+		return { data.data() + offsets[i], offsets[i + 1] - offsets[i] };
+	}
+};
+
+namespace detail
+{
+
+/// \brief A streambuf reading from memory
+class span_streambuf : public std::streambuf
+{
+  public:
+	explicit span_streambuf(std::span<const char> data)
+	{
+		auto p = const_cast<char *>(data.data());
+		setg(p, p, p + data.size());
+	}
+};
+
+/// \brief Decompresses blobs in memory, the zlib and xz state is reused for each blob
+class batch_decoder
+{
+  public:
+	batch_decoder() = default;
+
+	batch_decoder(const batch_decoder &) = delete;
+	batch_decoder &operator=(const batch_decoder &) = delete;
+
+	~batch_decoder()
+	{
+		if (m_zstream_init)
+			::inflateEnd(&m_zstream);
+#if HAVE_LibLZMA
+		::lzma_end(&m_xzstream);
+#endif
+	}
+
+	/// \brief Append the decompressed data in \a blob to \a out, returns false on error
+	/// or when one of the \a limits is exceeded, leaving \a out unchanged. Data that
+	/// is not compressed is copied as is.
+	///
+	/// The format is sniffed like basic_istream does, gzip and xz are handled here,
+	/// other codecs using their streambuf.
+	bool decompress(std::span<const char> blob, std::vector<char> &out, const decompression_limits &limits)
+	{
+		std::string_view data(blob.data(), blob.size());
+		auto start = out.size();
+
+		m_limits = limits;
+		m_blob_size = blob.size();
+		if (limits.max_cpu_time.count() > 0)
+			m_deadline = std::chrono::steady_clock::now() + limits.max_cpu_time;
+
+		bool result;
+		try
 		{
-			if (filename.extension() == ".gz")
-				this->m_gxriobuf.reset(new gzip_streambuf_type);
+			if (data.starts_with(gzip_codec::signature))
+				result = inflate(data, out);
 #if HAVE_LibLZMA
-			else if (filename.extension() == ".xz")
-				this->m_gxriobuf.reset(new xz_streambuf_type);
+			else if (data.starts_with(xz_codec::signature))
+				result = unxz(data, out);
 #endif
 			else
-				this->m_gxriobuf.reset(nullptr);
+				result = decompress_other(blob, out);
+		}
+		catch (const std::exception &)
+		{
+			result = false;
+		}
 
-			if (this->m_gxriobuf)
+		if (not result)
+			out.resize(start);
+
+		return result;
+	}
+
+  private:
+	/// \brief Make room for at least \a hint more characters after the \a used characters in \a out
+	static void grow(std::vector<char> &out, size_t used, size_t hint)
+	{
+		out.resize(used + std::max<size_t>(hint, 4096));
+	}
+
+	/// \brief Throws limit_exceeded if decompressing \a size bytes from the blob exceeds a limit
+	void check(std::uint64_t size) const
+	{
+		if (m_limits.max_output > 0 and size > m_limits.max_output)
+			throw limit_exceeded(limit_exceeded::limit_type::output, "Maximum decompressed size exceeded");
+
+		if (m_limits.max_ratio > 0 and size > m_limits.max_ratio * (m_blob_size ? m_blob_size : 1))
+			throw limit_exceeded(limit_exceeded::limit_type::ratio, "Maximum expansion ratio exceeded");
+
+		if (m_limits.max_cpu_time.count() > 0 and std::chrono::steady_clock::now() > m_deadline)
+			throw limit_exceeded(limit_exceeded::limit_type::cpu_time, "Maximum decompression time exceeded");
+	}
+
+	bool inflate(std::string_view data, std::vector<char> &out)
+	{
+		int err = m_zstream_init ? ::inflateReset2(&m_zstream, 47) : ::inflateInit2(&m_zstream, 47);
+		if (err != Z_OK)
+			return false;
+		m_zstream_init = true;
+
+		// gzip stores the size modulo 2^32 in the last four bytes, deflate
+		// does not expand data more than 1032 times
+		std::uint32_t isize = 0;
+		for (size_t i = 0; i < 4 and i < data.size(); ++i)
+			isize |= static_cast<std::uint32_t>(static_cast<unsigned char>(data[data.size() - 1 - i])) << (8 * (3 - i));
+
+		size_t hint = std::min<size_t>(isize + 1, data.size() * 1032);
+		if (m_limits.max_output > 0)
+			hint = std::min<size_t>(hint, m_limits.max_output + 1);
+
+		size_t start = out.size(), used = start;
+		grow(out, used, hint);
+
+		m_zstream.avail_in = 0;
+
+		for (;;)
+		{
+			if (m_zstream.avail_in == 0 and not data.empty())
 			{
-				if (not this->m_gxriobuf->init(&m_filebuf))
-					this->setstate(std::ios_base::failbit);
-				else
-				{
-					this->rdbuf(this->m_gxriobuf.get());
-					this->clear();
-				}
+				auto n = std::min(data.size(), kMaxZlibSlice);
+				m_zstream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+				m_zstream.avail_in = static_cast<uInt>(n);
+				data.remove_prefix(n);
 			}
-			else
+
+			if (used == out.size())
+				grow(out, used, used - start);
+
+			auto avail = std::min(out.size() - used, kMaxZlibSlice);
+			m_zstream.next_out = reinterpret_cast<Bytef *>(out.data() + used);
+			m_zstream.avail_out = static_cast<uInt>(avail);
+
+			err = ::inflate(&m_zstream, Z_NO_FLUSH);
+			used += avail - m_zstream.avail_out;
+			check(used - start);
+
+			if (err == Z_STREAM_END)
 			{
-				this->rdbuf(&m_filebuf);
-				this->clear();
+				if (m_zstream.avail_in == 0 and data.empty())
+					break;
+
+				// another gzip member follows
+				err = ::inflateReset(&m_zstream);
 			}
+
+			if (err != Z_OK and not (err == Z_BUF_ERROR and m_zstream.avail_out == 0))
+				return false;
 		}
-	}
 
-	/// \brief Open the file \a filename with mode \a mode
-	/// \param filename std::string specifying the file to open
-	/// \param mode The mode in which to open the file
-	///
-	/// A compression algorithm is chosen upon the contents of the
-	/// extension of \a filename with .gz mapping to gzip compression
-	/// and .xz to xz compression.
+		out.resize(used);
+		return true;
+	}
 
-	void open(const std::string &filename, std::ios_base::openmode mode = std::ios_base::out)
+#if HAVE_LibLZMA
+	bool unxz(std::string_view data, std::vector<char> &out)
 	{
-		open(std::filesystem::path{filename}, mode);
-	}
+		// liblzma reuses the memory of the previous decoder
+		if (::lzma_stream_decoder(&m_xzstream, m_limits.memlimit ? m_limits.memlimit : UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+			return false;
 
-	/// \brief Open the file \a filename with mode \a mode
-	/// \param filename Null terminated string specifying the file to open
-	/// \param mode The mode in which to open the file
-	///
-	/// A compression algorithm is chosen upon the contents of the
-	/// extension of \a filename with .gz mapping to gzip compression
-	/// and .xz to xz compression.
+		m_xzstream.next_in = reinterpret_cast<const std::uint8_t *>(data.data());
+		m_xzstream.avail_in = data.size();
 
-	void open(const char *filename, std::ios_base::openmode mode = std::ios_base::out)
+		size_t start = out.size(), used = start;
+		grow(out, used, data.size() * 4);
+
+		for (;;)
+		{
+			if (used == out.size())
+				grow(out, used, used - start);
+
+			auto avail = out.size() - used;
+			m_xzstream.next_out = reinterpret_cast<std::uint8_t *>(out.data() + used);
+			m_xzstream.avail_out = avail;
+
+			auto err = ::lzma_code(&m_xzstream, LZMA_FINISH);
+			used += avail - m_xzstream.avail_out;
+			check(used - start);
+
+			if (err == LZMA_STREAM_END)
+				break;
+
+			if (err != LZMA_OK)
+				return false;
+		}
+
+		out.resize(used);
+		return true;
+	}
+#endif
+
+	/// \brief Decompress data of other codecs using their streambuf, or copy it
+	bool decompress_other(std::span<const char> blob, std::vector<char> &out)
 	{
-		open(std::filesystem::path{filename}, mode);
+		auto sb = make_decompressor<char, std::char_traits<char>, kDefaultBufferSize>(
+			std::string_view(blob.data(), std::min(blob.size(), kMaxSignatureLength)));
+
+		if (not sb)
+		{
+			out.insert(out.end(), blob.begin(), blob.end());
+			return true;
+		}
+
+		sb->set_limits(m_limits);
+
+		span_streambuf upstream(blob);
+		if (not sb->init(&upstream))
+			return false;
+
+		size_t start = out.size(), used = start;
+		for (;;)
+		{
+			grow(out, used, std::max(blob.size() * 4, used - start));
+
+			auto n = sb->sgetn(out.data() + used, out.size() - used);
+			if (n <= 0)
+				break;
+			used += n;
+		}
+
+		out.resize(used);
+		return true;
 	}
 
-	/// \brief Return true if the file is open
-	/// \return m_filebuf.is_open()
+	z_stream m_zstream{};
+	bool m_zstream_init = false;
+#if HAVE_LibLZMA
+	lzma_stream m_xzstream = LZMA_STREAM_INIT;
+#endif
 
-	bool is_open() const
+	/// \brief The limits for the current blob, its size and when its time is up
+	decompression_limits m_limits;
+	size_t m_blob_size = 0;
+	std::chrono::steady_clock::time_point m_deadline;
+};
+
+/// \brief Decompress \a blobs appending to \a data and \a offsets, the indices
+/// of blobs that failed, counting from \a first, are added to \a failed.
+inline void decompress_blobs(std::span<const std::span<const char>> blobs, size_t first,
+	std::vector<char> &data, std::vector<size_t> &offsets, std::vector<size_t> &failed,
+	const decompression_limits &limits)
+{
+	thread_local batch_decoder decoder;
+
+	for (size_t i = 0; i < blobs.size(); ++i)
 	{
-		return m_filebuf.is_open();
+		if (not decoder.decompress(blobs[i], data, limits))
+			failed.push_back(first + i);
+		offsets.push_back(data.size());
 	}
+}
 
-	/// \brief Close the file
-	///
-	/// Calls m_filebuf.close(). If that fails, the failbit is set.
+} // namespace detail
 
-	void close()
+/// \brief Decompress many small compressed blobs into \a output
+///
+/// Each blob is sniffed like basic_istream does and may be gzip, xz or
+/// any other codec with a signature, blobs that are not compressed are
+/// copied. The zlib and xz decoders are reset and reused for each blob
+/// instead of being created anew. Returns false if any blob could not
+/// be decompressed, see batch_output::failed.
+///
+/// Each blob is decompressed within \a limits, a blob exceeding one of
+/// them fails. Set these when decompressing untrusted data.
+
+inline bool decompress_batch(std::span<const std::span<const char>> blobs, batch_output &output,
+	const decompression_limits &limits = {})
+{
+	output.data.clear();
+	output.offsets.assign(1, 0);
+	output.failed.clear();
+
+	detail::decompress_blobs(blobs, 0, output.data, output.offsets, output.failed, limits);
+
+	return output.failed.empty();
+}
+
+/// \brief Decompress many small compressed blobs into \a output, using \a executor
+///
+/// The blobs are split into parts which are decompressed by jobs posted to
+/// \a executor, which can be a gxrio::thread_pool. Each thread reuses its own
+/// decoders. This call waits for the jobs and should not be made from a job
+/// running on the same executor. An exception thrown by a job, like
+/// std::bad_alloc, is rethrown here once all jobs are done. Each blob is
+/// decompressed within \a limits.
+///
+/// \code
+/// 	gxrio::thread_pool pool(4);
+/// 	gxrio::batch_output output;
+///
+/// 	gxrio::decompress_batch(blobs, output, pool);
+/// 	for (size_t i = 0; i < output.size(); ++i)
+/// 		process(output[i]);
+/// \endcode
+
+template <typename Executor, std::enable_if_t<not std::is_same_v<std::remove_const_t<Executor>, decompression_limits>, int> = 0>
+bool decompress_batch(std::span<const std::span<const char>> blobs, batch_output &output, Executor &executor,
+	const decompression_limits &limits = {})
+{
+	// parts of about this many compressed bytes are decompressed by one job
+	const size_t kPartSize = 256 * 1024;
+
+	struct part
 	{
-		if (this->m_gxriobuf and not this->m_gxriobuf->close())
-			this->setstate(std::ios_base::failbit);
+		size_t first, last;
+		std::vector<char> data;
+		std::vector<size_t> offsets;
+		std::vector<size_t> failed;
+		std::exception_ptr exception;
+	};
+
+	std::vector<part> parts;
+	for (size_t i = 0; i < blobs.size();)
+	{
+		size_t first = i, size = 0;
+		// each blob also costs a fixed amount of work, counted as 64 bytes
+		while (i < blobs.size() and size < kPartSize)
+			size += blobs[i++].size() + 64;
 
-		if (not m_filebuf.close())
-			this->setstate(std::ios_base::failbit);
+		parts.push_back({ first, i });
 	}
 
-	/// \brief Swap the contents with those of \a rhs
-	/// \param rhs The ifstream to swap with
+	std::latch done(static_cast<std::ptrdiff_t>(parts.size()));
 
-	void swap(basic_ofstream &rhs)
+	for (size_t i = 0; i < parts.size(); ++i)
 	{
-		base_type::swap(rhs);
-		m_filebuf.swap(rhs.m_filebuf);
-
-		if (this->m_gxriobuf)
+		try
 		{
-			this->m_gxriobuf.set_upstream(&m_filebuf);
-			this->rdbuf(this->m_gxriobuf.get());
-		}
-		else
-			this->rdbuf(&m_filebuf);
+			executor.post([&p = parts[i], blobs, &done, &limits]
+			{
+				try
+				{
+					p.offsets.reserve(p.last - p.first);
+					detail::decompress_blobs(blobs.subspan(p.first, p.last - p.first), p.first, p.data, p.offsets, p.failed, limits);
+				}
+				catch (...)
+				{
+					p.exception = std::current_exception();
+				}
 
-		if (rhs.m_gxriobuf)
+				done.count_down();
+			});
+		}
+		catch (...)
 		{
-			rhs.m_gxriobuf.set_upstream(&rhs.m_filebuf);
-			rhs.rdbuf(rhs.m_gxriobuf.get());
+			// the jobs already posted use parts and done
+			done.count_down(static_cast<std::ptrdiff_t>(parts.size() - i));
+			done.wait();
+			throw;
 		}
-		else
-			rhs.rdbuf(&rhs.m_filebuf);
 	}
 
-  private:
-	/// \brief The filebuf
-	filebuf_type m_filebuf;
-};
+	done.wait();
 
-// --------------------------------------------------------------------
+	for (auto &p : parts)
+	{
+		if (p.exception)
+			std::rethrow_exception(p.exception);
+	}
 
-/// \brief Convenience typedefs
-using istream = basic_istream<char, std::char_traits<char>>;
-using ifstream = basic_ifstream<char, std::char_traits<char>>;
+	size_t size = 0;
+	for (auto &p : parts)
+		size += p.data.size();
 
-// using ostream = basic_ostream<char, std::char_traits<char>>;
-using ofstream = basic_ofstream<char, std::char_traits<char>>;
+	output.data.resize(size);
+	output.offsets.assign(1, 0);
+	output.offsets.reserve(blobs.size() + 1);
+	output.failed.clear();
+
+	size_t offset = 0;
+	for (auto &p : parts)
+	{
+		std::copy(p.data.begin(), p.data.end(), output.data.begin() + offset);
+		for (auto o : p.offsets)
+			output.offsets.push_back(offset + o);
+		output.failed.insert(output.failed.end(), p.failed.begin(), p.failed.end());
+		offset += p.data.size();
+	}
+
+	return output.failed.empty();
+}
+
+#endif
 
 } // namespace gxrio
@@ -0,0 +1,113 @@
+//        Copyright Maarten L. Hekkelman, 2022
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#define BOOST_TEST_ALTERNATIVE_INIT_API
+#include <boost/test/included/unit_test.hpp>
+
+#include <stdexcept>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <gxrio.hpp>
+
+namespace tt = boost::test_tools;
+namespace fs = std::filesystem;
+
+fs::path gTestDir = fs::current_path(); // filled in first test
+
+// --------------------------------------------------------------------
+
+bool init_unit_test()
+{
+	// not a test, just initialize test dir
+	if (boost::unit_test::framework::master_test_suite().argc == 2)
+		gTestDir = boost::unit_test::framework::master_test_suite().argv[1];
+
+	return true;
+}
+
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(b_1)
+{
+	// Data compressed by the brotli library directly
+	std::string text = "Hello, world!\n";
+
+	std::vector<uint8_t> data(BrotliEncoderMaxCompressedSize(text.length()));
+	size_t size = data.size();
+	BOOST_REQUIRE(BrotliEncoderCompress(BROTLI_DEFAULT_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+		text.length(), reinterpret_cast<const uint8_t *>(text.data()), &size, data.data()));
+
+	std::stringbuf buffer(std::string(reinterpret_cast<char *>(data.data()), size));
+
+	gxrio::basic_ibrotli_streambuf<char, std::char_traits<char>> zb;
+	zb.init(&buffer);
+
+	std::istream in(&zb);
+
+	std::string line;
+	BOOST_CHECK(std::getline(in, line));
+	BOOST_CHECK_EQUAL(line, "Hello, world!");
+	BOOST_CHECK(not std::getline(in, line));
+}
+
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(b_2)
+{
+	std::filesystem::create_directories(std::filesystem::temp_directory_path() / "gxrio-unit-test");
+	auto f = std::filesystem::temp_directory_path() / "gxrio-unit-test" / "text.txt.br";
+
+	std::string text;
+	for (int i = 0; i < 100000; ++i)
+		text += "line " + std::to_string(i) + "\n";
+
+	gxrio::compression_options options;
+	options.level = 5;
+	options.window_bits = 18;
+
+	gxrio::ofstream out(f, options);
+	BOOST_CHECK(out.is_open());
+	out << text;
+	out.close();
+
+	BOOST_CHECK(fs::file_size(f) < text.length() / 4);
+
+	// the result should decompress using the brotli library
+	std::ifstream file(f, std::ios::binary);
+	std::string compressed((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+	std::string result(text.length(), 0);
+	size_t size = result.length();
+	BOOST_CHECK(BrotliDecoderDecompress(compressed.length(), reinterpret_cast<const uint8_t *>(compressed.data()),
+					&size, reinterpret_cast<uint8_t *>(result.data())) == BROTLI_DECODER_RESULT_SUCCESS);
+	BOOST_CHECK(size == text.length() and result == text);
+
+	gxrio::ifstream in(f);
+	BOOST_CHECK(in.is_open());
+	std::string s((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	BOOST_CHECK(s == text);
+}
+
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(b_3)
+{
+	std::filesystem::create_directories(std::filesystem::temp_directory_path() / "gxrio-unit-test");
+	auto f = std::filesystem::temp_directory_path() / "gxrio-unit-test" / "empty.txt.br";
+
+	gxrio::ofstream out(f);
+	out.close();
+
+	BOOST_CHECK(fs::file_size(f) > 0);
+
+	gxrio::ifstream in(f);
+	std::string line;
+	BOOST_CHECK(not getline(in, line));
+	BOOST_CHECK(in.eof());
+	BOOST_CHECK(not in.bad());
+}
@@ -0,0 +1,295 @@
+//        Copyright Maarten L. Hekkelman, 2022
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#define BOOST_TEST_ALTERNATIVE_INIT_API
+#include <boost/test/included/unit_test.hpp>
+
+#include <filesystem>
+#include <future>
+#include <iostream>
+
+#include <gxrio.hpp>
+
+namespace tt = boost::test_tools;
+namespace fs = std::filesystem;
+
+fs::path gTestDir = fs::current_path(); // filled in first test
+
+// --------------------------------------------------------------------
+
+bool init_unit_test()
+{
+	// not a test, just initialize test dir
+	if (boost::unit_test::framework::master_test_suite().argc == 2)
+		gTestDir = boost::unit_test::framework::master_test_suite().argv[1];
+
+	return true;
+}
+
+// --------------------------------------------------------------------
+
+// A minimal coroutine type, the coroutine starts immediately and
+// reports its result through a std::future.
+
+template <typename T>
+struct task
+{
+	struct promise_type
+	{
+		std::promise<T> m_promise;
+
+		task get_return_object() { return { m_promise.get_future() }; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_value(T value) { m_promise.set_value(std::move(value)); }
+		void unhandled_exception() { m_promise.set_exception(std::current_exception()); }
+	};
+
+	std::future<T> m_result;
+};
+
+task<std::string> read_all(fs::path file, gxrio::thread_pool &pool)
+{
+	gxrio::async_reader reader(file, pool, 1000);
+
+	std::string result;
+
+	for (;;)
+	{
+		auto chunk = co_await reader.next_chunk();
+		if (chunk.empty())
+			break;
+
+		BOOST_CHECK(chunk.size() <= 1000);
+		result.append(chunk.begin(), chunk.end());
+	}
+
+	co_return result;
+}
+
+std::string read_sync(fs::path file)
+{
+	gxrio::ifstream in(file);
+	return { std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
+}
+
+BOOST_AUTO_TEST_CASE(a_1)
+{
+	gxrio::thread_pool pool(2);
+
+	std::vector<fs::path> files{
+		gTestDir / "hello.txt",
+		gTestDir / "hello-1000.txt.gz",
+#if HAVE_LibLZMA
+		gTestDir / "hello-1000.txt.xz",
+#endif
+	};
+
+	std::vector<task<std::string>> tasks;
+	for (auto &f : files)
+		tasks.emplace_back(read_all(f, pool));
+
+	for (size_t i = 0; i < files.size(); ++i)
+		BOOST_CHECK(tasks[i].m_result.get() == read_sync(files[i]));
+
+	// a job that throws does not end its worker thread
+	gxrio::thread_pool single(1);
+	std::promise<int> result;
+
+	single.post([] { throw std::runtime_error("job failed"); });
+	single.post([&result] { result.set_value(42); });
+
+	BOOST_CHECK_EQUAL(result.get_future().get(), 42);
+}
+
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(r_1)
+{
+	for (fs::path f : {
+		gTestDir / "hello-1000.txt.gz",
+#if HAVE_LibLZMA
+		gTestDir / "hello-1000.txt.xz",
+#endif
+		})
+	{
+		int n = 0;
+		for (auto line : gxrio::lines(f))
+		{
+			BOOST_CHECK_EQUAL(line, "Hello, world! - this is line " + std::to_string(n));
+			++n;
+		}
+
+		BOOST_CHECK_EQUAL(n, 1000);
+
+		auto odd = gxrio::lines(f)
+			| std::views::filter([](std::string_view line) { return line.ends_with('1'); })
+			| std::views::transform([](std::string_view line) { return line.length(); });
+
+		n = 0;
+		for (auto length : odd)
+		{
+			BOOST_CHECK(length >= 30);
+			++n;
+		}
+
+		BOOST_CHECK_EQUAL(n, 100);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(r_2)
+{
+	for (fs::path f : {
+		gTestDir / "hello.txt",
+		gTestDir / "hello-1000.txt.gz",
+#if HAVE_LibLZMA
+		gTestDir / "hello-1000.txt.xz",
+#endif
+		})
+	{
+		std::string text;
+		size_t last = 0;
+		for (auto chunk : gxrio::chunks(f, 1000))
+		{
+			BOOST_CHECK(last == 0 or last == 1000);
+			last = chunk.length();
+			text += chunk;
+		}
+
+		BOOST_CHECK(text == read_sync(f));
+	}
+
+	BOOST_CHECK_THROW(gxrio::chunks(gTestDir / "hello.txt", 0), std::invalid_argument);
+}
+
+// --------------------------------------------------------------------
+
+template <typename Compressor>
+std::string compress(const std::string &text)
+{
+	std::stringbuf buffer;
+
+	Compressor zb;
+	zb.init(&buffer);
+	zb.sputn(text.data(), text.length());
+	zb.close();
+
+	return buffer.str();
+}
+
+BOOST_AUTO_TEST_CASE(b_1)
+{
+	std::vector<std::string> texts, blobs;
+
+	for (size_t i = 0; i < 3000; ++i)
+	{
+		std::string text;
+		for (size_t j = 0; j < i % 50; ++j)
+			text += "value " + std::to_string(i) + " part " + std::to_string(j) + '\n';
+
+		texts.push_back(text);
+
+		switch (i % 3)
+		{
+			case 0: blobs.push_back(compress<gxrio::basic_ogzip_streambuf<char, std::char_traits<char>>>(text)); break;
+#if HAVE_LibLZMA
+			case 1: blobs.push_back(compress<gxrio::basic_oxz_streambuf<char, std::char_traits<char>>>(text)); break;
+#endif
+			default: blobs.push_back(text); break;
+		}
+	}
+
+	// a truncated gzip blob
+	texts.push_back({});
+	blobs.push_back(blobs[3].substr(0, blobs[3].length() / 2));
+
+	std::vector<std::span<const char>> spans(blobs.begin(), blobs.end());
+
+	gxrio::thread_pool pool(2);
+	gxrio::batch_output output;
+
+	for (bool parallel : { false, true })
+	{
+		bool ok = parallel ? gxrio::decompress_batch(spans, output, pool) : gxrio::decompress_batch(spans, output);
+		BOOST_CHECK(not ok);
+
+		BOOST_REQUIRE_EQUAL(output.size(), texts.size());
+		for (size_t i = 0; i < texts.size(); ++i)
+			BOOST_CHECK(output[i] == texts[i]);
+
+		BOOST_REQUIRE_EQUAL(output.failed.size(), 1);
+		BOOST_CHECK_EQUAL(output.failed.front(), texts.size() - 1);
+	}
+
+	// compressed blobs exceeding the limits fail
+	gxrio::decompression_limits limits;
+	limits.max_output = 1000;
+
+	for (bool parallel : { false, true })
+	{
+		bool ok = parallel ? gxrio::decompress_batch(spans, output, pool, limits) : gxrio::decompress_batch(spans, output, limits);
+		BOOST_CHECK(not ok);
+
+		std::vector<size_t> failed;
+		for (size_t i = 0; i < texts.size(); ++i)
+		{
+			if (i + 1 == texts.size() or (blobs[i] != texts[i] and texts[i].length() > limits.max_output))
+				failed.push_back(i);
+			else
+				BOOST_CHECK(output[i] == texts[i]);
+		}
+
+		BOOST_CHECK(output.failed == failed);
+	}
+
+#if HAVE_LibLZMA
+	limits = {};
+	limits.memlimit = 1;
+
+	gxrio::decompress_batch(spans, output, pool, limits);
+
+	// an empty xz stream has no blocks and needs no memory for decoding them
+	for (size_t i = 0; i < texts.size(); ++i)
+		BOOST_CHECK_EQUAL(std::find(output.failed.begin(), output.failed.end(), i) != output.failed.end(),
+			(i % 3 == 1 and not texts[i].empty()) or i + 1 == texts.size());
+#endif
+
+	// an executor failing to post a job, the jobs that were posted must be done first
+	struct failing_executor
+	{
+		void post(std::function<void()> job)
+		{
+			if (++posted > 2)
+				throw std::bad_alloc();
+			pool.post(std::move(job));
+		}
+
+		gxrio::thread_pool &pool;
+		size_t posted = 0;
+	} executor{ pool };
+
+	BOOST_CHECK_THROW(gxrio::decompress_batch(spans, output, executor), std::bad_alloc);
+}
+
+BOOST_AUTO_TEST_CASE(w_1)
+{
+	auto file = fs::temp_directory_path() / "gxrio-write-gather.gz";
+
+	std::vector<std::string_view> fragments{ "key", "\t", "value", "\n" };
+
+	{
+		gxrio::ofstream out(file);
+		for (int i = 0; i < 1000; ++i)
+			out.write_gather(std::span<const std::string_view>(fragments));
+	}
+
+	std::string expected;
+	for (int i = 0; i < 1000; ++i)
+		expected += "key\tvalue\n";
+
+	BOOST_CHECK(read_sync(file) == expected);
+
+	fs::remove(file);
+}
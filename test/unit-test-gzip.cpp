@@ -11,6 +11,7 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 
 #include <gxrio.hpp>
 
@@ -297,3 +298,49 @@ BOOST_AUTO_TEST_CASE(d_3)
 	BOOST_CHECK_EQUAL(line, "aap noot mies");
 }
 
+
+// --------------------------------------------------------------------
+
+std::string compress_text(const std::string &text, bool rsyncable)
+{
+	std::stringbuf buffer;
+
+	gxrio::basic_ogzip_streambuf<char, std::char_traits<char>> zb;
+	zb.set_options({ 6, 1, rsyncable });
+	zb.init(&buffer);
+	zb.sputn(text.data(), text.size());
+	zb.close();
+
+	return buffer.str();
+}
+
+size_t common_tail(const std::string &a, const std::string &b)
+{
+	// skip the gzip trailer, it contains the crc and size
+	size_t n = 0;
+	while (n + 8 < a.length() and n + 8 < b.length() and a[a.length() - 9 - n] == b[b.length() - 9 - n])
+		++n;
+	return n;
+}
+
+BOOST_AUTO_TEST_CASE(rs_1)
+{
+	std::string text;
+	for (int i = 0; i < 20000; ++i)
+		text += "line " + std::to_string(i * 7919 % 10007) + " of some text\n";
+
+	std::string changed = text;
+	changed.insert(100, "x");
+
+	auto a = compress_text(text, true);
+	auto b = compress_text(changed, true);
+
+	BOOST_CHECK(common_tail(a, b) > a.length() / 2);
+	BOOST_CHECK(common_tail(compress_text(text, false), compress_text(changed, false)) < a.length() / 2);
+
+	std::stringbuf buffer(b);
+	gxrio::istream in(&buffer);
+
+	std::string result{ std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
+	BOOST_CHECK(result == changed);
+}
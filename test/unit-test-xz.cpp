@@ -309,3 +309,19 @@ BOOST_AUTO_TEST_CASE(d_3)
 	BOOST_CHECK_EQUAL(line, "aap noot mies");
 }
 
+
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(l_1)
+{
+	fs::path f = gTestDir / "hello-1000.txt.xz";
+
+	gxrio::decompression_limits limits;
+	limits.memlimit = 1024;
+
+	gxrio::ifstream in(f, limits);
+	in.exceptions(std::ios::badbit);
+
+	std::string line;
+	BOOST_CHECK_THROW(getline(in, line), gxrio::limit_exceeded);
+}
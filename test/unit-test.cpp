@@ -11,6 +11,8 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <random>
+#include <sstream>
 
 #include <gxrio.hpp>
 
@@ -298,4 +300,1211 @@ BOOST_AUTO_TEST_CASE(t_9)
 
 	BOOST_CHECK(not getline(file, line));
 	BOOST_CHECK(file.eof());
-}
\ No newline at end of file
+}
+
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(t_10)
+{
+	std::filesystem::create_directories(std::filesystem::temp_directory_path() / "gxrio-unit-test");
+
+	for (fs::path f : {
+		std::filesystem::temp_directory_path() / "gxrio-unit-test" / "bomb.gz",
+#if HAVE_LibLZMA
+		std::filesystem::temp_directory_path() / "gxrio-unit-test" / "bomb.xz",
+#endif
+		})
+	{
+		gxrio::ofstream out(f);
+		std::string zeros(1024 * 1024, 0);
+		for (int i = 0; i < 4; ++i)
+			out.write(zeros.data(), zeros.size());
+		out.close();
+
+		gxrio::decompression_limits limits;
+		limits.max_output = 1024 * 1024;
+
+		gxrio::ifstream in(f, limits);
+		BOOST_CHECK(in.is_open());
+
+		std::vector<char> buffer(4096);
+		std::uint64_t total = 0;
+		while (in.read(buffer.data(), buffer.size()))
+			total += in.gcount();
+
+		BOOST_CHECK(in.bad());
+		BOOST_CHECK(total <= limits.max_output);
+
+		limits = {};
+		limits.max_ratio = 100;
+
+		gxrio::ifstream in2;
+		in2.set_limits(limits);
+		in2.open(f);
+		in2.exceptions(std::ios::badbit);
+
+		try
+		{
+			while (in2.read(buffer.data(), buffer.size()))
+				;
+			BOOST_FAIL("Expected a limit_exceeded exception");
+		}
+		catch (const gxrio::limit_exceeded &ex)
+		{
+			BOOST_CHECK(ex.type() == gxrio::limit_exceeded::limit_type::ratio);
+		}
+	}
+}
+
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(t_11)
+{
+	std::filesystem::create_directories(std::filesystem::temp_directory_path() / "gxrio-unit-test");
+
+	for (fs::path f : {
+		std::filesystem::temp_directory_path() / "gxrio-unit-test" / "empty.txt.gz",
+#if HAVE_LibLZMA
+		std::filesystem::temp_directory_path() / "gxrio-unit-test" / "empty.txt.xz",
+#endif
+		})
+	{
+		// nothing written, the file should still be a valid compressed file
+		gxrio::ofstream out(f);
+		BOOST_CHECK(out.is_open());
+		out.close();
+
+		BOOST_CHECK(fs::file_size(f) > 0);
+
+		gxrio::ifstream in(f);
+		BOOST_CHECK(in.is_open());
+
+		std::string line;
+		BOOST_CHECK(not getline(in, line));
+		BOOST_CHECK(in.eof());
+		BOOST_CHECK(not in.bad());
+	}
+}
+
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(t_12)
+{
+	auto dir = std::filesystem::temp_directory_path() / "gxrio-unit-test";
+	std::filesystem::create_directories(dir);
+
+	std::string text;
+	for (int i = 0; text.length() < 1024 * 1024; ++i)
+		text += "line " + std::to_string(i) + " of the checkpointed text\n";
+
+	gxrio::compression_options options;
+	options.checkpoint_interval = 64 * 1024;
+
+	for (std::string ext : {
+		".gz",
+#if HAVE_LibLZMA
+		".xz",
+#endif
+		})
+	{
+		fs::path f = dir / ("ckpt.txt" + ext);
+		fs::path crashed = dir / ("crashed.txt" + ext);
+
+		fs::remove(crashed);
+
+		{
+			gxrio::ofstream out(f, options);
+			BOOST_CHECK(out.is_open());
+
+			out.write(text.data(), text.length() / 2);
+			BOOST_CHECK(fs::exists(f.string() + ".ckpt"));
+
+			// simulate a crash by taking a copy of the file and its journal halfway
+			out.rdbuf()->pubsync();
+			fs::copy_file(f, crashed, fs::copy_options::overwrite_existing);
+			fs::copy_file(f.string() + ".ckpt", crashed.string() + ".ckpt", fs::copy_options::overwrite_existing);
+
+			out.write(text.data() + text.length() / 2, text.length() - text.length() / 2);
+		}
+
+		BOOST_CHECK(not fs::exists(f.string() + ".ckpt"));
+
+		gxrio::ofstream out;
+		out.set_options(options);
+		auto cp = out.resume(crashed);
+		BOOST_REQUIRE(not out.fail());
+		BOOST_CHECK(cp.uncompressed > 0 and cp.uncompressed <= text.length() / 2);
+
+		out.write(text.data() + cp.uncompressed, text.length() - cp.uncompressed);
+		out.close();
+		BOOST_CHECK(not out.fail());
+		BOOST_CHECK(not fs::exists(crashed.string() + ".ckpt"));
+
+		gxrio::ifstream in(crashed);
+		std::string result((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		BOOST_CHECK(result == text);
+	}
+}
+
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(t_13)
+{
+	auto dir = std::filesystem::temp_directory_path() / "gxrio-unit-test";
+	std::filesystem::create_directories(dir);
+
+	fs::path f = dir / "follow.log.gz";
+
+	// A writer using zlib directly, flushing after each line
+	gzFile out = gzopen(f.string().c_str(), "wb");
+	BOOST_REQUIRE(out != nullptr);
+	gzputs(out, "line 0\n");
+	gzflush(out, Z_SYNC_FLUSH);
+
+	gxrio::ifstream in(f);
+	gxrio::follow_options options;
+	options.poll_interval = std::chrono::milliseconds(20);
+	options.idle_timeout = std::chrono::milliseconds(500);
+	in.follow(options);
+
+	std::thread writer([out]
+	{
+		for (int i = 1; i < 10; ++i)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			gzputs(out, ("line " + std::to_string(i) + "\n").c_str());
+			gzflush(out, Z_SYNC_FLUSH);
+		}
+		gzclose(out);
+	});
+
+	std::string line;
+	int n = 0;
+	while (getline(in, line))
+	{
+		BOOST_CHECK_EQUAL(line, "line " + std::to_string(n));
+		++n;
+	}
+
+	writer.join();
+
+	BOOST_CHECK_EQUAL(n, 10);
+	BOOST_CHECK(in.eof());
+	BOOST_CHECK(not in.bad());
+}
+
+// --------------------------------------------------------------------
+// A third-party codec that stores the data as is after a signature
+
+struct identity_codec
+{
+	static constexpr std::string_view name = "identity";
+	static constexpr std::string_view signature = "GXID";
+	static constexpr std::string_view extensions[] = { ".id" };
+
+	template <typename CharT, typename Traits, size_t BufferSize>
+	class decompressor : public gxrio::basic_streambuf<CharT, Traits>
+	{
+	  public:
+		decompressor *init(std::basic_streambuf<CharT, Traits> *sb) override
+		{
+			this->set_upstream(sb);
+			CharT sig[4];
+			return sb->sgetn(sig, 4) == 4 ? this : nullptr;
+		}
+
+		decompressor *close() override { return this; }
+
+		typename Traits::int_type underflow() override
+		{
+			auto n = this->m_upstream->sgetn(m_buffer, sizeof(m_buffer));
+			this->setg(m_buffer, m_buffer, m_buffer + n);
+			return n > 0 ? Traits::to_int_type(*m_buffer) : Traits::eof();
+		}
+
+	  private:
+		CharT m_buffer[BufferSize];
+	};
+
+	template <typename CharT, typename Traits, size_t BufferSize>
+	class compressor : public gxrio::basic_streambuf<CharT, Traits>
+	{
+	  public:
+		compressor *init(std::basic_streambuf<CharT, Traits> *sb) override
+		{
+			this->set_upstream(sb);
+			return sb->sputn(signature.data(), 4) == 4 ? this : nullptr;
+		}
+
+		compressor *close() override { return this; }
+
+		typename Traits::int_type overflow(typename Traits::int_type ch) override
+		{
+			return Traits::eq_int_type(ch, Traits::eof()) ? Traits::not_eof(ch) : this->m_upstream->sputc(Traits::to_char_type(ch));
+		}
+	};
+};
+
+BOOST_AUTO_TEST_CASE(t_14)
+{
+	gxrio::register_codec<identity_codec>();
+
+	auto dir = std::filesystem::temp_directory_path() / "gxrio-unit-test";
+	std::filesystem::create_directories(dir);
+
+	fs::path f = dir / "hello.txt.id";
+
+	{
+		gxrio::ofstream out(f);
+		out << "Hello, world!" << std::endl;
+	}
+
+	{
+		std::ifstream file(f, std::ios::binary);
+		std::string line;
+		BOOST_CHECK(getline(file, line));
+		BOOST_CHECK_EQUAL(line, "GXIDHello, world!");
+	}
+
+	// by extension
+	{
+		gxrio::ifstream in(f);
+		std::string line;
+		BOOST_CHECK(getline(in, line));
+		BOOST_CHECK_EQUAL(line, "Hello, world!");
+	}
+
+	// by signature
+	{
+		std::ifstream file(f, std::ios::binary);
+		gxrio::istream in(file.rdbuf());
+		std::string line;
+		BOOST_CHECK(getline(in, line));
+		BOOST_CHECK_EQUAL(line, "Hello, world!");
+	}
+
+	// by signature, from an unbuffered upstream that can put back one character only
+	{
+		gxrio::ofstream out(dir / "hello.gz");
+		out << "Hello, world!" << std::endl;
+	}
+
+	{
+		std::ofstream out(dir / "hello.txt");
+		out << "Hello, world!" << std::endl;
+	}
+
+	for (auto name : { "hello.txt.id", "hello.gz", "hello.txt" })
+	{
+		std::filebuf file;
+		file.pubsetbuf(nullptr, 0);
+		BOOST_REQUIRE(file.open(dir / name, std::ios::in | std::ios::binary));
+
+		gxrio::istream in(&file);
+		std::string line;
+		BOOST_CHECK(getline(in, line));
+		BOOST_CHECK_EQUAL(line, "Hello, world!");
+	}
+}
+
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(t_15)
+{
+	auto dir = std::filesystem::temp_directory_path() / "gxrio-unit-test";
+	std::filesystem::create_directories(dir);
+
+	fs::path f = dir / "table.tsv.gz";
+
+	{
+		gxrio::ofstream out(f);
+		for (int row = 0; row < 10000; ++row)
+		{
+			for (int col = 0; col < 20; ++col)
+				out << (col ? "\t" : "") << row * 100 + col;
+			out << '\n';
+		}
+		out << "short\n";
+	}
+
+	gxrio::ifstream in(f);
+	gxrio::delimited_reader reader(in, { 17, 3, 3, 0 });
+
+	int row = 0;
+	while (reader.next() and row < 10000)
+	{
+		int v17 = -1, v3 = -1, v0 = -1;
+		BOOST_CHECK(reader.get(0, v17));
+		BOOST_CHECK(reader.get(1, v3));
+		BOOST_CHECK(reader.get(3, v0));
+		BOOST_CHECK_EQUAL(v17, row * 100 + 17);
+		BOOST_CHECK_EQUAL(v3, row * 100 + 3);
+		BOOST_CHECK_EQUAL(reader[2], reader[1]);
+		BOOST_CHECK_EQUAL(v0, row * 100);
+		++row;
+	}
+
+	BOOST_CHECK_EQUAL(row, 10000);
+	BOOST_CHECK_EQUAL(reader[3], "short");
+	BOOST_CHECK(reader[0].empty());
+	BOOST_CHECK(not reader.next());
+
+	// quoted fields
+	std::stringbuf csv("name,remark,value\r\n"
+					   "\"a, b\",\"say \"\"hi\"\"\",1.5\r\n"
+					   "\"multi\nline\",,2\r\n"
+					   "plain,x,3");
+
+	gxrio::delimited_options options;
+	options.delimiter = ',';
+	options.quoted = true;
+
+	gxrio::delimited_reader csv_reader(&csv, { 0, 1, 2 }, options);
+
+	BOOST_CHECK(csv_reader.next());
+	BOOST_CHECK_EQUAL(csv_reader[2], "value");
+
+	double d;
+	BOOST_CHECK(csv_reader.next());
+	BOOST_CHECK_EQUAL(csv_reader[0], "a, b");
+	BOOST_CHECK_EQUAL(csv_reader[1], "say \"hi\"");
+	BOOST_CHECK(csv_reader.get(2, d) and d == 1.5);
+
+	BOOST_CHECK(csv_reader.next());
+	BOOST_CHECK_EQUAL(csv_reader[0], "multi\nline");
+	BOOST_CHECK(csv_reader[1].empty());
+	BOOST_CHECK_EQUAL(csv_reader[2], "2");
+
+	BOOST_CHECK(csv_reader.next());
+	BOOST_CHECK_EQUAL(csv_reader[0], "plain");
+	BOOST_CHECK_EQUAL(csv_reader[2], "3");
+
+	BOOST_CHECK(not csv_reader.next());
+	BOOST_CHECK_EQUAL(csv_reader.row(), 4);
+
+	// wide characters
+	std::wstringbuf wide(L"\"a \"\"b\"\"\",\u00e9,42\n");
+
+	gxrio::basic_delimited_reader<wchar_t, std::char_traits<wchar_t>> wide_reader(&wide, { 2, 1, 0 }, options);
+
+	int n;
+	BOOST_CHECK(wide_reader.next());
+	BOOST_CHECK(wide_reader.get(0, n) and n == 42);
+	BOOST_CHECK(wide_reader[1] == L"\u00e9");
+	BOOST_CHECK(not wide_reader.get(1, n));
+	BOOST_CHECK(wide_reader[2] == L"a \"b\"");
+	BOOST_CHECK(not wide_reader.next());
+}
+
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(t_16)
+{
+	auto dir = std::filesystem::temp_directory_path() / "gxrio-unit-test";
+	std::filesystem::create_directories(dir);
+
+	fs::path f = dir / "fast.tsv.gz";
+
+	std::string expected;
+	std::string long_text(10000, 'x');
+
+	{
+		gxrio::basic_ofstream<char, std::char_traits<char>, 4096> out(f);
+		std::stringbuf copy;
+
+		gxrio::fast_writer w(out), wc(&copy);
+
+		for (int i = 0; i < 100000; ++i)
+		{
+			w.append(i).append('\t').append(i * 0.25).append('\t').append("row\n");
+			wc.append(i).append('\t').append(i * 0.25).append('\t').append("row\n");
+			expected += std::to_string(i) + '\t';
+
+			char b[32];
+			expected.append(b, std::to_chars(b, b + sizeof(b), i * 0.25).ptr);
+			expected += "\trow\n";
+		}
+
+		w.append(long_text).append(3.14159, std::chars_format::fixed, 2).append('\n');
+		expected += long_text + "3.14\n";
+
+		BOOST_CHECK(w.flush());
+		BOOST_CHECK(wc.flush());
+		BOOST_CHECK(copy.str() + long_text + "3.14\n" == expected);
+	}
+
+	gxrio::ifstream in(f);
+	std::string result((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	BOOST_CHECK(result == expected);
+
+	// values longer than the put area of a default stream, for streambufs
+	// that pass sputn through their put area
+	gxrio::compression_options rsyncable;
+	rsyncable.rsyncable = true;
+
+	for (auto [name, options] : {
+			 std::make_pair("fast-rsyncable.gz", rsyncable),
+#if HAVE_Brotli
+			 std::make_pair("fast.br", gxrio::compression_options{}),
+#endif
+			 std::make_pair("fast.gz", gxrio::compression_options{}) })
+	{
+		{
+			gxrio::ofstream out(dir / name, options);
+			gxrio::fast_writer w(out);
+
+			w.append("abc\n").append(1e300, std::chars_format::fixed, 2).append("\nxyz\n");
+			BOOST_CHECK(w.flush());
+		}
+
+		char b[512];
+		auto e = std::to_chars(b, b + sizeof(b), 1e300, std::chars_format::fixed, 2).ptr;
+
+		gxrio::ifstream in2(dir / name);
+		std::string result2((std::istreambuf_iterator<char>(in2)), std::istreambuf_iterator<char>());
+		BOOST_CHECK(result2 == "abc\n" + std::string(b, e) + "\nxyz\n");
+	}
+
+	// wide characters
+	std::wstringbuf wide;
+	{
+		gxrio::basic_fast_writer<wchar_t, std::char_traits<wchar_t>> w(&wide);
+		w.append(L"\u00e9\t").append(L'x').append(-42).append(' ').append(0.5).append(' ').append(2.0 / 3, std::chars_format::fixed, 3);
+		BOOST_CHECK(w.flush());
+	}
+
+	BOOST_CHECK(wide.str() == L"\u00e9\tx-42 0.5 0.667");
+}
+
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(t_17)
+{
+	auto dir = std::filesystem::temp_directory_path() / "gxrio-unit-test";
+	std::filesystem::create_directories(dir);
+
+	fs::path f = dir / "parallel.txt.gz";
+
+	const int kThreads = 4, kLines = 10000;
+
+	{
+		gxrio::compression_options options;
+		options.level = 1;
+
+		gxrio::parallel_member_writer writer(f, options, 4096);
+		BOOST_REQUIRE(writer.is_open());
+
+		std::vector<std::thread> threads;
+		for (int t = 0; t < kThreads; ++t)
+		{
+			threads.emplace_back([&writer, t]
+			{
+				gxrio::parallel_member_writer::ostream out(writer);
+				for (int i = 0; i < kLines; ++i)
+					out << t << ' ' << i << '\n';
+			});
+		}
+
+		for (auto &t : threads)
+			t.join();
+
+		BOOST_CHECK(writer.close());
+	}
+
+	gxrio::ifstream in(f);
+
+	std::vector<int> next(kThreads, 0);
+	int t, i, count = 0;
+	while (in >> t >> i)
+	{
+		BOOST_REQUIRE(t >= 0 and t < kThreads);
+		BOOST_CHECK_EQUAL(i, next[t]++);
+		++count;
+	}
+
+	BOOST_CHECK_EQUAL(count, kThreads * kLines);
+
+	// nothing written should still result in a valid file
+	{
+		gxrio::parallel_member_writer writer(f);
+	}
+
+	gxrio::ifstream in2(f);
+	BOOST_CHECK(in2.is_open());
+	BOOST_CHECK(in2.get() == std::char_traits<char>::eof());
+	BOOST_CHECK(not in2.bad());
+
+	BOOST_CHECK_THROW(gxrio::parallel_member_writer(f, {}, 0), std::invalid_argument);
+}
+
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(t_18)
+{
+	auto dir = std::filesystem::temp_directory_path() / "gxrio-unit-test";
+	std::filesystem::create_directories(dir);
+
+	fs::path f = dir / "broadcast.txt.gz";
+
+	std::string text;
+	for (int i = 0; text.length() < 4 * 1024 * 1024; ++i)
+		text += "line " + std::to_string(i) + '\n';
+
+	{
+		gxrio::ofstream out(f);
+		out << text;
+	}
+
+	// a budget smaller than the file, so the reader has to wait for the slowest subscriber
+	gxrio::broadcast_reader reader(f, 512 * 1024);
+	BOOST_REQUIRE(reader.is_open());
+
+	const int kSubscribers = 3;
+
+	std::vector<std::unique_ptr<gxrio::broadcast_reader::istream>> subscribers;
+	for (int i = 0; i < kSubscribers; ++i)
+		subscribers.emplace_back(new gxrio::broadcast_reader::istream(reader));
+
+	reader.start();
+
+	std::vector<std::string> results(kSubscribers);
+	std::vector<std::thread> threads;
+
+	for (int i = 0; i < kSubscribers; ++i)
+	{
+		threads.emplace_back([i, &subscribers, &results]
+		{
+			auto &in = *subscribers[i];
+
+			std::string line;
+			while (getline(in, line))
+			{
+				results[i] += line + '\n';
+
+				// one slow subscriber
+				if (i == 0 and results[i].length() % 100000 < 10)
+					std::this_thread::sleep_for(std::chrono::microseconds(100));
+			}
+		});
+	}
+
+	for (auto &t : threads)
+		t.join();
+
+	for (auto &result : results)
+		BOOST_CHECK(result == text);
+
+	subscribers.clear();
+}
+
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(t_19)
+{
+	auto dir = std::filesystem::temp_directory_path() / "gxrio-unit-test" / "partitions";
+	std::filesystem::create_directories(dir);
+
+	const size_t kPartitions = 64;
+
+	std::vector<fs::path> files;
+	for (size_t i = 0; i < kPartitions; ++i)
+		files.emplace_back(dir / ("part-" + std::to_string(i) + (i % 2 ? ".gz" : ".xz")));
+
+	gxrio::partition_options options;
+	options.compression.level = 1;
+	options.batch_size = 16 * 1024;
+	options.memory_budget = 256 * 1024;
+	options.threads = 2;
+
+	std::vector<std::string> expected(kPartitions);
+
+	{
+		gxrio::partitioned_writer writer(files, options);
+
+		// the last partition stays empty
+		for (size_t i = 0; i < 200000; ++i)
+		{
+			auto p = (i * 7919) % (kPartitions - 1);
+			auto record = "record " + std::to_string(i) + '\n';
+			BOOST_REQUIRE(writer.write(p, record));
+			expected[p] += record;
+		}
+
+		BOOST_CHECK(writer.close());
+	}
+
+	for (size_t i = 0; i < kPartitions; ++i)
+	{
+		gxrio::ifstream in(files[i]);
+		BOOST_REQUIRE(in.is_open());
+		std::string result((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		BOOST_CHECK(result == expected[i]);
+	}
+}
+
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(t_20)
+{
+	auto file = std::filesystem::temp_directory_path() / "gxrio-unit-test" / "rewind.gz";
+	std::filesystem::create_directories(file.parent_path());
+
+	std::string text;
+	for (size_t i = 0; text.length() < 4 * 1024 * 1024; ++i)
+		text += "line " + std::to_string(i) + '\n';
+
+	{
+		gxrio::ofstream out(file);
+		out << text;
+	}
+
+	gxrio::ifstream in;
+	in.set_history(1024 * 1024);
+	in.open(file);
+	BOOST_REQUIRE(in.is_open());
+
+	std::string buffer(100000, 0);
+	BOOST_REQUIRE(in.read(buffer.data(), buffer.length()));
+	BOOST_CHECK(buffer == text.substr(0, 100000));
+	BOOST_CHECK_EQUAL(in.tellg(), 100000);
+
+	// back to the start and read again
+	BOOST_REQUIRE(in.seekg(1000));
+	BOOST_REQUIRE(in.read(buffer.data(), 5000));
+	BOOST_CHECK(buffer.substr(0, 5000) == text.substr(1000, 5000));
+
+	BOOST_REQUIRE(in.seekg(-5, std::ios_base::cur));
+	BOOST_CHECK_EQUAL(in.tellg(), 5995);
+	BOOST_CHECK_EQUAL(in.get(), text[5995]);
+
+	// forward seeks read ahead
+	BOOST_REQUIRE(in.seekg(3 * 1024 * 1024));
+	BOOST_REQUIRE(in.read(buffer.data(), 100));
+	BOOST_CHECK(buffer.substr(0, 100) == text.substr(3 * 1024 * 1024, 100));
+
+	// within the history
+	BOOST_REQUIRE(in.seekg(3 * 1024 * 1024 - 512 * 1024));
+	BOOST_REQUIRE(in.read(buffer.data(), 100));
+	BOOST_CHECK(buffer.substr(0, 100) == text.substr(3 * 1024 * 1024 - 512 * 1024, 100));
+
+	// before the history
+	BOOST_CHECK(not in.seekg(1000));
+	in.clear();
+
+	BOOST_CHECK(not in.seekg(0, std::ios_base::end));
+
+	// changing the history of an open stream keeps the data read ahead
+	{
+		std::ofstream plain(file.parent_path() / "rewind.txt");
+		plain << text;
+	}
+
+	for (auto f : { file, file.parent_path() / "rewind.txt" })
+	{
+		for (size_t history : { 4096, 0 })
+		{
+			gxrio::ifstream in2;
+			in2.set_history(1024);
+			in2.open(f);
+
+			std::string line;
+			BOOST_REQUIRE(std::getline(in2, line));
+
+			in2.set_history(history);
+			std::string rest((std::istreambuf_iterator<char>(in2)), std::istreambuf_iterator<char>());
+			BOOST_CHECK(line + '\n' + rest == text);
+		}
+	}
+}
+
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(t_21)
+{
+	auto dir = std::filesystem::temp_directory_path() / "gxrio-unit-test";
+	std::filesystem::create_directories(dir);
+
+	auto key = [](size_t i)
+	{
+		auto s = std::to_string(i);
+		return "key-" + std::string(8 - s.length(), '0') + s;
+	};
+
+	// every other key, so lookups of missing keys can be tested as well
+	std::string text;
+	for (size_t i = 0; i < 400000; i += 2)
+		text += key(i) + '\t' + std::to_string(i * i) + '\n';
+
+	gxrio::compression_options xz_options;
+	xz_options.threads = 2;
+	xz_options.level = 1;
+
+	for (auto [name, options] : { std::make_pair("sorted.tsv.gz", gxrio::compression_options{}), std::make_pair("sorted.tsv.xz", xz_options) })
+	{
+		auto file = dir / name;
+		auto index = file;
+		index += ".gxi";
+		std::filesystem::remove(index);
+
+		{
+			gxrio::ofstream out(file, options);
+			out << text;
+		}
+
+		for (int pass = 0; pass < 2; ++pass)
+		{
+			gxrio::sorted_index_options index_options;
+			index_options.span = 64 * 1024;
+
+			gxrio::sorted_index ix(file, index_options);
+			BOOST_REQUIRE(ix);
+			BOOST_CHECK(std::filesystem::exists(index));
+
+			if (file.extension() == ".gz")
+				BOOST_CHECK_GT(ix.size(), 10);
+
+			for (size_t i : { 0, 2, 1000, 123456, 250000, 399998 })
+			{
+				auto line = ix.find(key(i));
+				BOOST_REQUIRE(line);
+				BOOST_CHECK_EQUAL(*line, key(i) + '\t' + std::to_string(i * i));
+			}
+
+			for (size_t i : { 1, 1001, 399999, 500000 })
+				BOOST_CHECK(not ix.find(key(i)));
+		}
+
+		// a truncated index is built again
+		std::filesystem::resize_file(index, std::filesystem::file_size(index) - 1);
+		BOOST_CHECK_EQUAL(gxrio::sorted_lookup(file, key(399998)).value_or(""), key(399998) + '\t' + std::to_string(399998ULL * 399998));
+
+		BOOST_CHECK(not gxrio::sorted_lookup(file, "a"));
+		BOOST_CHECK_EQUAL(gxrio::sorted_lookup(file, key(77776)).value_or(""), key(77776) + '\t' + std::to_string(77776ULL * 77776));
+	}
+}
+
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(t_22)
+{
+	auto dir = std::filesystem::temp_directory_path() / "gxrio-unit-test";
+	std::filesystem::create_directories(dir);
+
+	std::mt19937_64 rng(42);
+
+	std::string day_1, day_2;
+	for (size_t i = 0; i < 20000; ++i)
+	{
+		auto line = std::to_string(i) + '\t' + std::to_string(rng()) + '\t' + std::to_string(rng()) + '\n';
+		day_1 += line;
+		day_2 += (i % 50 == 7) ? std::to_string(i) + "\tchanged\n" : line;
+	}
+
+	auto reference = std::make_shared<const std::string>(day_1);
+
+	gxrio::compression_options options;
+	options.level = 4;
+	options.reference = reference;
+
+	{
+		gxrio::ofstream out(dir / "day-2.tsv.xz", options);
+		out << day_2;
+
+		gxrio::ofstream out_ref(dir / "day-2.tsv.xzr", options);
+		out_ref << day_2;
+	}
+
+	// only the differences are stored
+	BOOST_CHECK_LT(std::filesystem::file_size(dir / "day-2.tsv.xzr") * 10, std::filesystem::file_size(dir / "day-2.tsv.xz"));
+
+	{
+		gxrio::ifstream in;
+		in.set_reference(reference);
+		in.open(dir / "day-2.tsv.xzr");
+		BOOST_REQUIRE(in.is_open());
+
+		std::string result((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		BOOST_CHECK(result == day_2);
+	}
+
+	// the wrong reference is reported
+	{
+		gxrio::ifstream in;
+		in.set_reference(std::make_shared<const std::string>(day_2));
+		in.open(dir / "day-2.tsv.xzr");
+		in.exceptions(std::ios::badbit);
+
+		BOOST_CHECK_THROW(in.get(), gxrio::reference_mismatch);
+	}
+
+	// as is a missing reference
+	{
+		gxrio::ifstream in(dir / "day-2.tsv.xzr");
+		BOOST_REQUIRE(in.is_open());
+
+		std::string line;
+		BOOST_CHECK(not std::getline(in, line));
+		BOOST_CHECK(in.bad());
+	}
+}
+
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(t_23)
+{
+	using direction = gxrio::settings::direction;
+
+	auto dir = std::filesystem::temp_directory_path() / "gxrio-unit-test";
+	std::filesystem::create_directories(dir);
+
+	{
+		std::ofstream out(dir / "gxrio.conf");
+		out << "# test\n"
+			<< "gzip.read.buffer_size = 65536\n"
+			<< "xz.write.threads=2\n"
+			<< "xz.write.buffer_size = 4096\n"
+			<< "garbage\n"
+			<< "xz.write.speed = 11\n";
+	}
+
+	gxrio::settings s;
+	BOOST_REQUIRE(s.load(dir / "gxrio.conf"));
+	BOOST_CHECK_EQUAL(s.get("gzip", direction::read).buffer_size, 65536);
+	BOOST_CHECK_EQUAL(s.get("gzip", direction::write).buffer_size, 0);
+	BOOST_CHECK_EQUAL(s.get("xz", direction::write).threads, 2);
+	BOOST_CHECK_EQUAL(s.get("xz", direction::write).buffer_size, 4096);
+
+	BOOST_REQUIRE(s.save(dir / "gxrio-2.conf"));
+
+	gxrio::settings s2;
+	BOOST_REQUIRE(s2.load(dir / "gxrio-2.conf"));
+	BOOST_CHECK_EQUAL(s2.get("xz", direction::write).threads, 2);
+	BOOST_CHECK_EQUAL(s2.get("gzip", direction::read).buffer_size, 65536);
+
+	// streams pick up the defaults
+	auto saved = gxrio::settings::defaults();
+	gxrio::settings::defaults() = s;
+
+	std::string text;
+	for (size_t i = 0; i < 100000; ++i)
+		text += "line " + std::to_string(i) + '\n';
+
+	for (auto name : { "settings.gz", "settings.xz", "settings.txt" })
+	{
+		{
+			gxrio::ofstream out(dir / name);
+			out << text;
+		}
+
+		gxrio::ifstream in(dir / name);
+		std::string result((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		BOOST_CHECK(result == text);
+	}
+
+	gxrio::settings::defaults() = saved;
+}
+
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(t_24)
+{
+	auto dir = std::filesystem::temp_directory_path() / "gxrio-unit-test";
+	std::filesystem::create_directories(dir);
+
+	std::string text;
+	for (size_t i = 0; i < 100000; ++i)
+		text += "line " + std::to_string(i) + '\n';
+
+	std::vector<std::filesystem::path> files{ dir / "async-1.xz", dir / "async-2.gz", dir / "async-3.txt", dir / "async-4.xz" };
+	std::vector<std::future<bool>> closing;
+
+	gxrio::ofstream out;
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		out.open(files[i]);
+		BOOST_REQUIRE(out.is_open());
+		out << text << i << '\n';
+		closing.emplace_back(out.close_async(i % 2 == 0));
+		BOOST_CHECK(not out.is_open());
+	}
+
+	// the stream is still buffered after close_async
+	out.open(dir / "async-5.txt");
+	out << "abc";
+	BOOST_CHECK_EQUAL(std::filesystem::file_size(dir / "async-5.txt"), 0U);
+	out.close();
+	BOOST_CHECK_EQUAL(std::filesystem::file_size(dir / "async-5.txt"), 3U);
+
+	for (auto &f : closing)
+		BOOST_CHECK(f.get());
+
+	// finishing the compressed data fails, the file itself is unbuffered and
+	// has nothing left to write when it is closed
+	if (std::filesystem::exists("/dev/full"))
+	{
+		auto saved = gxrio::settings::defaults();
+		gxrio::settings::defaults().set("gzip", gxrio::settings::direction::write, { 1, 0 });
+
+		std::filesystem::remove(dir / "full.gz");
+		std::filesystem::create_symlink("/dev/full", dir / "full.gz");
+
+		out.open(dir / "full.gz");
+		BOOST_REQUIRE(out.is_open());
+		out << "abc";
+		BOOST_CHECK(not out.close_async().get());
+
+		gxrio::settings::defaults() = saved;
+	}
+
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		gxrio::ifstream in(files[i]);
+		std::string result((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		BOOST_CHECK(result == text + std::to_string(i) + '\n');
+	}
+}
+
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(t_25)
+{
+	auto dir = std::filesystem::temp_directory_path() / "gxrio-unit-test";
+	std::filesystem::create_directories(dir);
+
+	std::mt19937 rng(25);
+	std::string text(8 * 1024 * 1024 + 17, 0);
+	for (auto &ch : text)
+		ch = "acgt\n"[rng() % 5];
+
+	gxrio::compression_options options;
+	options.level = 1;
+
+	for (auto name : { "large.gz", "large.xz" })
+	{
+		{
+			gxrio::ofstream out(dir / name, options);
+			out.write(text.data(), 3);
+			out.write(text.data() + 3, text.size() - 3);
+			BOOST_CHECK(out.good());
+		}
+
+		gxrio::ifstream in(dir / name);
+		std::string result(text.size(), 0);
+		in.read(result.data(), 5);
+		in.read(result.data() + 5, result.size() - 5);
+		BOOST_CHECK_EQUAL(in.gcount(), static_cast<std::streamsize>(result.size() - 5));
+		BOOST_CHECK(result == text);
+		BOOST_CHECK(in.get() == std::char_traits<char>::eof());
+	}
+}
+
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(t_26)
+{
+	auto dir = std::filesystem::temp_directory_path() / "gxrio-unit-test";
+	std::filesystem::create_directories(dir);
+
+	gxrio::gzip_header header;
+	header.name = "original.txt";
+	header.comment = "a comment";
+	header.extra = std::string("GX\x04\0size", 10);
+	header.mtime = 1700000000;
+	header.os = 3;
+
+	std::string text = "The quick brown fox jumps over the lazy dog\n";
+
+	{
+		gxrio::ofstream out(dir / "header.gz");
+		BOOST_CHECK(out.set_gzip_header(header));
+		out << text;
+	}
+
+	{
+		// too late once data was compressed
+		gxrio::ofstream out(dir / "late.gz");
+		out << std::string(1024 * 1024, 'x');
+		BOOST_CHECK(not out.set_gzip_header(header));
+	}
+
+	gxrio::ifstream in(dir / "header.gz");
+	auto h = in.get_gzip_header();
+	BOOST_REQUIRE(h.has_value());
+	BOOST_CHECK_EQUAL(h->name, header.name);
+	BOOST_CHECK_EQUAL(h->comment, header.comment);
+	BOOST_CHECK(h->extra == header.extra);
+	BOOST_CHECK_EQUAL(h->mtime, header.mtime);
+	BOOST_CHECK_EQUAL(h->os, header.os);
+
+	std::string result((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	BOOST_CHECK(result == text);
+
+	// without a header set, nothing is stored
+	{
+		gxrio::ofstream out(dir / "no-header.gz");
+		out << text;
+	}
+
+	gxrio::ifstream in2(dir / "no-header.gz");
+	BOOST_CHECK(std::getline(in2, result));
+	h = in2.get_gzip_header();
+	BOOST_REQUIRE(h.has_value());
+	BOOST_CHECK(h->name.empty() and h->comment.empty() and h->extra.empty());
+	BOOST_CHECK_EQUAL(h->mtime, 0U);
+
+#if HAVE_LibLZMA
+	{
+		gxrio::ofstream out(dir / "header.xz");
+		BOOST_CHECK(not out.set_gzip_header(header));
+		out << text;
+	}
+
+	gxrio::ifstream in3(dir / "header.xz");
+	BOOST_CHECK(not in3.get_gzip_header().has_value());
+#endif
+}
+
+// --------------------------------------------------------------------
+
+#if HAVE_LibLZMA
+BOOST_AUTO_TEST_CASE(t_27)
+{
+	auto dir = std::filesystem::temp_directory_path() / "gxrio-unit-test";
+	std::filesystem::create_directories(dir);
+
+	gxrio::compression_options options;
+	options.level = 1;
+
+	// concatenate a number of xz streams, with stream padding in between
+	std::string text, concatenated;
+	for (int i = 0; i < 5; ++i)
+	{
+		std::string shard;
+		for (int j = 0; j < 20000 * (i + 1); ++j)
+			shard += "shard " + std::to_string(i) + " line " + std::to_string(j) + '\n';
+
+		std::ostringstream s;
+		{
+			gxrio::ofstream out(dir / "shard.xz", options);
+			out << shard;
+		}
+
+		std::ifstream in(dir / "shard.xz", std::ios::binary);
+		s << in.rdbuf();
+
+		concatenated += s.str();
+		if (i == 2)
+			concatenated.append(8, '\0');
+		text += shard;
+	}
+
+	{
+		std::ofstream out(dir / "concatenated.xz", std::ios::binary);
+		out << concatenated;
+	}
+
+	auto saved = gxrio::settings::defaults();
+
+	for (unsigned threads : { 1, 3 })
+	{
+		gxrio::settings::defaults().set("xz", gxrio::settings::direction::read, { 0, threads });
+
+		gxrio::ifstream in(dir / "concatenated.xz");
+		std::string result((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		BOOST_CHECK(result == text);
+
+		// moved while reading
+		gxrio::ifstream in2(dir / "concatenated.xz");
+		std::string line;
+		BOOST_CHECK(std::getline(in2, line));
+		gxrio::ifstream in3(std::move(in2));
+		result = line + '\n' + std::string((std::istreambuf_iterator<char>(in3)), std::istreambuf_iterator<char>());
+		BOOST_CHECK(result == text);
+
+		// the limits are checked before a stream is decoded
+		gxrio::decompression_limits limits;
+		limits.max_output = text.length() / 2;
+
+		gxrio::ifstream in4(dir / "concatenated.xz", limits);
+		in4.exceptions(std::ios::badbit);
+
+		result.clear();
+		try
+		{
+			for (char ch; in4.get(ch);)
+				result += ch;
+			BOOST_FAIL("Expected a limit_exceeded exception");
+		}
+		catch (const gxrio::limit_exceeded &ex)
+		{
+			BOOST_CHECK(ex.type() == gxrio::limit_exceeded::limit_type::output);
+		}
+
+		BOOST_CHECK_LE(result.length(), limits.max_output);
+		BOOST_CHECK(text.compare(0, result.length(), result) == 0);
+	}
+
+	gxrio::settings::defaults() = saved;
+}
+#endif
+
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(t_28)
+{
+	auto dir = std::filesystem::temp_directory_path() / "gxrio-unit-test";
+	std::filesystem::create_directories(dir);
+
+	std::string large(20000, 'L');
+
+	std::vector<std::string> keys, values;
+	for (size_t i = 0; i < 2000; ++i)
+	{
+		keys.push_back("key-" + std::to_string(i));
+		values.push_back(i % 500 == 0 ? large : "value " + std::to_string(i * i));
+	}
+
+	std::string text;
+	for (size_t i = 0; i < keys.size(); ++i)
+		text += keys[i] + '\t' + values[i] + '\n';
+
+	gxrio::compression_options rsyncable;
+	rsyncable.rsyncable = true;
+
+	for (auto [name, options] : {
+			 std::make_pair("gather.gz", gxrio::compression_options{}),
+			 std::make_pair("gather-rsyncable.gz", rsyncable),
+#if HAVE_LibLZMA
+			 std::make_pair("gather.xz", gxrio::compression_options{}),
+#endif
+			 std::make_pair("gather.txt", gxrio::compression_options{}) })
+	{
+		{
+			gxrio::ofstream out(dir / name, options);
+
+			// one record per call, then batches of 100 records
+			std::vector<std::string_view> batch;
+			for (size_t i = 0; i < keys.size(); ++i)
+			{
+				if (i < 100)
+				{
+					out.write_gather({ keys[i], "\t", values[i], "\n" });
+					continue;
+				}
+
+				batch.insert(batch.end(), { keys[i], "\t", values[i], "\n" });
+				if (batch.size() == 400 or i + 1 == keys.size())
+				{
+					out.write_gather(batch.data(), batch.size());
+					batch.clear();
+				}
+			}
+
+			BOOST_CHECK(out.good());
+		}
+
+		gxrio::ifstream in(dir / name);
+		std::string result((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		BOOST_CHECK(result == text);
+	}
+}
@@ -0,0 +1,105 @@
+//          Copyright Maarten L. Hekkelman, 2022
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// gxcat, write the decompressed contents of files to stdout
+//
+// The compression format is sniffed from the data, so gzip, xz and
+// uncompressed files can be mixed. Without arguments, or when a
+// file is named '-', stdin is read.
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include <gxrio.hpp>
+
+const size_t kBufferSize = 128 * 1024;
+
+using istream_type = gxrio::basic_istream<char, std::char_traits<char>, kBufferSize>;
+
+bool cat(std::streambuf *sb, const char *name)
+{
+	istream_type in(sb);
+	if (not in)
+	{
+		std::cerr << "gxcat: " << name << ": not a valid compressed file" << std::endl;
+		return false;
+	}
+
+	in.exceptions(std::ios_base::badbit);
+
+	gxrio::view_reader reader(in.rdbuf());
+
+	for (;;)
+	{
+		auto data = reader.peek();
+		if (data.empty())
+			break;
+
+		if (std::fwrite(data.data(), 1, data.size(), stdout) != data.size())
+		{
+			std::cerr << "gxcat: error writing output: " << std::strerror(errno) << std::endl;
+			return false;
+		}
+
+		reader.consume(data.size());
+	}
+
+	return true;
+}
+
+int main(int argc, char *const argv[])
+{
+	std::ios_base::sync_with_stdio(false);
+
+#if defined(_WIN32)
+	_setmode(_fileno(stdin), _O_BINARY);
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+	int result = 0;
+
+	try
+	{
+		if (argc == 1)
+			result = cat(std::cin.rdbuf(), "stdin") ? 0 : 1;
+
+		for (int i = 1; i < argc; ++i)
+		{
+			if (std::strcmp(argv[i], "-") == 0)
+			{
+				if (not cat(std::cin.rdbuf(), "stdin"))
+					result = 1;
+				continue;
+			}
+
+			std::filebuf fb;
+			if (not fb.open(argv[i], std::ios_base::in | std::ios_base::binary))
+			{
+				std::cerr << "gxcat: " << argv[i] << ": " << std::strerror(errno) << std::endl;
+				result = 1;
+				continue;
+			}
+
+			if (not cat(&fb, argv[i]))
+				result = 1;
+		}
+	}
+	catch (const std::exception &ex)
+	{
+		std::cerr << "gxcat: " << ex.what() << std::endl;
+		result = 1;
+	}
+
+	if (std::fflush(stdout) != 0)
+		result = 1;
+
+	return result;
+}
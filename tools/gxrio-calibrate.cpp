@@ -0,0 +1,231 @@
+//          Copyright Maarten L. Hekkelman, 2022
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// gxrio-calibrate, find the best settings for gxrio streams on this machine
+//
+// usage: gxrio-calibrate [-s size] [-l level] [-o file]
+//
+// Test data of size megabytes, 8 by default, is generated and written and
+// read using gxrio streams for each codec, with various file buffer sizes
+// and, for xz, thread counts. The fastest settings are written to file, or
+// when -o is not given to the file named by the GXRIO_CONFIG environment
+// variable or gxrio.conf. Set GXRIO_CONFIG to this file to have gxrio
+// streams use the settings as their defaults.
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gxrio.hpp>
+
+namespace fs = std::filesystem;
+
+const size_t kBufferSizes[] = { 4 * 1024, 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024 };
+
+// --------------------------------------------------------------------
+
+void usage()
+{
+	std::cerr << "usage: gxrio-calibrate [-s size] [-l level] [-o file]" << std::endl;
+	exit(1);
+}
+
+/// Generate tab separated text that compresses like real data
+std::string make_data(size_t size)
+{
+	const char *words[] = { "alpha", "beta", "gamma", "delta", "epsilon", "zeta", "eta", "theta" };
+
+	std::mt19937 rng(1);
+	std::string result;
+	result.reserve(size + 128);
+
+	for (size_t line = 0; result.size() < size; ++line)
+	{
+		result += std::to_string(line);
+		result += '\t';
+		result += words[rng() % 8];
+		result += '\t';
+		result += std::to_string(rng() % 100000);
+		result += '\t';
+		result += std::to_string(rng());
+		result += '\n';
+	}
+
+	return result;
+}
+
+/// Time writing \a data to \a file
+double time_write(const fs::path &file, const std::string &data, const gxrio::compression_options &options)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	{
+		gxrio::ofstream out(file, options);
+		out.write(data.data(), data.size());
+	}
+
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/// Time reading \a file, the best of two runs
+double time_read(const fs::path &file)
+{
+	double result = 0;
+	std::vector<char> buffer(64 * 1024);
+
+	for (int run = 0; run < 2; ++run)
+	{
+		auto start = std::chrono::steady_clock::now();
+
+		gxrio::ifstream in(file);
+		while (in.read(buffer.data(), buffer.size()) or in.gcount() > 0)
+			;
+
+		double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (run == 0 or t < result)
+			result = t;
+	}
+
+	return result;
+}
+
+/// Find the fastest settings for the codec \a name, writing files with extension \a ext
+void calibrate(const std::string &name, const std::string &ext, const std::string &data, gxrio::compression_options options, gxrio::settings &result)
+{
+	using direction = gxrio::settings::direction;
+
+	auto &defaults = gxrio::settings::defaults();
+	auto file = fs::temp_directory_path() / ("gxrio-calibrate" + ext);
+
+	gxrio::settings::values write, read;
+	double best;
+
+	if (name == "xz")
+	{
+		best = 0;
+		for (unsigned threads = 1; threads <= std::max(1U, std::thread::hardware_concurrency()); threads *= 2)
+		{
+			options.threads = threads;
+			auto t = time_write(file, data, options);
+			if (best == 0 or t < best)
+			{
+				best = t;
+				write.threads = threads;
+			}
+		}
+		options.threads = write.threads;
+	}
+
+	best = 0;
+	for (auto size : kBufferSizes)
+	{
+		defaults.set(name, direction::write, { size, 0 });
+		auto t = time_write(file, data, options);
+		if (best == 0 or t < best)
+		{
+			best = t;
+			write.buffer_size = size;
+		}
+	}
+
+	double write_time = best;
+
+	// the file is written again with the best settings
+	defaults.set(name, direction::write, write);
+	time_write(file, data, options);
+
+	best = 0;
+	for (auto size : kBufferSizes)
+	{
+		defaults.set(name, direction::read, { size, 0 });
+		auto t = time_read(file);
+		if (best == 0 or t < best)
+		{
+			best = t;
+			read.buffer_size = size;
+		}
+	}
+
+	result.set(name, direction::write, write);
+	result.set(name, direction::read, read);
+
+	auto mb = data.size() / (1024.0 * 1024);
+
+	std::cout << std::left << std::setw(8) << name << std::right << std::fixed << std::setprecision(1)
+			  << " write: " << std::setw(7) << mb / write_time << " MB/s, buffer " << std::setw(7) << write.buffer_size;
+	if (write.threads)
+		std::cout << ", " << write.threads << " thread(s)";
+	std::cout << std::endl
+			  << std::setw(8) << ""
+			  << "  read: " << std::setw(7) << mb / best << " MB/s, buffer " << std::setw(7) << read.buffer_size << std::endl;
+
+	fs::remove(file);
+}
+
+// --------------------------------------------------------------------
+
+int main(int argc, char *const argv[])
+{
+	size_t size = 8;
+	gxrio::compression_options options;
+	options.level = 6;
+
+	fs::path output = "gxrio.conf";
+	if (auto env = std::getenv("GXRIO_CONFIG"); env != nullptr and *env != 0)
+		output = env;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+
+		if (arg == "-s" and i + 1 < argc)
+			size = std::stoul(argv[++i]);
+		else if (arg == "-l" and i + 1 < argc)
+			options.level = std::stoi(argv[++i]);
+		else if (arg == "-o" and i + 1 < argc)
+			output = argv[++i];
+		else
+			usage();
+	}
+
+	try
+	{
+		// start from the library defaults, not from a previous calibration
+		gxrio::settings::defaults() = gxrio::settings{};
+
+		auto data = make_data(size * 1024 * 1024);
+
+		gxrio::settings result;
+
+		calibrate("none", ".tsv", data, options, result);
+		calibrate("gzip", ".gz", data, options, result);
+#if HAVE_LibLZMA
+		calibrate("xz", ".xz", data, options, result);
+#endif
+#if HAVE_Brotli
+		calibrate("brotli", ".br", data, options, result);
+#endif
+
+		if (not result.save(output))
+		{
+			std::cerr << "gxrio-calibrate: could not write " << output.string() << std::endl;
+			return 1;
+		}
+
+		std::cout << "Settings written to " << output.string() << std::endl;
+	}
+	catch (const std::exception &ex)
+	{
+		std::cerr << "gxrio-calibrate: " << ex.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
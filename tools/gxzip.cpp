@@ -0,0 +1,272 @@
+//          Copyright Maarten L. Hekkelman, 2022
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// gxzip, compress files using gzip or xz
+//
+// usage: gxzip [-1..-9] [-T threads] [-F gz|xz] [-c] [-k] [--rsyncable] [file...]
+//
+// Like gzip, each file is replaced by a compressed version with the
+// extension .gz or .xz, unless -k is given. With -c or when no files are
+// specified, the output is written to stdout.
+//
+// With more than one thread, xz uses its multithreaded encoder and gzip
+// data is compressed in blocks in parallel, each block written as an
+// independent gzip member. The result is a valid gzip file that can be
+// read by any gzip implementation.
+//
+// --rsyncable makes gzip output friendly for rsync and deduplication.
+
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include <gxrio.hpp>
+
+namespace fs = std::filesystem;
+
+const size_t kBufferSize = 128 * 1024;
+const size_t kBlockSize = 1024 * 1024;
+
+using traits_type = std::char_traits<char>;
+
+// --------------------------------------------------------------------
+
+struct config
+{
+	gxrio::compression_options options;
+	std::string format = "gz";
+	bool to_stdout = false;
+	bool keep = false;
+};
+
+void usage()
+{
+	std::cerr << "usage: gxzip [-1..-9] [-T threads] [-F gz|xz] [-c] [-k] [--rsyncable] [file...]" << std::endl;
+	exit(1);
+}
+
+// --------------------------------------------------------------------
+
+/// Compress a single block into a complete gzip member
+std::string compress_block(std::string block, const gxrio::compression_options &options)
+{
+	std::stringbuf out;
+
+	gxrio::basic_ogzip_streambuf<char, traits_type, kBufferSize> z;
+	z.set_options(options);
+	z.init(&out);
+	z.sputn(block.data(), block.size());
+	z.close();
+
+	return std::move(out).str();
+}
+
+/// Compress the data in \a in into \a out using multiple threads
+bool compress_parallel_gzip(std::streambuf *in, std::streambuf *out, const config &cfg)
+{
+	gxrio::thread_pool pool(cfg.options.threads);
+
+	std::deque<std::future<std::string>> pending;
+	size_t block_count = 0;
+
+	auto write_front = [&pending, out]()
+	{
+		auto block = pending.front().get();
+		pending.pop_front();
+		return out->sputn(block.data(), block.size()) == static_cast<std::streamsize>(block.size());
+	};
+
+	for (;;)
+	{
+		std::string block(kBlockSize, 0);
+		block.resize(in->sgetn(block.data(), block.size()));
+
+		if (block.empty())
+			break;
+
+		auto task = std::make_shared<std::packaged_task<std::string()>>(
+			[block = std::move(block), options = cfg.options]() mutable
+			{ return compress_block(std::move(block), options); });
+
+		pending.emplace_back(task->get_future());
+		pool.post([task] { (*task)(); });
+		++block_count;
+
+		if (pending.size() > 2 * pool.size() and not write_front())
+			return false;
+	}
+
+	while (not pending.empty())
+	{
+		if (not write_front())
+			return false;
+	}
+
+	// An empty input still results in a valid gzip file
+	if (block_count == 0)
+	{
+		auto block = compress_block({}, cfg.options);
+		out->sputn(block.data(), block.size());
+	}
+
+	return out->pubsync() == 0;
+}
+
+/// Compress the data in \a in into \a out using a compressing streambuf
+template <typename StreamBuf>
+bool compress_stream(std::streambuf *in, std::streambuf *out, const config &cfg)
+{
+	auto z = std::make_unique<StreamBuf>();
+	z->set_options(cfg.options);
+	z->init(out);
+
+	gxrio::view_reader reader(in);
+
+	for (;;)
+	{
+		auto data = reader.peek();
+		if (data.empty())
+			break;
+
+		if (z->sputn(data.data(), data.size()) != static_cast<std::streamsize>(data.size()))
+			return false;
+
+		reader.consume(data.size());
+	}
+
+	z->close();
+
+	return out->pubsync() == 0;
+}
+
+bool compress(std::streambuf *in, std::streambuf *out, const config &cfg)
+{
+	if (cfg.format == "gz")
+	{
+		if (cfg.options.threads > 1)
+			return compress_parallel_gzip(in, out, cfg);
+		return compress_stream<gxrio::basic_ogzip_streambuf<char, traits_type, kBufferSize>>(in, out, cfg);
+	}
+
+#if HAVE_LibLZMA
+	if (cfg.format == "xz")
+		return compress_stream<gxrio::basic_oxz_streambuf<char, traits_type, kBufferSize>>(in, out, cfg);
+#endif
+
+	std::cerr << "gxzip: unsupported format " << cfg.format << std::endl;
+	return false;
+}
+
+// --------------------------------------------------------------------
+
+int main(int argc, char *const argv[])
+{
+	std::ios_base::sync_with_stdio(false);
+
+#if defined(_WIN32)
+	_setmode(_fileno(stdin), _O_BINARY);
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+	config cfg;
+	std::vector<fs::path> files;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+
+		if (arg.length() == 2 and arg[0] == '-' and arg[1] >= '0' and arg[1] <= '9')
+			cfg.options.level = arg[1] - '0';
+		else if (arg == "-T" and i + 1 < argc)
+		{
+			// -T 0 uses all cores, without -T the default from gxrio::settings is used
+			cfg.options.threads = std::stoul(argv[++i]);
+			if (cfg.options.threads == 0)
+				cfg.options.threads = std::thread::hardware_concurrency();
+		}
+		else if (arg == "-F" and i + 1 < argc)
+			cfg.format = argv[++i];
+		else if (arg == "-c")
+			cfg.to_stdout = true;
+		else if (arg == "-k")
+			cfg.keep = true;
+		else if (arg == "--rsyncable")
+			cfg.options.rsyncable = true;
+		else if (arg.length() > 1 and arg[0] == '-')
+			usage();
+		else
+			files.emplace_back(arg);
+	}
+
+	int result = 0;
+
+	try
+	{
+		if (files.empty())
+			result = compress(std::cin.rdbuf(), std::cout.rdbuf(), cfg) ? 0 : 1;
+
+		for (auto &file : files)
+		{
+			std::filebuf in;
+			if (not in.open(file, std::ios_base::in | std::ios_base::binary))
+			{
+				std::cerr << "gxzip: " << file << ": " << std::strerror(errno) << std::endl;
+				result = 1;
+				continue;
+			}
+
+			if (cfg.to_stdout)
+			{
+				if (not compress(&in, std::cout.rdbuf(), cfg))
+					result = 1;
+				continue;
+			}
+
+			fs::path out_file = file;
+			out_file += "." + cfg.format;
+
+			std::filebuf out;
+			if (not out.open(out_file, std::ios_base::out | std::ios_base::trunc | std::ios_base::binary))
+			{
+				std::cerr << "gxzip: " << out_file << ": " << std::strerror(errno) << std::endl;
+				result = 1;
+				continue;
+			}
+
+			bool ok = compress(&in, &out, cfg);
+
+			if (not out.close())
+				ok = false;
+
+			if (not ok)
+			{
+				std::cerr << "gxzip: error compressing " << file << std::endl;
+				fs::remove(out_file);
+				result = 1;
+				continue;
+			}
+
+			in.close();
+
+			if (not cfg.keep)
+				fs::remove(file);
+		}
+	}
+	catch (const std::exception &ex)
+	{
+		std::cerr << "gxzip: " << ex.what() << std::endl;
+		result = 1;
+	}
+
+	return result;
+}